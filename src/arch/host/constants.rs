@@ -23,7 +23,9 @@
 //! Platform definition for the stm32f401re
 
 use flash::SectorInfo;
-use {flash, fs};
+use std::env;
+use std::path::Path;
+use {flash, flash_ll, fs};
 
 // Semantically this is a 0x80000-aligned 0x80000 byte array (but a more-than-0x8000-aligned type
 // appears to not be supported)
@@ -123,17 +125,20 @@ pub static SECTORS: [(usize, usize); 8] = [
 /// Number of buckets for the flash lock hashset
 pub const FLASH_LOCK_BUCKETS: usize = 16;
 
+/// Environment variable naming a flash image file to use instead of the built-in flash
+pub const FLASH_IMAGE_VAR: &str = "JAVACARD_FLASH_IMAGE";
+
 /// Get the flash sectors list
+///
+/// If `FLASH_IMAGE_VAR` is set, the flash image it names is mapped first (cut along `SECTORS`),
+/// so that the flash contents persist across runs.
 pub fn flash_sectors() -> Vec<SectorInfo> {
-    SECTORS
-        .iter()
-        .enumerate()
-        .map(|(i, &(begin, size))| SectorInfo {
-            num: i as u32,
-            start: unsafe { (&mut FLASH.get_mut()[0] as *mut _ as *mut u8).offset(begin as isize) },
-            length: size,
-        })
-        .collect()
+    if let Some(path) = env::var_os(FLASH_IMAGE_VAR) {
+        if !flash_ll::image_mapped() {
+            flash_ll::map_image(Path::new(&path), &SECTORS).expect("Unable to map the flash image");
+        }
+    }
+    flash_ll::sectors()
 }
 
 /// Flash program sector
@@ -154,6 +159,15 @@ pub const FLASH_DEFRAG_SECTOR: fs::SectorID = fs::SectorID(5); // Reserve sector
 /// The sector where applet are stored.
 pub const FLASH_APPLET_SECTOR: fs::SectorID = fs::SectorID(4); // Reserve sector 5 as applet sector
 
+/// Default roles of the flash sectors
+pub const FLASH_GEOMETRY: fs::Geometry<'static> = fs::Geometry {
+    program: FLASH_PROGRAM_SECTORS,
+    sectors: FLASH_FS_SECTORS,
+    defrag: FLASH_DEFRAG_SECTOR,
+    applet: FLASH_APPLET_SECTOR,
+    index: None,
+};
+
 /// MPU sector size
 pub const MPU_SECTORS: usize = 8;
 /// MPU min size allow
@@ -161,22 +175,22 @@ pub const MPU_MIN_SIZE: usize = 32;
 
 /// Get program begin address
 pub fn program_begin() -> *const u8 {
-    (unsafe { &FLASH.get()[0] as *const u8 }).wrapping_offset(SECTORS[7].0 as isize)
+    flash_ll::sector_bounds(7).0
 }
 
 /// Get program size
 pub fn program_size() -> usize {
-    SECTORS[7].1
+    flash_ll::sector_bounds(7).1
 }
 
 /// Get applet begin adress
 pub fn applet_begin() -> *const u8 {
-    (unsafe { &FLASH.get()[0] as *const u8 }).wrapping_offset(SECTORS[5].0 as isize)
+    flash_ll::sector_bounds(5).0
 }
 
 /// Get applet size
 pub fn applet_size() -> usize {
-    SECTORS[5].1
+    flash_ll::sector_bounds(5).1
 }
 
 /// Get RAM begin address
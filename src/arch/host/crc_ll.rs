@@ -0,0 +1,78 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+//! Emulate the CRC calculation unit
+//!
+//! The CRC-32/MPEG-2 computed by the STM32 CRC unit is computed in software, four bytes at a time
+//! using slicing-by-4 tables.
+
+/// Polynomial of the CRC, in MSB-first representation
+const POLYNOMIAL: u32 = 0x04C11DB7;
+
+lazy_static! {
+    /// `TABLES[0]` is the usual byte-wise CRC table, and `TABLES[k][i]` is the CRC of byte `i`
+    /// followed by `k` null bytes
+    static ref TABLES: [[u32; 256]; 4] = {
+        let mut tables = [[0; 256]; 4];
+        for i in 0..256 {
+            let mut crc = (i as u32) << 24;
+            for _ in 0..8 {
+                crc = if crc & 0x80000000 != 0 {
+                    (crc << 1) ^ POLYNOMIAL
+                } else {
+                    crc << 1
+                };
+            }
+            tables[0][i] = crc;
+        }
+        for k in 1..4 {
+            for i in 0..256 {
+                let prev = tables[k - 1][i];
+                tables[k][i] = (prev << 8) ^ tables[0][(prev >> 24) as usize];
+            }
+        }
+        tables
+    };
+}
+
+/// Computes the CRC of `bytes`, starting from the reset value of the CRC unit
+pub fn crc32(bytes: &[u8]) -> u32 {
+    crc32_update(0xFFFFFFFF, bytes)
+}
+
+/// Continues computing a CRC whose current value is `crc` with `bytes`
+pub fn crc32_update(mut crc: u32, bytes: &[u8]) -> u32 {
+    let t = &*TABLES;
+    let mut words = bytes.chunks_exact(4);
+    for w in &mut words {
+        crc ^= (w[0] as u32) << 24 | (w[1] as u32) << 16 | (w[2] as u32) << 8 | w[3] as u32;
+        crc = t[3][(crc >> 24) as usize]
+            ^ t[2][(crc >> 16) as usize & 0xFF]
+            ^ t[1][(crc >> 8) as usize & 0xFF]
+            ^ t[0][crc as usize & 0xFF];
+    }
+    for &b in words.remainder() {
+        crc = (crc << 8) ^ t[0][((crc >> 24) as u8 ^ b) as usize];
+    }
+    crc
+}
@@ -21,25 +21,318 @@
 // THE SOFTWARE.
 
 //! Emulate flash accessors
+//!
+//! The emulated flash is the built-in `FLASH` array cut along `SECTORS`, unless a flash image file
+//! has been mapped with [`map_image`], in which case it is the image, cut along the sector table
+//! given along with it.
+//!
+//! [`map_image`]: fn.map_image.html
+//!
+//! Operations complete instantly, but the time they would take on the card is accounted in a
+//! virtual clock (see [`elapsed_ns`]), following the measures of `PERFORMANCE.md` for the current
+//! [`Parallelism`].
+//!
+//! [`elapsed_ns`]: fn.elapsed_ns.html
+//! [`Parallelism`]: enum.Parallelism.html
+//!
+//! Sectors can also wear out along a [`WearModel`], for evaluating how long the filesystem lasts.
+//!
+//! [`WearModel`]: struct.WearModel.html
 
+use libc;
 use spin::Mutex;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::fs::OpenOptions;
+use std::io;
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr;
+use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
 use {privilege, FLASH, SECTORS};
 
 /// Flash lock flag
 static LOCKED: AtomicBool = AtomicBool::new(true);
+/// Whether the emulated flash programs bytes (x8) rather than words (x32)
+static PARALLELISM_X8: AtomicBool = AtomicBool::new(false);
+/// Virtual time spent in flash operations, in nanoseconds
+static ELAPSED_NS: AtomicU64 = AtomicU64::new(0);
+/// Number of words programmed
+static PROGRAMMED_WORDS: AtomicU64 = AtomicU64::new(0);
+/// Number of sectors erased
+static ERASED_SECTORS: AtomicU64 = AtomicU64::new(0);
+
+/// Time to erase 128k of 0's, and additional time when they are all 1's, at x8 and x32
+/// parallelism (in nanoseconds, see `PERFORMANCE.md`)
+const ERASE_128K_NS: [(u64, u64); 2] = [(1_000_000_000, 1_000_000_000), (800_000_000, 200_000_000)];
+/// Time to program a 32-bit word at x8 (as 4 bytes) and x32 parallelism (in nanoseconds, from
+/// the time taken to write a whole 128k sector, see `PERFORMANCE.md`)
+const PROGRAM_WORD_NS: [u64; 2] = [1_000_000_000 / 0x8000, 350_000_000 / 0x8000];
+
+/// Error reported by `has_error` when programming a worn word failed (`FLASH_SR.PGPERR`)
+pub const WEAR_ERROR: u32 = 0x40;
+/// Whether programming a worn word failed since the last `clear_error`
+static PROGRAM_FAILED: AtomicBool = AtomicBool::new(false);
+
+/// Erase-cycle endurance model of the emulated flash
+///
+/// Each 32-bit word gets a lifetime, spread uniformly over `[endurance; endurance + spread)` erase
+/// cycles of its sector. Once its sector has been erased more times than that, one bit of the word
+/// is stuck at 0: it still reads as 0 right after an erase, and programming it to 1 fails.
+#[derive(Debug, Copy, Clone)]
+pub struct WearModel {
+    /// Erase cycles all the words withstand
+    pub endurance: u32,
+
+    /// Spread of the word lifetimes past `endurance`
+    pub spread: u32,
+
+    /// Seed picking the lifetime and the stuck bit of each word
+    pub seed: u64,
+}
+
+/// Current wear model, along with the number of erases of each sector since it was set
+static WEAR: Mutex<(Option<WearModel>, Vec<u32>)> = Mutex::new((None, Vec::new()));
+
+impl WearModel {
+    /// Returns the lifetime and the mask of the bit to be stuck of a word of a sector
+    fn fate(&self, sector: usize, word: usize) -> (u32, u32) {
+        // splitmix64
+        let mut h = self.seed ^ ((sector as u64) << 32) ^ word as u64;
+        h = h.wrapping_add(0x9E37_79B9_7F4A_7C15);
+        h = (h ^ (h >> 30)).wrapping_mul(0xBF58_476D_1CE4_E5B9);
+        h = (h ^ (h >> 27)).wrapping_mul(0x94D0_49BB_1331_11EB);
+        h ^= h >> 31;
+        let lifetime = self.endurance + (h % u64::from(self.spread.max(1))) as u32;
+        (lifetime, 1 << ((h >> 32) % 32))
+    }
+}
+
+/// Sets the wear model of the flash (`None` for a flash that never wears out), resetting the
+/// erase counts
+pub fn set_wear_model(model: Option<WearModel>) {
+    *WEAR.lock() = (model, Vec::new());
+}
+
+/// Returns the number of times a sector has been erased since the wear model was set
+pub fn erase_count(sector: usize) -> u32 {
+    WEAR.lock().1.get(sector).cloned().unwrap_or(0)
+}
+
+/// Records an erase of `sector`, and sticks the bits of its words that are now worn out
+unsafe fn wear_erase(sector: usize, start: *mut u8, size: usize) {
+    let mut wear = WEAR.lock();
+    let (ref model, ref mut erases) = *wear;
+    if erases.len() <= sector {
+        erases.resize(sector + 1, 0);
+    }
+    erases[sector] += 1;
+    if let Some(ref model) = *model {
+        if erases[sector] > model.endurance {
+            for w in 0..size / 4 {
+                let (lifetime, mask) = model.fate(sector, w);
+                if erases[sector] > lifetime {
+                    *(start as *mut u32).add(w) &= !mask;
+                }
+            }
+        }
+    }
+}
+
+/// Flags a program error if programming `val` at `addr` needs a stuck bit to be 1
+fn wear_program(addr: *mut u32, val: u32) {
+    let wear = WEAR.lock();
+    if let Some(ref model) = wear.0 {
+        for (sector, &erases) in wear.1.iter().enumerate() {
+            let (start, size) = sector_bounds(sector);
+            let offset = (addr as usize).wrapping_sub(start as usize);
+            if offset < size {
+                let (lifetime, mask) = model.fate(sector, offset / 4);
+                if erases > lifetime && val & mask != 0 {
+                    PROGRAM_FAILED.store(true, Ordering::SeqCst);
+                }
+                return;
+            }
+        }
+    }
+}
+
+/// Program parallelism of the flash, trading programming speed for the supply voltage range
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Parallelism {
+    /// Byte programs, for 1.7V and above
+    X8,
+    /// Word programs, for 2.7V and above (the one set up by the firmware)
+    X32,
+}
 /// Flash mutex simulator
 pub static FLASH_TEST_RUNNING: Mutex<()> = Mutex::new(());
 
+/// A flash image file mapped in memory
+struct Image {
+    /// Address of the first byte of the mapping
+    base: *mut u8,
+
+    /// Length of the mapping
+    size: usize,
+
+    /// Sectors of the image, as (begin, size) pairs
+    sectors: Vec<(usize, usize)>,
+}
+
+unsafe impl Send for Image {}
+
+/// Flash image currently emulating the flash, if any
+static IMAGE: Mutex<Option<Image>> = Mutex::new(None);
+
+/// Maps the flash image file at `path` in place of the built-in flash, cut along `sectors` (given
+/// as (begin, size) pairs)
+///
+/// The file is created if it doesn't exist, and grown with blank (all-`0xFF`) flash if it is too
+/// short. All writes go straight to the file, and reads are served from the mapping without any
+/// copy.
+///
+/// This must not be called while a `Flash` object exists.
+///
+/// # Errors
+///
+/// Errors if the file cannot be opened, grown or mapped.
+pub fn map_image(path: &Path, sectors: &[(usize, usize)]) -> io::Result<()> {
+    unmap_image();
+    let size = sectors.iter().map(|&(b, s)| b + s).max().unwrap_or(0);
+    let file = OpenOptions::new()
+        .read(true)
+        .write(true)
+        .create(true)
+        .open(path)?;
+    let old_len = file.metadata()?.len() as usize;
+    if old_len < size {
+        file.set_len(size as u64)?;
+    }
+    let base = unsafe {
+        libc::mmap(
+            ptr::null_mut(),
+            size,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED,
+            file.as_raw_fd(),
+            0,
+        )
+    };
+    if base == libc::MAP_FAILED {
+        return Err(io::Error::last_os_error());
+    }
+    let base = base as *mut u8;
+    for i in old_len..size {
+        // Bytes past the former end of the file are blank flash
+        unsafe { *base.add(i) = 0xFF };
+    }
+    *IMAGE.lock() = Some(Image {
+        base: base,
+        size: size,
+        sectors: sectors.to_vec(),
+    });
+    Ok(())
+}
+
+/// Writes back and unmaps the current flash image, if any, going back to the built-in flash
+///
+/// This must not be called while a `Flash` object exists.
+pub fn unmap_image() {
+    if let Some(image) = IMAGE.lock().take() {
+        unsafe {
+            libc::msync(image.base as *mut libc::c_void, image.size, libc::MS_SYNC);
+            libc::munmap(image.base as *mut libc::c_void, image.size);
+        }
+    }
+}
+
+/// Sets the parallelism the virtual clock follows (it starts at `Parallelism::X32`)
+pub fn set_parallelism(p: Parallelism) {
+    PARALLELISM_X8.store(p == Parallelism::X8, Ordering::SeqCst);
+}
+
+/// Returns the virtual time spent in flash operations so far, in nanoseconds
+pub fn elapsed_ns() -> u64 {
+    ELAPSED_NS.load(Ordering::SeqCst)
+}
+
+/// Returns the number of words programmed so far
+pub fn programmed_words() -> u64 {
+    PROGRAMMED_WORDS.load(Ordering::SeqCst)
+}
+
+/// Returns the number of sectors erased so far
+pub fn erased_sectors() -> u64 {
+    ERASED_SECTORS.load(Ordering::SeqCst)
+}
+
+/// Resets the virtual time spent in flash operations, along with the operation counters
+pub fn reset_elapsed() {
+    ELAPSED_NS.store(0, Ordering::SeqCst);
+    PROGRAMMED_WORDS.store(0, Ordering::SeqCst);
+    ERASED_SECTORS.store(0, Ordering::SeqCst);
+}
+
+/// Index of the current parallelism in the timing tables
+fn timing_index() -> usize {
+    if PARALLELISM_X8.load(Ordering::SeqCst) {
+        0
+    } else {
+        1
+    }
+}
+
+/// Accounts the virtual time of erasing `size` bytes holding `ones` bits set
+fn account_erase(size: usize, ones: u64) {
+    let (zeros_ns, ones_ns) = ERASE_128K_NS[timing_index()];
+    let ns = size as u64 * zeros_ns / 0x20000 + ones * ones_ns / (8 * 0x20000);
+    ELAPSED_NS.fetch_add(ns, Ordering::SeqCst);
+    ERASED_SECTORS.fetch_add(1, Ordering::SeqCst);
+}
+
+/// Accounts the virtual time of programming a word
+fn account_program() {
+    ELAPSED_NS.fetch_add(PROGRAM_WORD_NS[timing_index()], Ordering::SeqCst);
+    PROGRAMMED_WORDS.fetch_add(1, Ordering::SeqCst);
+}
+
+/// Returns whether a flash image is currently mapped
+pub fn image_mapped() -> bool {
+    IMAGE.lock().is_some()
+}
+
+/// Returns the address of the first byte and the length of a sector of the emulated flash
+///
+/// # Panics
+///
+/// Panics if there is no such sector.
+pub fn sector_bounds(sector: usize) -> (*mut u8, usize) {
+    match *IMAGE.lock() {
+        Some(ref image) => {
+            let (begin, size) = image.sectors[sector];
+            (image.base.wrapping_add(begin), size)
+        }
+        None => {
+            let (begin, size) = SECTORS[sector];
+            let base = unsafe { &mut FLASH.get_mut()[0] as *mut u8 };
+            (base.wrapping_add(begin), size)
+        }
+    }
+}
+
 /// Emulate flasg sectors access
 pub fn sectors() -> Vec<::flash::SectorInfo> {
-    SECTORS
-        .iter()
-        .enumerate()
-        .map(|(i, &(begin, size))| ::flash::SectorInfo {
-            num: i as u32,
-            start: unsafe { (&mut FLASH.get_mut()[0] as *mut u8).offset(begin as isize) },
-            length: size,
+    let count = match *IMAGE.lock() {
+        Some(ref image) => image.sectors.len(),
+        None => SECTORS.len(),
+    };
+    (0..count)
+        .map(|i| {
+            let (start, length) = sector_bounds(i);
+            ::flash::SectorInfo {
+                num: i as u32,
+                start: start,
+                length: length,
+            }
         })
         .collect()
 }
@@ -69,12 +362,17 @@ pub unsafe fn setup() {
 /// Emulate flash check error flag
 pub unsafe fn has_error() -> u32 {
     assert!(privilege::is_privileged());
-    0
+    if PROGRAM_FAILED.load(Ordering::SeqCst) {
+        WEAR_ERROR
+    } else {
+        0
+    }
 }
 
 /// Emulate flash clear error flag
 pub unsafe fn clear_error() {
     assert!(privilege::is_privileged());
+    PROGRAM_FAILED.store(false, Ordering::SeqCst);
 }
 
 /// Emulate flash busy flag
@@ -83,17 +381,45 @@ pub unsafe fn currently_busy() -> bool {
     false
 }
 
+/// Waits for the flash not to be busy any longer
+pub unsafe fn wait_ready() {
+    while currently_busy() {
+        // The emulated flash is never busy
+    }
+}
+
 /// Erasing flash sector
 pub unsafe fn erase(sector: u32) {
     assert!(!locked() && privilege::is_privileged());
-    let (begin, size) = SECTORS[sector as usize];
-    for i in begin..(begin + size) {
-        FLASH.get_mut()[i] = 0xFF;
-    }
+    let (start, size) = sector_bounds(sector as usize);
+    let ones = (0..size).map(|i| (*start.add(i)).count_ones() as u64).sum();
+    account_erase(size, ones);
+    ptr::write_bytes(start, 0xFF, size);
+    wear_erase(sector as usize, start, size);
 }
 
 /// Writing flash method
 pub unsafe fn write(addr: *mut u32, val: u32) {
     assert!(!locked() && privilege::is_privileged());
+    account_program();
+    wear_program(addr, val);
+    *addr &= val;
+}
+
+/// Emulate the start of a burst of programs
+pub unsafe fn begin_program() {
+    assert!(!locked() && privilege::is_privileged());
+}
+
+/// Emulate a program within a burst
+pub unsafe fn program(addr: *mut u32, val: u32) {
+    assert!(!locked() && privilege::is_privileged());
+    account_program();
+    wear_program(addr, val);
     *addr &= val;
 }
+
+/// Emulate the end of a burst of programs
+pub unsafe fn end_program() {
+    assert!(!locked() && privilege::is_privileged());
+}
@@ -0,0 +1,72 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+//! Scanning kernels for blank and erased runs of flash, using SSE2
+
+use core::arch::x86_64::{
+    __m128i, _mm_cmpeq_epi8, _mm_loadu_si128, _mm_movemask_epi8, _mm_set1_epi8,
+};
+
+/// Number of bytes compared at once
+const LANES: usize = 16;
+
+/// Returns a mask with bit `i` set if byte `i` of the 16 bytes starting at `p` is not `value`
+unsafe fn mismatches(p: *const u8, value: u8) -> u32 {
+    let chunk = _mm_loadu_si128(p as *const __m128i);
+    let eq = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(value as i8))) as u32;
+    !eq & 0xFFFF
+}
+
+/// Returns the index of the first byte of `bytes` that is not `value`, or `bytes.len()` if there
+/// is none
+pub fn find_first_not(bytes: &[u8], value: u8) -> usize {
+    let mut i = 0;
+    while i + LANES <= bytes.len() {
+        let m = unsafe { mismatches(bytes.as_ptr().add(i), value) };
+        if m != 0 {
+            return i + m.trailing_zeros() as usize;
+        }
+        i += LANES;
+    }
+    i + bytes[i..]
+        .iter()
+        .position(|&b| b != value)
+        .unwrap_or(bytes.len() - i)
+}
+
+/// Returns the index following the last byte of `bytes` that is not `value`, or `0` if there is
+/// none
+pub fn find_last_not(bytes: &[u8], value: u8) -> usize {
+    let mut end = bytes.len();
+    while end >= LANES {
+        let m = unsafe { mismatches(bytes.as_ptr().add(end - LANES), value) };
+        if m != 0 {
+            return end - LANES + 32 - m.leading_zeros() as usize;
+        }
+        end -= LANES;
+    }
+    bytes[..end]
+        .iter()
+        .rposition(|&b| b != value)
+        .map_or(0, |p| p + 1)
+}
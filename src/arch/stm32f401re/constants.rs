@@ -106,6 +106,15 @@ pub const FLASH_DEFRAG_SECTOR: fs::SectorID = fs::SectorID(5); // Reserve sector
 /// Sector reserved for applets (inside the sectors used for the filesystem)
 pub const FLASH_APPLET_SECTOR: fs::SectorID = fs::SectorID(4); // Reserve sector 5 as applet sector
 
+/// Default roles of the flash sectors
+pub const FLASH_GEOMETRY: fs::Geometry<'static> = fs::Geometry {
+    program: FLASH_PROGRAM_SECTORS,
+    sectors: FLASH_FS_SECTORS,
+    defrag: FLASH_DEFRAG_SECTOR,
+    applet: FLASH_APPLET_SECTOR,
+    index: None,
+};
+
 /// Address at the beginning of the running program
 pub const fn program_begin() -> *const u8 {
     flash_sectors()[7].start
@@ -23,6 +23,11 @@
 //! Raw instructions for performing Flash operations.
 //!
 //! No safety at all is provided, for a safe interface see `flash.rs`.
+//!
+//! Fetching instructions from the flash stalls for as long as it is busy programming or erasing.
+//! The functions waiting on such an operation are thus placed in the `.ramfunc` section, copied to
+//! RAM at boot along with `.data`, so that interrupts handlers also living in RAM can run
+//! meanwhile.
 
 use bindings::{
     FLASH_CR_PSIZE_Msk, FLASH_CR_PSIZE_Pos, FLASH_CR_SER_Msk, FLASH_CR_SNB_Msk, FLASH_CR_SNB_Pos,
@@ -81,22 +86,78 @@ pub unsafe fn currently_busy() -> bool {
     read_volatile(&(*FLASH).SR) & FLASH_SR_BSY_Msk == FLASH_SR_BSY
 }
 
-/// Erases a sector, writing all-`0xFF`'s on it
+/// Stores `val` at `addr`, starting a flash operation, then waits until the flash is not busy
+///
+/// This is written in assembly so that, once inlined in a `.ramfunc` function, no instruction gets
+/// fetched from the flash until the operation has completed (even in debug builds).
+#[inline(always)]
+unsafe fn start_and_wait(addr: *mut u32, val: u32) {
+    asm!("str $0, [$1]
+          dsb
+      1:  ldr r3, [$2]
+          tst r3, $3
+          bne 1b"
+         :: "r"(val), "r"(addr), "r"(&(*FLASH).SR as *const u32), "r"(FLASH_SR_BSY_Msk)
+         : "r3", "cc", "memory" : "volatile");
+}
+
+/// Waits for the flash not to be busy any longer, running from RAM
+#[link_section = ".ramfunc"]
+#[inline(never)]
+pub unsafe fn wait_ready() {
+    asm!("1:  ldr r3, [$0]
+          tst r3, $1
+          bne 1b"
+         :: "r"(&(*FLASH).SR as *const u32), "r"(FLASH_SR_BSY_Msk)
+         : "r3", "cc", "memory" : "volatile");
+}
+
+/// Erases a sector, writing all-`0xFF`'s on it, and returns once the erase is over
 ///
 /// Note: must be called with flash unlocked
+#[link_section = ".ramfunc"]
+#[inline(never)]
 pub unsafe fn erase(sector: u32) {
     set_bits_volatile(
         &mut (*FLASH).CR,
         FLASH_CR_SER_Msk | FLASH_CR_SNB_Msk,
         FLASH_CR_SER | (sector << FLASH_CR_SNB_Pos),
     );
-    add_bits_volatile(&mut (*FLASH).CR, FLASH_CR_STRT);
+    let cr = read_volatile(&(*FLASH).CR) | FLASH_CR_STRT;
+    start_and_wait(&mut (*FLASH).CR, cr);
 }
 
-/// Writes a 32-bits value to the flash, at address `addr`
+/// Writes a 32-bits value to the flash, at address `addr`, and returns once it is programmed
 ///
 /// Note: must be called with flash unlocked
+#[link_section = ".ramfunc"]
+#[inline(never)]
 pub unsafe fn write(addr: *mut u32, val: u32) {
     add_bits_volatile(&mut (*FLASH).CR, FLASH_CR_PG);
+    start_and_wait(addr, val);
+}
+
+/// Starts a burst of 32-bits programs (see `program()`)
+///
+/// Note: must be called with flash unlocked
+pub unsafe fn begin_program() {
+    add_bits_volatile(&mut (*FLASH).CR, FLASH_CR_PG);
+}
+
+/// Writes a 32-bits value to the flash, at address `addr`, as part of a burst started with
+/// `begin_program()`
+///
+/// No need to wait for the previous program to complete: the bus stalls on the write until the
+/// flash is ready to accept it, so that the programming unit is kept busy.
+///
+/// Note: must be called with flash unlocked
+pub unsafe fn program(addr: *mut u32, val: u32) {
     write_volatile(addr, val);
 }
+
+/// Ends a burst of 32-bits programs, once the last one has completed (see `currently_busy()`)
+///
+/// Note: must be called with flash unlocked
+pub unsafe fn end_program() {
+    set_bits_volatile(&mut (*FLASH).CR, FLASH_CR_PG, 0);
+}
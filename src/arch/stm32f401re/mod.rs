@@ -49,10 +49,12 @@ pub use self::constants::*;
 
 pub mod alloc_ll;
 pub mod context_ll;
+pub mod crc_ll;
 pub mod flash_ll;
 pub mod mpu_ll;
 pub mod privilege;
 pub mod registers;
+pub mod scan_ll;
 pub mod syscall_ll;
 pub mod usart_ll;
 
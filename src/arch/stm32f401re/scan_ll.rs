@@ -0,0 +1,80 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+//! Scanning kernels for blank and erased runs of flash, comparing aligned 32-bit words
+
+/// Returns the index of the first byte of `bytes` that is not `value`, or `bytes.len()` if there
+/// is none
+pub fn find_first_not(bytes: &[u8], value: u8) -> usize {
+    let pattern = value as u32 * 0x01010101;
+    let mut i = 0;
+    // Byte-by-byte until the first 32-bit aligned word
+    while i < bytes.len() && (bytes.as_ptr() as usize + i) & 0b11 != 0 {
+        if bytes[i] != value {
+            return i;
+        }
+        i += 1;
+    }
+    // Word-by-word until the last 32-bit aligned word
+    while i + 4 <= bytes.len() {
+        let diff = unsafe { *(bytes.as_ptr().add(i) as *const u32) } ^ pattern;
+        if diff != 0 {
+            // Little-endian: the first byte is the least significant one
+            return i + diff.trailing_zeros() as usize / 8;
+        }
+        i += 4;
+    }
+    // Byte-by-byte until the end
+    while i < bytes.len() && bytes[i] == value {
+        i += 1;
+    }
+    i
+}
+
+/// Returns the index following the last byte of `bytes` that is not `value`, or `0` if there is
+/// none
+pub fn find_last_not(bytes: &[u8], value: u8) -> usize {
+    let pattern = value as u32 * 0x01010101;
+    let mut end = bytes.len();
+    // Byte-by-byte until the last 32-bit aligned word
+    while end > 0 && (bytes.as_ptr() as usize + end) & 0b11 != 0 {
+        if bytes[end - 1] != value {
+            return end;
+        }
+        end -= 1;
+    }
+    // Word-by-word until the first 32-bit aligned word
+    while end >= 4 {
+        let diff = unsafe { *(bytes.as_ptr().add(end - 4) as *const u32) } ^ pattern;
+        if diff != 0 {
+            // Little-endian: the last byte is the most significant one
+            return end - diff.leading_zeros() as usize / 8;
+        }
+        end -= 4;
+    }
+    // Byte-by-byte until the beginning
+    while end > 0 && bytes[end - 1] == value {
+        end -= 1;
+    }
+    end
+}
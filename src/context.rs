@@ -446,6 +446,14 @@ pub fn push(new_ctxt: ContextID, with: Context) {
     ctxts[new_ctxt.0].top_of_stack.push_context(with);
 }
 
+/// Returns whether the context `ctxt` is waiting on the context stack for a remote call to return
+pub fn is_stacked(ctxt: ContextID) -> bool {
+    CONTEXT_STACK
+        .lock()
+        .as_ref()
+        .map_or(false, |v| v.iter().any(|&(c, _)| c.0 == ctxt.0))
+}
+
 /// Pops the last context on the context stack as the next userland context.
 ///
 /// # Panics
@@ -45,6 +45,22 @@ void flash_erase0(uint8_t sector);
 uint8_t fs_init();
 uint8_t fs_write(uint8_t const *tag, uint8_t taglen, uint8_t const *data,
                  uint32_t datalen);
+// Returns FS_WOULD_BLOCK instead of defragmenting a sector, which takes seconds
+#define FS_WOULD_BLOCK 5
+uint8_t fs_write_nodefrag(uint8_t const *tag, uint8_t taglen,
+                          uint8_t const *data, uint32_t datalen);
+// Writes of up to `size` bytes of blocks after fs_reserve never defragment,
+// until fs_release
+uint8_t fs_reserve(uint32_t size, uint32_t *handle);
+void fs_release(uint32_t handle);
+// Empties sparse sectors into others while idle, so that writes defragment less
+uint8_t fs_compact(uint32_t *freed);
+// Creates a file of `datalen` zeros, which are only written out on its first
+// change
+uint8_t fs_create_zeroed(uint8_t const *tag, uint8_t taglen, uint32_t datalen);
+// fs_read_inplace returns FS_ZEROED for such a file until fs_materialize
+#define FS_ZEROED 6
+uint8_t fs_materialize(uint8_t const *tag, uint8_t taglen);
 // Despite returning `uint8_t`, fs_write_applet never returns but reboots the
 // card
 void fs_write_applet(uint8_t const *tag, uint8_t taglen, uint8_t const *data,
@@ -62,6 +78,8 @@ uint8_t fs_read_2b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
                       uint16_t *res);
 uint8_t fs_read_4b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
                       uint32_t *res);
+// Edits never extend a file, returning FS_OUT_OF_BOUNDS past its end
+#define FS_OUT_OF_BOUNDS 8
 uint8_t fs_write_1b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
                        uint8_t data);
 uint8_t fs_write_2b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
@@ -69,6 +87,18 @@ uint8_t fs_write_2b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
 uint8_t fs_write_4b_at(uint8_t const *tag, uint8_t taglen, uint32_t offset,
                        uint32_t data);
 uint8_t fs_length(uint8_t const *tag, uint8_t taglen, uint32_t *res);
+// The permissions are checked once by fs_open, and the handle then replaces the
+// tag until fs_close. A context keeps at most 4 files opened, which are closed
+// when it returns.
+#define FS_TOO_MANY_HANDLES 7
+uint8_t fs_open(uint8_t const *tag, uint8_t taglen, uint32_t *handle);
+void fs_close(uint32_t handle);
+uint8_t fs_read_1b_at_handle(uint32_t handle, uint32_t offset, uint8_t *res);
+uint8_t fs_read_2b_at_handle(uint32_t handle, uint32_t offset, uint16_t *res);
+uint8_t fs_read_4b_at_handle(uint32_t handle, uint32_t offset, uint32_t *res);
+uint8_t fs_write_1b_at_handle(uint32_t handle, uint32_t offset, uint8_t data);
+uint8_t fs_write_2b_at_handle(uint32_t handle, uint32_t offset, uint16_t data);
+uint8_t fs_write_4b_at_handle(uint32_t handle, uint32_t offset, uint32_t data);
 void fs_drop();
 
 // All `tagret` arguments point to the beginning of a 32-byte buffer
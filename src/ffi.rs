@@ -581,6 +581,11 @@ fn fs_error_to_errno(e: fs::Error) -> u8 {
         fs::Error::OutOfFlash => 1,
         fs::Error::NoSuchTag => 2,
         fs::Error::InvalidLengthForTag => 3,
+        fs::Error::Corrupted => 4,
+        fs::Error::WouldBlock => 5,
+        fs::Error::Zeroed => 6,
+        fs::Error::TooManyHandles => 7,
+        fs::Error::OutOfBounds => 8,
         fs::Error::IO(e) => 0x80 | flash_io_error_to_errno(e) as u8,
     }
 }
@@ -616,6 +621,165 @@ pub unsafe extern "C" fn fs_write(tag: *const u8, taglen: u8, data: *const u8, d
     }
 }
 
+/// Writes a file onto the file system, unless a sector must be defragmented first.
+///
+/// This function behaves as [`fs_write`], except that instead of defragmenting a sector (which
+/// takes seconds), it returns 5 without writing anything. The caller may then answer its current
+/// request first, and call [`fs_write`] afterwards.
+///
+/// # Errors
+///
+/// This function will error in case of flash i/o error, if a sector would have to be
+/// defragmented, or if the flash is full and cannot be defragmented enough to save space for the
+/// newly created file.
+///
+/// # Safety
+///
+/// This function must be called after a [`fs_init`]. In addition, `tag` (resp. `data`) must point
+/// to a buffer of size at least `taglen` (resp. `datalen`).
+///
+/// [`fs_init`]: fn.fs_init.html
+/// [`fs_write`]: fn.fs_write.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_write_nodefrag(
+    tag: *const u8,
+    taglen: u8,
+    data: *const u8,
+    datalen: u32,
+) -> u8 {
+    let res = syscall::fs_write_nodefrag(
+        slice::from_raw_parts(tag, taglen as usize),
+        slice::from_raw_parts(data, datalen as usize),
+    );
+    match res {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Reserves space on the file system that can be written without defragmenting.
+///
+/// This function runs any defragmentation needed for `size` bytes of blocks (each file also takes
+/// a few bytes of header, tag and checksum) to be writable immediately, and stores a handle to the
+/// reservation in `handle`. Until it is released with [`fs_release`], the writes that would
+/// otherwise defragment take from the reservation instead. It will return a non-zero value on
+/// error. Only the runtime environment and the installer may reserve space.
+///
+/// # Errors
+///
+/// This function will error in case of flash i/o error or if not enough space can be gathered on
+/// a single sector.
+///
+/// # Safety
+///
+/// This function must be called after a [`fs_init`]. In addition, `handle` must be a valid
+/// pointer.
+///
+/// [`fs_init`]: fn.fs_init.html
+/// [`fs_release`]: fn.fs_release.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_reserve(size: u32, handle: *mut u32) -> u8 {
+    match syscall::fs_reserve(size as usize) {
+        Ok(fs::Reservation(h)) => {
+            *handle = h as u32;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Releases the space a reservation made with [`fs_reserve`] still holds.
+///
+/// [`fs_reserve`]: fn.fs_reserve.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_release(handle: u32) {
+    syscall::fs_release(fs::Reservation(handle as usize))
+}
+
+/// Compacts the file system, while idle.
+///
+/// This function moves the files of the sparsest sectors into other sectors, and erases the
+/// sectors left empty, so that later writes find room without defragmenting. It returns in `freed`
+/// the number of sectors erased, and a non-zero value on error. Only the runtime environment and
+/// the installer may compact the file system.
+///
+/// # Errors
+///
+/// This function will error in case of flash i/o error.
+///
+/// # Safety
+///
+/// This function must be called after a [`fs_init`]. In addition, `freed` must be a valid pointer.
+///
+/// [`fs_init`]: fn.fs_init.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_compact(freed: *mut u32) -> u8 {
+    match syscall::fs_compact() {
+        Ok(n) => {
+            *freed = n as u32;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Creates a zero-filled file on the file system.
+///
+/// This function creates a file, tagged by `tag` (whose length is in `taglen`), and containing
+/// `datalen` zeros, without writing the zeros out: only the length is recorded, the zeros being
+/// written along with the first change to the file. It will return a non-zero value on error.
+///
+/// Note that if a file tagged by `tag` was already present on the file system, it will be erased.
+///
+/// # Errors
+///
+/// This function will error in case of flash i/o error, or if the flash is full and cannot be
+/// defragmented enough to save space for the newly created file.
+///
+/// # Safety
+///
+/// This function must be called after a [`fs_init`]. In addition, `tag` must point to a buffer of
+/// size at least `taglen`.
+///
+/// [`fs_init`]: fn.fs_init.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_create_zeroed(tag: *const u8, taglen: u8, datalen: u32) -> u8 {
+    match syscall::fs_create_zeroed(
+        slice::from_raw_parts(tag, taglen as usize),
+        datalen as usize,
+    ) {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Writes out the zeros of a zero-filled file.
+///
+/// This function writes out the zeros of the file tagged by `tag` (whose length is in `taglen`),
+/// created by [`fs_create_zeroed`], so that it can be read with [`fs_read_inplace`]. Nothing is
+/// done for other files. It will return a non-zero value on error.
+///
+/// # Errors
+///
+/// This function will error in case of flash i/o error, if the file does not exist, or if the
+/// flash is full and cannot be defragmented enough to save space for the zeros.
+///
+/// # Safety
+///
+/// This function must be called after a [`fs_init`]. In addition, `tag` must point to a buffer of
+/// size at least `taglen`.
+///
+/// [`fs_init`]: fn.fs_init.html
+/// [`fs_create_zeroed`]: fn.fs_create_zeroed.html
+/// [`fs_read_inplace`]: fn.fs_read_inplace.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_materialize(tag: *const u8, taglen: u8) -> u8 {
+    match syscall::fs_materialize(slice::from_raw_parts(tag, taglen as usize)) {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
 /// Writes an applet onto the file system.
 ///
 /// This function writes a file, tagged by `tag` (whose length is in `taglen`), and containing data
@@ -699,8 +863,8 @@ pub unsafe extern "C" fn fs_exists(tag: *const u8, taglen: u8) -> u8 {
 ///
 /// # Errors
 ///
-/// This function can error in case of flash i/o error, or if the said file is currently being
-/// locked in writing.
+/// This function can error in case of flash i/o error, if the said file is currently being
+/// locked in writing, or if it is zeroed and has no data on flash yet (see [`fs_materialize`]).
 ///
 /// # Safety
 ///
@@ -709,6 +873,7 @@ pub unsafe extern "C" fn fs_exists(tag: *const u8, taglen: u8) -> u8 {
 ///
 /// [`fs_init`]: fn.fs_init.html
 /// [`fs_free`]: fn.fs_free.html
+/// [`fs_materialize`]: fn.fs_materialize.html
 #[no_mangle]
 pub unsafe extern "C" fn fs_read_inplace(
     tag: *const u8,
@@ -841,6 +1006,107 @@ pub unsafe extern "C" fn fs_write_4b_at(tag: *const u8, taglen: u8, offset: u32,
     }
 }
 
+/// Opens the file of tag `tag` (whose length is in `taglen`), returning in `handle` a handle to
+/// pass to the `fs_*_at_handle` functions instead of the tag, until [`fs_close`]. The permissions
+/// are checked once, on opening, and the file is not looked up again as long as it does not move.
+/// A context may keep at most `syscall::FS_HANDLES_PER_CONTEXT` files opened, which are closed
+/// when it returns. Returns non-zero if an error occurs.
+///
+/// [`fs_close`]: fn.fs_close.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_open(tag: *const u8, taglen: u8, handle: *mut u32) -> u8 {
+    match syscall::fs_open(slice::from_raw_parts(tag, taglen as usize)) {
+        Ok(fs::Handle(h)) => {
+            *handle = h as u32;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Closes a handle returned by [`fs_open`].
+///
+/// [`fs_open`]: fn.fs_open.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_close(handle: u32) {
+    syscall::fs_close(fs::Handle(handle as usize))
+}
+
+/// Same as [`fs_read_1b_at`], for the file opened as `handle`.
+///
+/// [`fs_read_1b_at`]: fn.fs_read_1b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_read_1b_at_handle(handle: u32, offset: u32, res: *mut u8) -> u8 {
+    match syscall::fs_read_1b_at_handle(fs::Handle(handle as usize), offset as usize) {
+        Ok(v) => {
+            *res = v;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Same as [`fs_read_2b_at`], for the file opened as `handle`.
+///
+/// [`fs_read_2b_at`]: fn.fs_read_2b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_read_2b_at_handle(handle: u32, offset: u32, res: *mut u16) -> u8 {
+    match syscall::fs_read_2b_at_handle(fs::Handle(handle as usize), offset as usize) {
+        Ok(v) => {
+            *res = v;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Same as [`fs_read_4b_at`], for the file opened as `handle`.
+///
+/// [`fs_read_4b_at`]: fn.fs_read_4b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_read_4b_at_handle(handle: u32, offset: u32, res: *mut u32) -> u8 {
+    match syscall::fs_read_4b_at_handle(fs::Handle(handle as usize), offset as usize) {
+        Ok(v) => {
+            *res = v;
+            0
+        }
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Same as [`fs_write_1b_at`], for the file opened as `handle`.
+///
+/// [`fs_write_1b_at`]: fn.fs_write_1b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_write_1b_at_handle(handle: u32, offset: u32, data: u8) -> u8 {
+    match syscall::fs_write_1b_at_handle(fs::Handle(handle as usize), offset as usize, data) {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Same as [`fs_write_2b_at`], for the file opened as `handle`.
+///
+/// [`fs_write_2b_at`]: fn.fs_write_2b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_write_2b_at_handle(handle: u32, offset: u32, data: u16) -> u8 {
+    match syscall::fs_write_2b_at_handle(fs::Handle(handle as usize), offset as usize, data) {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
+/// Same as [`fs_write_4b_at`], for the file opened as `handle`.
+///
+/// [`fs_write_4b_at`]: fn.fs_write_4b_at.html
+#[no_mangle]
+pub unsafe extern "C" fn fs_write_4b_at_handle(handle: u32, offset: u32, data: u32) -> u8 {
+    match syscall::fs_write_4b_at_handle(fs::Handle(handle as usize), offset as usize, data) {
+        Ok(()) => 0,
+        Err(e) => fs_error_to_errno(e),
+    }
+}
+
 /// Returns in `res` the length (in bytes) of the file of tag `tag` (whose length is in `taglen`),
 /// returning non-zero if an error occurred.
 #[no_mangle]
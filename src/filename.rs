@@ -63,6 +63,12 @@ pub fn can_write(context: ContextID, tag: &[u8]) -> bool {
     }
 }
 
+// Operations on the whole filesystem, rather than on files, are left to the runtime and installer
+pub fn can_manage(context: ContextID) -> bool {
+    context.id() == ContextNumber::RuntimeEnvironment as usize
+        || context.id() == ContextNumber::Installer as usize
+}
+
 pub fn is_applet(tag: &[u8]) -> bool {
     tag.len() == 2 && tag[0] == FileType::Cap as u8
 }
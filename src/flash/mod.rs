@@ -29,9 +29,11 @@ mod tests;
 
 use alloc::vec::Vec;
 use core::borrow::Borrow;
+use core::cell::Cell;
 use core::ops::Deref;
 use core::ptr::{read_unaligned, read_volatile};
 use core::slice;
+use core::sync::atomic::{AtomicBool, Ordering};
 use hashset::HashSet;
 use spin::{Mutex, MutexGuard};
 use {core, flash_ll, FLASH_LOCK_BUCKETS};
@@ -104,10 +106,28 @@ pub struct Flash {
     /// being keyed in and FLASH_CR being locked again)
     locked: Mutex<()>,
 
+    /// Whether a [`Session`] currently keeps the flash unlocked
+    ///
+    /// [`Session`]: struct.Session.html
+    in_session: AtomicBool,
+
     /// List of the sectors
     sectors: Vec<Sector>,
 }
 
+/// A flash session, keeping the flash unlocked so long as it exists
+///
+/// All the writes and erases performed while a session is alive reuse its unlocking, instead of
+/// unlocking and locking the flash again each time. Sessions may be nested, in which case only the
+/// outermost one unlocks and locks the flash.
+pub struct Session<'a> {
+    /// Flash kept unlocked by this session
+    flash: &'a Flash,
+
+    /// Guard holding `flash.locked`, if this is the outermost session
+    guard: Option<MutexGuard<'a, ()>>,
+}
+
 /// Internal structure for handling a sector
 #[derive(Debug)]
 pub struct Sector {
@@ -149,6 +169,28 @@ pub struct FlashBlockMut<'a> {
 
     /// Reference to the parent sector
     sector: &'a Sector,
+
+    /// Word currently being combined, shared with the enclosing [`Sector::with_writer`]
+    ///
+    /// [`Sector::with_writer`]: struct.Sector.html#method.with_writer
+    pending: &'a PendingWord,
+}
+
+/// Write-combining buffer for a [`FlashBlockMut`]
+///
+/// Byte writes falling into the same 32-bit word are merged here, and the word is programmed only
+/// once a write lands in another word, the block is read, a burst is programmed, a
+/// [`FlashBlockMut::barrier`] is requested or the writer is done. Words are thus always programmed
+/// in the order they were first written to.
+///
+/// [`FlashBlockMut`]: struct.FlashBlockMut.html
+/// [`FlashBlockMut::barrier`]: struct.FlashBlockMut.html#method.barrier
+struct PendingWord {
+    /// Aligned index (in the sector) and value of the word not programmed yet, if any
+    word: Cell<Option<(usize, u32)>>,
+
+    /// First error met while programming a word from a context not able to report it
+    error: Cell<Option<IOError>>,
 }
 
 /// Mutex to record whether a [`Flash`] object already has taken ownership of the flash.
@@ -192,6 +234,7 @@ impl Flash {
         let res = Flash {
             _guard: guard,
             locked: Mutex::new(()),
+            in_session: AtomicBool::new(false),
             sectors: sectors,
         };
         with_flash_unlocked(&res, || {
@@ -210,6 +253,47 @@ impl Flash {
     pub fn sector(&self, SectorID(id): SectorID) -> &Sector {
         &self.sectors[id]
     }
+
+    /// Opens a session, keeping the flash unlocked until the returned [`Session`] is dropped
+    ///
+    /// This is meant for grouping all the writes of a single logical operation.
+    ///
+    /// # Errors
+    ///
+    /// Errors if the flash is already unlocked outside of a session.
+    ///
+    /// [`Session`]: struct.Session.html
+    pub fn session(&self) -> Result<Session, IOError> {
+        if self.in_session.load(Ordering::SeqCst) {
+            return Ok(Session {
+                flash: self,
+                guard: None,
+            });
+        }
+        let guard = get!(self
+            .locked
+            .try_lock()
+            .map_or(Err(IOError::LockedError), Ok));
+        unsafe {
+            flash_ll::unlock();
+        }
+        self.in_session.store(true, Ordering::SeqCst);
+        Ok(Session {
+            flash: self,
+            guard: Some(guard),
+        })
+    }
+}
+
+impl<'a> Drop for Session<'a> {
+    fn drop(&mut self) {
+        if self.guard.is_some() {
+            self.flash.in_session.store(false, Ordering::SeqCst);
+            unsafe {
+                flash_ll::lock();
+            }
+        }
+    }
 }
 
 /// Returns an `IOError` if there is an error waiting in the `FLASH_SR` register.
@@ -236,17 +320,22 @@ fn overlap(a_start: usize, a_length: usize, b_start: usize, b_length: usize) ->
 /// Waits for a flash operation to complete.
 fn sync() {
     unsafe {
-        while flash_ll::currently_busy() {
-            // Busy wait for the flash not to be busy any longer
-        }
+        flash_ll::wait_ready();
     }
 }
 
 /// Calls callback `f` with the flash unlocked (ie. with the flash ready to receive writes).
+///
+/// Within a [`Session`], the flash is already unlocked and is left so.
+///
+/// [`Session`]: struct.Session.html
 fn with_flash_unlocked<F, T>(flash: &Flash, f: F) -> Result<T, IOError>
 where
     F: FnOnce() -> T,
 {
+    if flash.in_session.load(Ordering::SeqCst) {
+        return Ok(f());
+    }
     let _lock = get!(flash
         .locked
         .try_lock()
@@ -306,6 +395,17 @@ impl Sector {
         self.length
     }
 
+    /// Returns the raw memory-mapped contents of the whole sector, without taking any lock
+    ///
+    /// # Safety
+    ///
+    /// As no lock is taken, nothing prevents the sector from being written to or erased while the
+    /// returned slice is alive. This is only meant for privileged scans (like mounting a
+    /// filesystem), which must not keep the slice around across a write or an erase of the sector.
+    pub unsafe fn raw(&self) -> &[u8] {
+        slice::from_raw_parts(self.start, self.length)
+    }
+
     /// Returns a read-only flash block on the requested portion of this sector
     ///
     /// # Errors
@@ -322,10 +422,12 @@ impl Sector {
 
     /// Calls a callback, giving it a [`FlashBlockMut`] on the requested portion of this sector
     ///
+    /// Byte writes that are still pending are programmed once the callback returns.
+    ///
     /// # Errors
     ///
-    /// Errors if the portion exceeds the size of the sector, or if there is an incompatible lock
-    /// on it.
+    /// Errors if the portion exceeds the size of the sector, if there is an incompatible lock
+    /// on it, or if programming a combined word failed outside of a call able to report it.
     pub fn with_writer<F, T>(
         &self,
         flash: &Flash,
@@ -341,16 +443,26 @@ impl Sector {
         } else {
             get!(with_flash_unlocked(flash, || {
                 get!(self.lock(true, start, length));
+                let pending = PendingWord {
+                    word: Cell::new(None),
+                    error: Cell::new(None),
+                };
                 let res = f(FlashBlockMut {
                     start: start,
                     length: length,
                     sector: self,
+                    pending: &pending,
                 });
+                let flushed = pending.flush(self);
                 sync();
                 unsafe {
                     self.unlock(true, start, length);
                 }
-                Ok(res)
+                get!(flushed);
+                match pending.error.get() {
+                    Some(e) => err!(e),
+                    None => Ok(res),
+                }
             }))
         }
     }
@@ -448,10 +560,32 @@ impl<'a> core::fmt::Debug for FlashBlock<'a> {
     }
 }
 
+impl PendingWord {
+    /// Programs the pending word, if any
+    fn flush(&self, sector: &Sector) -> Result<(), IOError> {
+        match self.word.take() {
+            None => Ok(()),
+            Some((aligned, val)) => unsafe {
+                let addr = sector.start.offset(aligned as isize) as *mut u32;
+                flash_ll::clear_error();
+                flash_ll::write(addr, val);
+                sync();
+                test_for_error()
+            },
+        }
+    }
+}
+
 impl<'a> Deref for FlashBlockMut<'a> {
     type Target = [u8];
 
+    // Programs the pending word first, so that reads see all the previous writes
     fn deref(&self) -> &Self::Target {
+        if let Err(e) = self.pending.flush(self.sector) {
+            if self.pending.error.get().is_none() {
+                self.pending.error.set(Some(e));
+            }
+        }
         unsafe { slice::from_raw_parts(self.sector.start.offset(self.start as isize), self.length) }
     }
 }
@@ -459,23 +593,77 @@ impl<'a> Deref for FlashBlockMut<'a> {
 impl<'a> FlashBlockMut<'a> {
     /// Writes a byte in this block
     ///
+    /// The byte is merged with the other bytes written to the same 32-bit word, the word being
+    /// programmed at once when another word gets written to (see [`barrier`]).
+    ///
     /// # Errors
     ///
-    /// Errors if the requested index is farther than the length of this block.
+    /// Errors if the requested index is farther than the length of this block, or if programming
+    /// the previously pending word failed.
+    ///
+    /// [`barrier`]: #method.barrier
     pub fn write(&mut self, i: usize, v: u8) -> Result<(), IOError> {
         if i >= self.length {
             return err!(IOError::OutOfBounds);
         }
+        let aligned = (self.start + i) & !0b11; // Align to 32-bits boundary
+        let pos = ((self.start + i) & 0b11) * 8; // Position of the byte inside the word
+        let old = match self.pending.word.get() {
+            Some((a, w)) if a == aligned => w,
+            _ => {
+                get!(self.barrier());
+                unsafe { read_volatile(self.sector.start.offset(aligned as isize) as *const u32) }
+            }
+        };
+        let new = (old & !(0xFF << pos)) | ((v as u32) << pos);
+        self.pending.word.set(Some((aligned, new)));
+        Ok(())
+    }
+
+    /// Programs all the pending writes of this block
+    ///
+    /// Writes are always programmed in order, but bytes of the same word are programmed at once.
+    /// Calling this before a write that must only hit the flash after everything written so far
+    /// (like a validity flip) ensures it cannot be merged with any of them.
+    ///
+    /// # Errors
+    ///
+    /// Errors if programming the pending word failed.
+    pub fn barrier(&mut self) -> Result<(), IOError> {
+        self.pending.flush(self.sector)
+    }
+
+    /// Programs `count` 32-bit words in a single burst, starting at the 32-bit aligned index `b`
+    /// of this block, the word at index `b + x` being `get_u32(x)`
+    ///
+    /// The status register is only checked once the whole burst is done. If it reports an error,
+    /// the words are read back so as to locate the first one not holding its value.
+    ///
+    /// # Errors
+    ///
+    /// Errors with the offset (relative to `b`) of the first failing word, along with the error
+    /// reported by the flash.
+    fn program_burst<F32: Fn(usize) -> u32>(
+        &mut self,
+        b: usize,
+        count: usize,
+        get_u32: F32,
+    ) -> Result<(), (usize, IOError)> {
         unsafe {
-            let aligned = (self.start + i) & !0b11; // Align to 32-bits boundary
-            let addr = self.sector.start.offset(aligned as isize) as *mut u32;
-            let pos = ((self.start + i) & 0b11) * 8; // Position of the byte inside the word
-            let old = read_volatile(addr);
-            let new = (old & !(0xFF << pos)) | ((v as u32) << pos);
+            let base = self.sector.start.offset((self.start + b) as isize) as *mut u32;
             flash_ll::clear_error();
-            flash_ll::write(addr, new);
+            flash_ll::begin_program();
+            for x in 0..count {
+                flash_ll::program(base.add(x), get_u32(4 * x));
+            }
             sync();
-            Ok(get!(test_for_error()))
+            flash_ll::end_program();
+            test_for_error().map_err(|e| {
+                let failing = (0..count)
+                    .find(|&x| read_volatile(base.add(x)) != get_u32(4 * x))
+                    .unwrap_or(0);
+                (4 * failing, e)
+            })
         }
     }
 
@@ -495,16 +683,16 @@ impl<'a> FlashBlockMut<'a> {
             get!(self.write(b + i, get_u8(i)));
             i += 1;
         }
-        // Word-by-word write until the last 32-bit aligned word
-        unsafe {
-            while (i + 3) < length {
-                let addr = self.sector.start.offset((self.start + b + i) as isize);
-                flash_ll::clear_error();
-                flash_ll::write(addr as *mut u32, get_u32(i));
-                sync();
-                get!(test_for_error());
-                i += 4;
+        // Word-by-word write until the last 32-bit aligned word, in a single burst
+        let words = (length - i) / 4;
+        if words > 0 {
+            get!(self.barrier());
+            let first = i;
+            if let Err((offset, e)) = self.program_burst(b + first, words, |x| get_u32(first + x)) {
+                debug!("Programming failed at index {:x}", self.start + b + first + offset);
+                return err!(e);
             }
+            i += 4 * words;
         }
         // Byte-by-byte write until the end
         while i < length {
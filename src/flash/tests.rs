@@ -47,6 +47,45 @@ speculate! {
         }
     }
 
+    describe "image" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            let path = ::std::env::temp_dir()
+                .join(format!("javacard-os-flash-{}.img", ::std::process::id()));
+            let _ = ::std::fs::remove_file(&path);
+            let geometry = [(0, 0x1000), (0x1000, 0x1000), (0x2000, 0x4000)];
+            flash_ll::map_image(&path, &geometry).unwrap();
+        }
+
+        after {
+            flash_ll::unmap_image();
+            ::std::fs::remove_file(&path).unwrap();
+        }
+
+        it "should follow the given geometry, starting blank" {
+            let sectors = flash_ll::sectors();
+            assert_eq!(sectors.iter().map(|s| s.length).collect::<Vec<_>>(), [0x1000, 0x1000, 0x4000]);
+            let flash = unsafe { Flash::new(&sectors) }.unwrap();
+            assert_eq!(&*flash.sector(SectorID(2)).read(0x3FFC, 4).unwrap(), [0xFF; 4]);
+        }
+
+        it "should persist writes across mappings" {
+            {
+                let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+                let s = flash.sector(SectorID(1));
+                s.with_writer(&flash, 0, 4, |mut b| b.write_block(0, &[1, 2, 3, 4]).unwrap()).unwrap();
+            }
+            flash_ll::unmap_image();
+            assert_eq!(&::std::fs::read(&path).unwrap()[0x1000..0x1004], [1, 2, 3, 4]);
+
+            flash_ll::map_image(&path, &geometry).unwrap();
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            assert_eq!(&*flash.sector(SectorID(1)).read(0, 5).unwrap(), [1, 2, 3, 4, 0xFF]);
+            flash.sector(SectorID(1)).erase(&flash).unwrap();
+            assert_eq!(&*flash.sector(SectorID(1)).read(0, 4).unwrap(), [0xFF; 4]);
+        }
+    }
+
     describe "flash" {
         before {
             let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
@@ -72,6 +111,28 @@ speculate! {
             assert_eq!(res, 1337);
         }
 
+        it "should keep the flash unlocked along a session" {
+            {
+                let _session = flash.session().unwrap();
+                assert!(!flash_ll::locked());
+                with_flash_unlocked(&flash, || assert!(!flash_ll::locked())).unwrap();
+                {
+                    let _nested = flash.session().unwrap();
+                }
+                assert!(!flash_ll::locked());
+                let s = flash.sector(SectorID(6));
+                s.erase(&flash).unwrap();
+                s.with_writer(&flash, 0, 1, |mut b| b.write(0, 42).unwrap()).unwrap();
+                assert!(!flash_ll::locked());
+                assert_eq!(&*s.read(0, 1).unwrap(), [42]);
+            }
+            assert!(flash_ll::locked());
+        }
+
+        it "should fail opening a session while the flash is unlocked" {
+            with_flash_unlocked(&flash, || assert!(flash.session().is_err())).unwrap();
+        }
+
         it "should return a sector when asked to" {
             let s = flash.sector(flash::SectorID(2));
             assert_eq!(s.num(), 2);
@@ -137,6 +198,21 @@ speculate! {
                 assert_eq!(&*sector.read(3, 1).unwrap(), [2]);
             }
 
+            it "should combine byte writes and read them back" {
+                sector.erase(&flash).unwrap();
+                sector.with_writer(&flash, 1, 6, |mut b| {
+                    b.write(0, 1).unwrap();
+                    b.write(2, 3).unwrap();
+                    b.write(1, 2).unwrap();
+                    assert_eq!(&b[..3], [1, 2, 3]);
+                    b.write(3, 4).unwrap();
+                    b.write(4, 5).unwrap();
+                    b.barrier().unwrap();
+                    b.write(5, 6).unwrap();
+                }).unwrap();
+                assert_eq!(&*sector.read(0, 8).unwrap(), [0xFF, 1, 2, 3, 4, 5, 6, 0xFF]);
+            }
+
             it "should erase" {
                 sector.erase(&flash).unwrap();
                 assert_eq!(&*sector.read(4, 2).unwrap(), [0xFF, 0xFF]);
@@ -199,6 +275,68 @@ speculate! {
                 sector.with_writer(&flash, 0, 8, |mut b| b.zero_block(0, 8).unwrap()).unwrap();
                 assert_eq!(&*sector.read(6, 2).unwrap(), [0, 0]);
             }
+
+            it "should correctly write a long unaligned block of data in a burst" {
+                let data: Vec<u8> = (0..1001).map(|x| (x * 7) as u8).collect();
+                sector.with_writer(&flash, 3, 1001, |mut b| b.write_block(0, &data).unwrap()).unwrap();
+                assert_eq!(&*sector.read(3, 1001).unwrap(), &data[..]);
+                assert_eq!(&*sector.read(0, 3).unwrap(), [0xFF; 3]);
+                assert_eq!(sector.read(1004, 1).unwrap()[0], 0xFF);
+            }
+
+            it "should account virtual time as measured on the card" {
+                // The sector is 128k long, and full of 1's
+                flash_ll::reset_elapsed();
+                sector.erase(&flash).unwrap();
+                assert_eq!(flash_ll::elapsed_ns(), 1_000_000_000);
+                flash_ll::reset_elapsed();
+                sector.with_writer(&flash, 0, 0x20000, |mut b| b.zero_block(0, 0x20000).unwrap()).unwrap();
+                assert!((flash_ll::elapsed_ns() as i64 - 350_000_000).abs() < 1_000_000);
+                flash_ll::reset_elapsed();
+                sector.erase(&flash).unwrap();
+                assert_eq!(flash_ll::elapsed_ns(), 800_000_000);
+
+                flash_ll::set_parallelism(flash_ll::Parallelism::X8);
+                flash_ll::reset_elapsed();
+                sector.erase(&flash).unwrap();
+                assert_eq!(flash_ll::elapsed_ns(), 2_000_000_000);
+                flash_ll::reset_elapsed();
+                sector.with_writer(&flash, 0, 0x20000, |mut b| b.zero_block(0, 0x20000).unwrap()).unwrap();
+                assert!((flash_ll::elapsed_ns() as i64 - 1_000_000_000).abs() < 1_000_000);
+                flash_ll::set_parallelism(flash_ll::Parallelism::X32);
+            }
+
+            it "should wear out along the wear model" {
+                flash_ll::set_wear_model(Some(flash_ll::WearModel { endurance: 2, spread: 1, seed: 42 }));
+                sector.erase(&flash).unwrap();
+                sector.erase(&flash).unwrap();
+                assert_eq!(flash_ll::erase_count(7), 2);
+                assert!(sector.read(0, sector.len()).unwrap().iter().all(|&x| x == 0xFF));
+                sector.erase(&flash).unwrap();
+                // Each word now has a bit stuck at 0
+                for w in sector.read(0, sector.len()).unwrap().chunks(4) {
+                    assert_eq!(w.iter().map(|x| x.count_zeros()).sum::<u32>(), 1);
+                }
+                let res = sector.with_writer(&flash, 0, 4, |mut b| b.write_block(0, &[0xFF; 4]));
+                assert_eq!(res, Ok(Err(IOError::UnknownError(flash_ll::WEAR_ERROR))));
+                sector.with_writer(&flash, 4, 4, |mut b| b.write_block(0, &[0; 4]).unwrap()).unwrap();
+                flash_ll::set_wear_model(None);
+            }
+
+            #[ignore]
+            it "benchmarks writing a whole sector" {
+                let len = sector.len();
+                let data: Vec<u8> = (0..len).map(|x| (x * 7) as u8).collect();
+                let start = ::std::time::Instant::now();
+                flash_ll::reset_elapsed();
+                sector.with_writer(&flash, 0, len, |mut b| b.write_block(0, &data).unwrap()).unwrap();
+                println!("Writing {} bytes: {:?} (on card: {}ms)", len, start.elapsed(), flash_ll::elapsed_ns() / 1_000_000);
+                assert_eq!(&*sector.read(0, len).unwrap(), &data[..]);
+                sector.erase(&flash).unwrap();
+                let start = ::std::time::Instant::now();
+                sector.with_writer(&flash, 0, len, |mut b| b.zero_block(0, len).unwrap()).unwrap();
+                println!("Zeroing {} bytes: {:?}", len, start.elapsed());
+            }
         }
     }
 }
@@ -0,0 +1,308 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//! Host benchmark suite of the filesystem, run with `make bench`
+//!
+//! Workloads are lists of operations (see [`replay`]), each replayed on a freshly erased
+//! filesystem laid out along `FLASH_GEOMETRY`, followed by the regression corpus of the latency
+//! fuzzer. All of them are synthetic, built by a seeded generator so that they are the same on
+//! every run. Results are printed as one JSON object per workload and per line, so that they
+//! can be tracked across versions.
+
+#![cfg(test)]
+#![allow(unused_variables, unused_mut)]
+
+use super::fuzz::corpus;
+use super::*;
+#[cfg(test)]
+use speculate::speculate; // Must be imported into the current scope.
+
+use std::time::{Duration, Instant};
+use {flash_ll, FLASH_GEOMETRY};
+
+/// Performs an operation of a workload on `fs`, taking the written bytes from `data` (starting at
+/// `salt` for edits)
+///
+/// Operations are lines of one of the forms:
+///
+/// ```none
+/// a <tag> <len>          write_applet
+/// w <tag> <len>          write
+/// e <tag> <offset> <len> edit_at
+/// d <tag>                erase
+/// r <tag>                read
+/// ```
+pub fn replay(fs: &mut FileSystem, line: &str, data: &[u8], salt: usize) -> Result<(), Error> {
+    let words: Vec<&str> = line.split(' ').collect();
+    let tag = words[1].as_bytes();
+    let num = |i: usize| words[i].parse::<usize>().unwrap();
+    match words[0] {
+        "a" => fs.write_applet(tag, &data[..num(2)]),
+        "w" => fs.write(tag, &data[..num(2)]),
+        "e" => fs.edit_at(tag, num(2), &data[salt % 64..salt % 64 + num(3)]),
+        "d" => fs.erase(tag),
+        "r" => fs.read(tag).map(|_| ()),
+        op => panic!("Unknown operation {} in trace", op),
+    }
+}
+
+/// Bytes written by the workloads
+pub fn data() -> Vec<u8> {
+    (0..4096).map(|x| (x * 7) as u8).collect()
+}
+
+/// Deterministic pseudo-random generator for building workloads
+pub struct Lcg(pub u64);
+
+impl Lcg {
+    /// Returns a number in `[0; n)`
+    pub fn below(&mut self, n: usize) -> usize {
+        self.0 = self
+            .0
+            .wrapping_mul(6_364_136_223_846_793_005)
+            .wrapping_add(1_442_695_040_888_963_407);
+        (self.0 >> 33) as usize % n
+    }
+}
+
+/// Returns the operations of a synthetic card session, replayed by the geometry sweep and the wear
+/// simulation
+///
+/// Four applets are installed along with their records and counters, then counters are written,
+/// records edited and rewritten, temporary files come and go, and applets are reinstalled now and
+/// then.
+pub fn workload() -> Vec<String> {
+    let mut rng = Lcg(6);
+    let sizes = [64, 128, 256, 512];
+    let mut ops: Vec<String> = (0..4)
+        .map(|cap| format!("a cap-{} {}", cap, 2048 + rng.below(1024)))
+        .collect();
+    let mut records = Vec::new();
+    for cap in 0..4 {
+        for rec in 0..6 {
+            let size = sizes[rng.below(4)];
+            ops.push(format!("w rec-{}-{} {}", cap, rec, size));
+            records.push(size);
+        }
+    }
+    ops.extend((0..24).map(|ctr| format!("w ctr-{} 4", ctr)));
+    let mut temporaries = [false; 16];
+    while ops.len() < 2776 {
+        let rec = rng.below(records.len());
+        match rng.below(100) {
+            0..=41 => ops.push(format!("w ctr-{} 4", rng.below(24))),
+            42..=69 => {
+                let len = [1, 2, 4, 16][rng.below(4)];
+                let offset = rng.below(records[rec] - len);
+                ops.push(format!("e rec-{}-{} {} {}", rec / 6, rec % 6, offset, len));
+            }
+            70..=83 => {
+                records[rec] = sizes[rng.below(4)];
+                ops.push(format!("w rec-{}-{} {}", rec / 6, rec % 6, records[rec]));
+            }
+            84..=96 => {
+                let tmp = rng.below(16);
+                ops.push(if temporaries[tmp] {
+                    format!("d tmp-{}", tmp)
+                } else {
+                    format!("w tmp-{} {}", tmp, 1 + rng.below(255))
+                });
+                temporaries[tmp] = !temporaries[tmp];
+            }
+            _ => ops.push(format!("a cap-{} {}", rng.below(4), 2048 + rng.below(1024))),
+        }
+    }
+    ops
+}
+
+/// Installs applets along with their static fields, then uninstalls and reinstalls them
+fn applet_install() -> Vec<String> {
+    let mut rng = Lcg(1);
+    let mut ops = Vec::new();
+    for round in 0..5 {
+        for cap in 0..4 {
+            ops.push(format!("a cap-{} {}", cap, 1500 + rng.below(1500)));
+            for field in 0..12 {
+                ops.push(format!("w cap-{}-{} {}", cap, field, 16 + rng.below(240)));
+            }
+        }
+        for cap in 0..4 {
+            for field in 0..12 {
+                ops.push(format!("d cap-{}-{}", cap, field));
+            }
+        }
+    }
+    ops
+}
+
+/// Updates a few bytes at a time of a set of object fields
+fn update_storm() -> Vec<String> {
+    let mut rng = Lcg(2);
+    let mut ops: Vec<String> = (0..32).map(|i| format!("w obj-{} 128", i)).collect();
+    for _ in 0..3000 {
+        let len = [1, 2, 4, 16][rng.below(4)];
+        ops.push(format!(
+            "e obj-{} {} {}",
+            rng.below(32),
+            rng.below(128 - len),
+            len
+        ));
+    }
+    ops
+}
+
+/// Decrements counters, each write replacing a whole 4-byte counter
+fn counters() -> Vec<String> {
+    let mut rng = Lcg(3);
+    (0..3000)
+        .map(|_| format!("w ctr-{} 4", rng.below(16)))
+        .collect()
+}
+
+/// Rewrites the list of installed packages, of 16-byte entries, as packages come and go
+fn package_list() -> Vec<String> {
+    let mut rng = Lcg(4);
+    (0..400)
+        .map(|_| format!("w packages {}", 16 * (40 + rng.below(9))))
+        .collect()
+}
+
+/// Mostly reads, along with some edits and rewrites
+fn mixed_reads() -> Vec<String> {
+    let mut rng = Lcg(5);
+    let mut ops: Vec<String> = (0..48).map(|i| format!("w file-{} 512", i)).collect();
+    for _ in 0..5000 {
+        let tag = rng.below(48);
+        ops.push(match rng.below(10) {
+            0..=6 => format!("r file-{}", tag),
+            7 | 8 => format!("e file-{} {} 8", tag, rng.below(504)),
+            _ => format!("w file-{} 512", tag),
+        });
+    }
+    ops
+}
+
+/// Measures of a workload run
+struct Report {
+    /// Host time taken by each operation
+    latencies: Vec<Duration>,
+    /// Virtual on-card flash time taken by each operation, in nanoseconds
+    card_latencies: Vec<u64>,
+    /// Words programmed over the run
+    programmed_words: u64,
+    /// Sectors erased over the run
+    erased_sectors: u64,
+    /// Defragmentations run over the run
+    defragmentations: usize,
+}
+
+/// Replays `ops` on `fs`, measuring each operation
+fn run<S: AsRef<str>>(fs: &mut FileSystem, ops: &[S]) -> Report {
+    let data = data();
+    let mut report = Report {
+        latencies: Vec::with_capacity(ops.len()),
+        card_latencies: Vec::with_capacity(ops.len()),
+        programmed_words: 0,
+        erased_sectors: 0,
+        defragmentations: 0,
+    };
+    let defragmentations = fs.stats().defragmentations;
+    flash_ll::reset_elapsed();
+    for (i, op) in ops.iter().enumerate() {
+        let card_start = flash_ll::elapsed_ns();
+        let start = Instant::now();
+        replay(fs, op.as_ref(), &data, i).unwrap();
+        report.latencies.push(start.elapsed());
+        report
+            .card_latencies
+            .push(flash_ll::elapsed_ns() - card_start);
+    }
+    report.programmed_words = flash_ll::programmed_words();
+    report.erased_sectors = flash_ll::erased_sectors();
+    report.defragmentations = fs.stats().defragmentations - defragmentations;
+    report
+}
+
+impl Report {
+    /// Returns the report as a single-line JSON object
+    fn to_json(&self, name: &str) -> String {
+        let n = self.latencies.len();
+        let mut host: Vec<u64> = self.latencies.iter().map(|d| d.as_nanos() as u64).collect();
+        let mut card = self.card_latencies.clone();
+        host.sort();
+        card.sort();
+        let total: u64 = host.iter().sum();
+        let card_total: u64 = card.iter().sum();
+        format!(
+            "{{\"workload\":\"{}\",\"ops\":{},\"ops_per_sec\":{},\"p50_us\":{},\"p99_us\":{},\"max_us\":{},\
+             \"card_ops_per_sec\":{},\"card_p50_us\":{},\"card_p99_us\":{},\"card_max_us\":{},\
+             \"bytes_programmed\":{},\"erases\":{},\"defragmentations\":{}}}",
+            name,
+            n,
+            n as u64 * 1_000_000_000 / total.max(1),
+            host[n / 2] / 1000,
+            host[n * 99 / 100] / 1000,
+            host[n - 1] / 1000,
+            n as u64 * 1_000_000_000 / card_total.max(1),
+            card[n / 2] / 1000,
+            card[n * 99 / 100] / 1000,
+            card[n - 1] / 1000,
+            4 * self.programmed_words,
+            self.erased_sectors,
+            self.defragmentations,
+        )
+    }
+}
+
+speculate! {
+    describe "bench" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+        }
+
+        #[ignore]
+        it "benchmarks java card workloads" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            println!(); // Start the JSON lines on a line of their own
+            let mut workloads: Vec<(String, Vec<String>)> = vec![
+                ("applet-install".to_string(), applet_install()),
+                ("update-storm".to_string(), update_storm()),
+                ("counters".to_string(), counters()),
+                ("package-list".to_string(), package_list()),
+                ("mixed-reads".to_string(), mixed_reads()),
+                ("session".to_string(), workload()),
+            ];
+            for (name, _, ops) in corpus() {
+                workloads.push((format!("corpus/{}", name), ops));
+            }
+            for (name, ops) in workloads {
+                for sector in fs_sectors.iter() {
+                    sector.erase(&flash).unwrap();
+                }
+                let mut fs = FileSystem::new(&flash, &fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet).unwrap();
+                println!("{}", run(&mut fs, &ops).to_json(&name));
+            }
+        }
+    }
+}
@@ -0,0 +1,333 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//! Offline analysis of flash dumps, run with `make fsck DUMP=<file> [OUTPUT=<file>]`
+//!
+//! A dump is a raw copy of the whole flash, cut along `SECTORS` and laid out along
+//! `FLASH_GEOMETRY`, as taken with `dump_image dump.bin 0x08000000 0x80000` from OpenOCD. It is
+//! scanned the way mounting scans it, but without repairing anything, and the report gives:
+//!  * the live, dead and free bytes of each sector, and the largest write that still fits without
+//!    defragmenting,
+//!  * the broken blocks mounting would erase from, and the valid blocks whose lazily-checked
+//!    payload is corrupted,
+//!  * the tags having several valid blocks, of which mounting keeps the first one scanned,
+//!  * the defragmentation marker left by an interrupted defragmentation, if any,
+//!  * the defragmentation the next write not fitting would run, and the bytes it would copy.
+//!
+//! When `OUTPUT` is given, a compacted image is also written there: the dump is mounted (which
+//! repairs it), every sector holding dead bytes is defragmented, and sparse sectors are merged.
+
+#![cfg(test)]
+#![allow(unused_variables, unused_mut)]
+
+use super::*;
+#[cfg(test)]
+use speculate::speculate; // Must be imported into the current scope.
+
+use std::cmp::min;
+use std::collections::BTreeMap;
+use std::{env, fs};
+use {flash_ll, FLASH_GEOMETRY, SECTORS};
+
+/// Usage of a filesystem sector
+#[derive(Debug, Default, PartialEq, Eq)]
+pub struct SectorReport {
+    /// Size of the valid blocks
+    pub live: usize,
+
+    /// Size of the invalid and erased blocks
+    pub dead: usize,
+
+    /// Size of the blank space following the last block
+    pub free: usize,
+
+    /// Position of the broken block ending the scan of the sector, if any
+    ///
+    /// Everything from there on is erased at the next mount, and is accounted neither as live nor
+    /// as free.
+    pub broken: Option<usize>,
+
+    /// Number of valid blocks whose payload does not match its checksum
+    pub corrupted: usize,
+}
+
+/// Findings of [`analyze`](fn.analyze.html)
+#[derive(Debug, PartialEq, Eq)]
+pub struct Report {
+    /// Usage of each sector, the defrag sector holding the blocks of an interrupted
+    /// defragmentation
+    pub sectors: Vec<SectorReport>,
+
+    /// Sector whose defragmentation was interrupted, as marked at the end of the defrag sector
+    pub marker: Option<usize>,
+
+    /// Whether the marker names no sector that can be defragmented, which mounting cannot recover
+    /// from
+    pub orphaned_marker: bool,
+
+    /// Tags having several valid blocks, along with their number of valid blocks
+    pub duplicates: Vec<(Vec<u8>, usize)>,
+
+    /// Largest block that can be written without defragmenting
+    pub largest_write: usize,
+
+    /// Sector the next defragmentation would be run on, along with the bytes it would copy (once
+    /// to the defrag sector, and once back) and those it would reclaim
+    pub next_defrag: Option<(SectorID, usize, usize)>,
+}
+
+/// Scans `sectors`, laid out along `defrag` and `applet` and whose blocks are in format `format`,
+/// without modifying them
+pub fn analyze(sectors: &[&Sector], defrag: SectorID, applet: SectorID, format: Format) -> Report {
+    let mut tags: BTreeMap<Vec<u8>, usize> = BTreeMap::new();
+    let mut reports = Vec::with_capacity(sectors.len());
+    // The last byte of the defrag sector is its marker
+    let zones: Vec<(&Sector, usize)> = sectors
+        .iter()
+        .enumerate()
+        .map(|(id, &x)| (x, x.len() - (SectorID(id) == defrag) as usize))
+        .collect();
+    let cursors = ScanCursor::all(&zones, format);
+    for ((id, &(_, end)), mut cursor) in zones.iter().enumerate().zip(cursors) {
+        let mut report = SectorReport::default();
+        while !cursor.done() {
+            let pos = cursor.pos();
+            match cursor.next() {
+                Ok(b) if b.valid => {
+                    report.live += b.size;
+                    if !cursor.payload_ok(&b) {
+                        report.corrupted += 1;
+                    }
+                    if SectorID(id) != defrag {
+                        *tags.entry(cursor.tag(&b).to_vec()).or_insert(0) += 1;
+                    }
+                }
+                Ok(b) => report.dead += b.size,
+                Err(ParseNoBlock::Erased(_)) => report.dead += cursor.pos() - pos,
+                Err(ParseNoBlock::Empty) => {
+                    report.free = end - pos;
+                    break;
+                }
+                Err(ParseNoBlock::Broken) => {
+                    report.broken = Some(pos);
+                    break;
+                }
+            }
+        }
+        reports.push(report);
+    }
+
+    let defragsect = sectors[defrag.0];
+    let marker = unsafe { defragsect.raw()[defragsect.len() - 1] } as usize;
+    let marker = if marker == 0xFF { None } else { Some(marker) };
+    let orphaned_marker = marker.map_or(false, |x| x >= sectors.len() || x == defrag.0);
+
+    // Mirror the choices of `place`: writes go to the first sector able to take them, and the
+    // sparsest sector gets defragmented first. Mounting erases broken blocks, so everything past
+    // the last block scanned counts as free.
+    let defragsize = defragsect.len() - 1;
+    let writable: Vec<usize> = (0..sectors.len())
+        .filter(|&x| x != defrag.0 && x != applet.0)
+        .collect();
+    let largest_write = writable
+        .iter()
+        .map(|&x| {
+            let free = sectors[x].len() - reports[x].live - reports[x].dead;
+            min(free, defragsize.saturating_sub(reports[x].live))
+        })
+        .max()
+        .unwrap_or(0);
+    let next_defrag = writable
+        .iter()
+        .filter(|&&x| reports[x].dead != 0)
+        .max_by_key(|&&x| {
+            let used = reports[x].live + reports[x].dead;
+            if reports[x].live == 0 {
+                usize::MAX
+            } else {
+                (1 << 15) * used / reports[x].live
+            }
+        })
+        .map(|&x| (SectorID(x), 2 * reports[x].live, reports[x].dead));
+
+    Report {
+        sectors: reports,
+        marker: marker,
+        orphaned_marker: orphaned_marker,
+        duplicates: tags.into_iter().filter(|x| x.1 > 1).collect(),
+        largest_write: largest_write,
+        next_defrag: next_defrag,
+    }
+}
+
+/// Repairs and compacts the filesystem laid out along `FLASH_GEOMETRY` on `sectors`
+///
+/// The filesystem is mounted, which erases broken blocks, drops duplicate valid blocks and
+/// finishes any interrupted defragmentation, then every sector holding dead bytes is
+/// defragmented, and sparse sectors are merged. An orphaned marker cannot be recovered from, and
+/// is dropped along with the defrag sector.
+pub fn repair(flash: &Flash, sectors: &[&Sector]) -> Result<(), Error> {
+    let (defrag, applet) = (FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet);
+    if analyze(sectors, defrag, applet, Format::default()).orphaned_marker {
+        get!(sectors[defrag.0].erase(flash));
+    }
+    let mut fs = get!(FileSystem::new(flash, sectors, defrag, applet));
+    for id in fs.defragmentation_candidates() {
+        get!(fs.defragment(id));
+    }
+    get!(fs.compact());
+    Ok(())
+}
+
+/// Prints `report` on the standard output
+fn print(report: &Report) {
+    println!("sector   live   dead   free");
+    for (i, s) in report.sectors.iter().enumerate() {
+        let mut notes = Vec::new();
+        if SectorID(i) == FLASH_GEOMETRY.defrag {
+            notes.push("defrag sector".to_string());
+        } else if SectorID(i) == FLASH_GEOMETRY.applet {
+            notes.push("applet sector".to_string());
+        }
+        if let Some(pos) = s.broken {
+            notes.push(format!("broken block at {:#x}", pos));
+        }
+        if s.corrupted != 0 {
+            notes.push(format!("{} corrupted payloads", s.corrupted));
+        }
+        println!(
+            "{:6} {:6} {:6} {:6}  {}",
+            i,
+            s.live,
+            s.dead,
+            s.free,
+            notes.join(", ")
+        );
+    }
+    if let Some(marker) = report.marker {
+        let state = if report.orphaned_marker {
+            "orphaned"
+        } else {
+            "resumed at mount"
+        };
+        println!(
+            "Interrupted defragmentation of sector {} ({})",
+            marker, state
+        );
+    }
+    for &(ref tag, count) in report.duplicates.iter() {
+        println!("Tag {:02x?} has {} valid blocks", tag, count);
+    }
+    println!(
+        "Largest write without defragmenting: {}",
+        report.largest_write
+    );
+    match report.next_defrag {
+        Some((SectorID(id), copied, reclaimed)) => println!(
+            "Next defragmentation: sector {}, copying {} bytes to reclaim {}",
+            id, copied, reclaimed
+        ),
+        None => println!("Next defragmentation: none possible"),
+    }
+}
+
+speculate! {
+    describe "fsck" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            let path = env::temp_dir().join(format!("javacard-os-fsck-{}.img", ::std::process::id()));
+            let _ = fs::remove_file(&path);
+        }
+
+        after {
+            flash_ll::unmap_image();
+            fs::remove_file(&path).unwrap();
+        }
+
+        it "reports and repairs the defects of a dump" {
+            flash_ll::map_image(&path, &SECTORS).unwrap();
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+            for sector in fs_sectors.iter() {
+                sector.erase(&flash).unwrap();
+            }
+            let mut fs = FileSystem::new(&flash, &fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet).unwrap();
+            fs.write(b"dup", b"value").unwrap();
+            fs.write(b"obj", &[1; 100]).unwrap();
+            fs.write(b"obj", &[2; 100]).unwrap();
+            drop(fs);
+
+            let size = parse_hdr(unsafe { fs_sectors[0].raw() }, Format::default()).unwrap().size;
+            let dup = unsafe { fs_sectors[0].raw()[..size].to_vec() };
+            // A second valid block of the same tag, as left by an interrupted write
+            fs_sectors[1].with_writer(&flash, 0, size, |mut b| b.write_block(0, &dup)).unwrap().unwrap();
+            // A block whose checksum does not match
+            let mut broken = dup.clone();
+            broken[size - 2] ^= 1;
+            fs_sectors[2].with_writer(&flash, 0, size, |mut b| b.write_block(0, &broken)).unwrap().unwrap();
+            // The marker of a defragmentation of a sector that does not exist
+            let defragsect = fs_sectors[FLASH_GEOMETRY.defrag.0];
+            defragsect.with_writer(&flash, defragsect.len() - 1, 1, |mut b| b.write(0, 9)).unwrap().unwrap();
+
+            let report = analyze(&fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet, Format::default());
+            let s = &report.sectors;
+            assert_eq!(s[0].live, size + s[0].dead);
+            assert_eq!(s[0].live + s[0].dead + s[0].free, fs_sectors[0].len());
+            assert_eq!((s[1].live, s[1].dead), (size, 0));
+            assert_eq!((s[2].live, s[2].broken), (0, Some(0)));
+            assert_eq!(report.duplicates, vec![(b"dup".to_vec(), 2)]);
+            assert_eq!((report.marker, report.orphaned_marker), (Some(9), true));
+            assert_eq!(report.largest_write, fs_sectors[3].len());
+            assert_eq!(report.next_defrag, Some((SectorID(0), 2 * s[0].live, s[0].dead)));
+
+            repair(&flash, &fs_sectors).unwrap();
+            let report = analyze(&fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet, Format::default());
+            assert!(report.sectors.iter().all(|x| x.dead == 0 && x.broken.is_none()), "{:?}", report);
+            assert!(report.duplicates.is_empty());
+            assert_eq!((report.marker, report.next_defrag), (None, None));
+            let fs = FileSystem::new(&flash, &fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet).unwrap();
+            assert_eq!(&*fs.read(b"dup").unwrap(), b"value");
+            assert_eq!(&*fs.read(b"obj").unwrap(), &[2u8; 100] as &[u8]);
+        }
+
+        #[ignore]
+        it "analyzes a flash dump" {
+            let dump = env::var("FSCK_DUMP").expect("FSCK_DUMP is not set");
+            // Work on a copy, so that the dump itself is left untouched
+            fs::copy(&dump, &path).unwrap();
+            flash_ll::map_image(&path, &SECTORS).unwrap();
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+            print(&analyze(&fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet, Format::default()));
+            if let Ok(output) = env::var("FSCK_OUTPUT") {
+                repair(&flash, &fs_sectors).unwrap();
+                println!("\nAfter compaction:");
+                print(&analyze(&fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet, Format::default()));
+                drop(fs_sectors);
+                drop(flash);
+                flash_ll::unmap_image();
+                fs::copy(&path, &output).unwrap();
+                println!("Wrote the compacted image to {}", output);
+            }
+        }
+    }
+}
@@ -0,0 +1,229 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//! Worst-case latency fuzzer of the filesystem, run with `make fuzz`
+//!
+//! Rather than coverage, the fuzzer is guided by the on-card flash time taken by a single operation
+//! (see `flash_ll::elapsed_ns`): it mutates sequences of operations, keeping those whose costliest
+//! operation gets costlier. The worst sequence found is then minimized, and added to the
+//! regression corpus in `corpus/`, whose entries are replayed by the benchmark suite and checked
+//! by the tests not to get any costlier.
+//!
+//! Sequences are in the syntax of the workloads (see `bench::replay`), and are replayed on a
+//! freshly erased filesystem laid out along `FLASH_GEOMETRY`.
+
+#![cfg(test)]
+#![allow(unused_variables, unused_mut)]
+
+use super::bench::{data, replay, Lcg};
+use super::*;
+#[cfg(test)]
+use speculate::speculate; // Must be imported into the current scope.
+
+use std::{env, fs};
+use {flash_ll, FLASH_GEOMETRY};
+
+/// Directory of the regression corpus
+const CORPUS: &str = concat!(env!("CARGO_MANIFEST_DIR"), "/src/fs/corpus");
+
+/// Header line of a corpus entry giving the on-card time of its costliest operation
+const WORST_HEADER: &str = "# worst: ";
+
+/// Replays `ops` on a freshly erased filesystem, returning the index and the on-card time (in
+/// nanoseconds) of its costliest operation, or `None` if any operation failed
+pub fn worst_op<S: AsRef<str>>(
+    flash: &Flash,
+    fs_sectors: &[&Sector],
+    ops: &[S],
+) -> Option<(usize, u64)> {
+    for sector in fs_sectors.iter() {
+        sector.erase(flash).unwrap();
+    }
+    let mut fs = FileSystem::new(
+        flash,
+        fs_sectors,
+        FLASH_GEOMETRY.defrag,
+        FLASH_GEOMETRY.applet,
+    )
+    .unwrap();
+    let data = data();
+    let mut worst = (0, 0);
+    for (i, op) in ops.iter().enumerate() {
+        let start = flash_ll::elapsed_ns();
+        if replay(&mut fs, op.as_ref(), &data, i).is_err() {
+            return None;
+        }
+        let cost = flash_ll::elapsed_ns() - start;
+        if cost > worst.1 {
+            worst = (i, cost);
+        }
+    }
+    Some(worst)
+}
+
+/// Returns a random operation, on one of a few tags
+fn random_op(rng: &mut Lcg) -> String {
+    let tag = rng.below(12);
+    match rng.below(8) {
+        0 => format!("d f{}", tag),
+        1 => format!("e f{} 0 1", tag),
+        _ => format!("w f{} {}", tag, [4, 64, 512, 2048, 4096][rng.below(5)]),
+    }
+}
+
+/// Returns a mutated copy of `ops`
+fn mutate(ops: &[String], rng: &mut Lcg) -> Vec<String> {
+    let mut res = ops.to_vec();
+    match rng.below(4) {
+        0 => {
+            let i = rng.below(res.len() + 1);
+            res.insert(i, random_op(rng));
+        }
+        1 if !res.is_empty() => {
+            res.remove(rng.below(res.len()));
+        }
+        2 if !res.is_empty() => {
+            let i = rng.below(res.len());
+            res[i] = random_op(rng);
+        }
+        _ => {
+            // Repeat a span of operations
+            let i = rng.below(res.len() + 1);
+            let j = i + rng.below(res.len() - i + 1);
+            let span: Vec<String> = res[i..j].to_vec();
+            for (k, op) in span.into_iter().enumerate() {
+                res.insert(j + k, op);
+            }
+        }
+    }
+    res
+}
+
+/// Searches for a sequence of operations whose costliest operation is as costly as possible
+fn search(flash: &Flash, fs_sectors: &[&Sector], seed: u64, iterations: usize) -> Vec<String> {
+    let mut rng = Lcg(seed);
+    let mut best: Vec<String> = (0..32).map(|_| random_op(&mut rng)).collect();
+    let mut best_cost = worst_op(flash, fs_sectors, &best).map_or(0, |x| x.1);
+    for _ in 0..iterations {
+        let candidate = mutate(&best, &mut rng);
+        if let Some((_, cost)) = worst_op(flash, fs_sectors, &candidate) {
+            if cost > best_cost {
+                best = candidate;
+                best_cost = cost;
+            }
+        }
+    }
+    best
+}
+
+/// Removes as many operations as possible from `ops`, as long as its costliest operation stays as
+/// costly
+fn minimize(flash: &Flash, fs_sectors: &[&Sector], mut ops: Vec<String>) -> Vec<String> {
+    let (worst, cost) = worst_op(flash, fs_sectors, &ops).unwrap();
+    ops.truncate(worst + 1);
+    let mut chunk = ops.len() / 2;
+    while chunk > 0 {
+        let mut i = 0;
+        while i + chunk <= ops.len() {
+            let candidate: Vec<String> =
+                ops[..i].iter().chain(&ops[i + chunk..]).cloned().collect();
+            if worst_op(flash, fs_sectors, &candidate).map_or(false, |x| x.1 >= cost) {
+                ops = candidate;
+            } else {
+                i += chunk;
+            }
+        }
+        chunk /= 2;
+    }
+    ops
+}
+
+/// Returns the entries of the regression corpus, as their name, the on-card time of their
+/// costliest operation and their operations
+pub fn corpus() -> Vec<(String, u64, Vec<String>)> {
+    let mut paths: Vec<_> = fs::read_dir(CORPUS)
+        .unwrap()
+        .map(|x| x.unwrap().path())
+        .collect();
+    paths.sort();
+    paths
+        .into_iter()
+        .map(|path| {
+            let contents = fs::read_to_string(&path).unwrap();
+            let worst = contents
+                .lines()
+                .find(|l| l.starts_with(WORST_HEADER))
+                .map_or(0, |l| l[WORST_HEADER.len()..].parse().unwrap());
+            let ops = contents
+                .lines()
+                .filter(|l| !l.starts_with('#'))
+                .map(|l| l.to_string())
+                .collect();
+            let name = path.file_name().unwrap().to_string_lossy().into_owned();
+            (name, worst, ops)
+        })
+        .collect()
+}
+
+speculate! {
+    describe "fuzz" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+        }
+
+        it "does not get costlier on the corpus" {
+            for (name, worst, ops) in corpus() {
+                let (_, cost) = worst_op(&flash, &fs_sectors, &ops).expect("Corpus entry failed");
+                assert!(cost <= worst, "{} went from {}ns to {}ns", name, worst, cost);
+            }
+        }
+
+        #[ignore]
+        it "searches for defragmentation cliffs" {
+            let iterations = env::var("FUZZ_ITERATIONS").ok().map_or(500, |x| x.parse().unwrap());
+            let seed = env::var("FUZZ_SEED").ok().map_or(1, |x| x.parse().unwrap());
+            let found = search(&flash, &fs_sectors, seed, iterations);
+            let ops = minimize(&flash, &fs_sectors, found);
+            let (worst, cost) = worst_op(&flash, &fs_sectors, &ops).unwrap();
+            println!("Worst operation: {} ({}ms on card), after {} operations", ops[worst], cost / 1_000_000, worst);
+            if corpus().iter().all(|x| x.2 != ops) {
+                // Named after the seed only, as the cost in the header changes on rebaselines
+                let mut path = format!("{}/cliff-{}.trace", CORPUS, seed);
+                let mut n = 1;
+                while ::std::path::Path::new(&path).exists() {
+                    n += 1;
+                    path = format!("{}/cliff-{}-{}.trace", CORPUS, seed, n);
+                }
+                let mut contents = format!("# Found by the latency fuzzer (see fs/fuzz.rs)\n{}{}\n", WORST_HEADER, cost);
+                for op in ops.iter() {
+                    contents += op;
+                    contents += "\n";
+                }
+                fs::write(&path, contents).unwrap();
+                println!("Added {} to the corpus", path);
+            }
+        }
+    }
+}
@@ -0,0 +1,483 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//! Table of the files of a filesystem
+//!
+//! By default, the table is a [`HashSet`] holding every file in RAM, rebuilt at each mount, so
+//! that the number of files is bounded by the kernel heap rather than by the flash. It can instead
+//! be kept on flash (see [`FileSystem::with_index`]), in a dedicated sector, with only a few hot
+//! files cached in RAM.
+//!
+//! The on-flash index is an open-addressing hash table of 8-byte records, in which records are
+//! never overwritten but appended and then obsoleted, as the flash allows:
+//!
+//! ```text
+//!  0       1        2          4               8
+//! +-------+--------+----------+---------------+
+//! | state | sector | tag hash | block offset  |
+//! +-------+--------+----------+---------------+
+//! ```
+//!
+//! A record is free while all its bytes are `0xFF`, and its state is only set to live once the
+//! rest of it is programmed. As free slots never come back until the sector is erased, a lookup
+//! probes from the slot of the tag hash up to the first free slot. Once three quarters of the
+//! slots are used, the index is rebuilt from the blocks on flash, as long as this brings it back
+//! under three quarters. Otherwise the free slots are used up first, and the index is only rebuilt
+//! once there are none left, so that a crowded index does not get erased at every write.
+//!
+//! The index is only a shortcut to the blocks, which stay the reference: records are checked
+//! against the block they point to (which must be a valid one, with the same tag) before being
+//! trusted. A record is obsoleted before its block is invalidated, and added after its block is
+//! made valid, so that an interrupted operation leaves, at worst, a valid block without a record.
+//! Mounting thus adds the records missing for valid blocks, and obsoletes the ones that no longer
+//! point to a valid block, before any sector gets erased and reused.
+//!
+//! [`HashSet`]: ../hashset/struct.HashSet.html
+//! [`FileSystem::with_index`]: struct.FileSystem.html#method.with_index
+
+use super::{parse_hdr, Error, File, Format, ScanCursor, SectorID};
+use alloc::vec::Vec;
+use core::cell::{Cell, Ref, RefCell};
+use core::ops::Deref;
+use flash::{Flash, IOError as FlashIOError, Sector};
+use hashset::HashSet;
+
+/// Magic number at the beginning of an index sector, followed by the version of the format
+const INDEX_MAGIC: [u8; 4] = *b"FSIX";
+/// Version of the format of the index
+const INDEX_VERSION: u8 = 1;
+/// Size of a record (and of the header)
+const RECORD_SIZE: usize = 8;
+/// Value of the `state` byte of a record whose tag and offset are set
+const RECORD_LIVE: u8 = 0x7F;
+/// Value of the `state` byte of a record that was obsoleted
+const RECORD_OBSOLETE: u8 = 0x00;
+/// Number of files cached in RAM in front of an on-flash index
+const INDEX_CACHE_SIZE: usize = 16;
+
+/// Hashes a tag, with a function that must stay stable across versions as it lays out the index
+/// (and the shared payloads of a deduplicating filesystem)
+pub(super) fn hash(tag: &[u8]) -> u32 {
+    // FNV-1a
+    tag.iter()
+        .fold(0x811c9dc5, |h, &b| (h ^ b as u32).wrapping_mul(0x01000193))
+}
+
+/// Reference to a file of a [`Files`](enum.Files.html) table
+pub(super) enum FileRef<'r, 'a: 'r> {
+    /// File of a table held in RAM
+    Ram(&'r File<'a>),
+    /// File cached in front of an on-flash index
+    Cached(Ref<'r, File<'a>>),
+}
+
+impl<'r, 'a> Deref for FileRef<'r, 'a> {
+    type Target = File<'a>;
+
+    fn deref(&self) -> &File<'a> {
+        match *self {
+            FileRef::Ram(f) => f,
+            FileRef::Cached(ref f) => f,
+        }
+    }
+}
+
+/// Table of the files of a filesystem
+pub(super) enum Files<'a> {
+    /// All files, held in RAM
+    Ram(HashSet<File<'a>>),
+    /// Files indexed on flash
+    Flash(Index<'a>),
+}
+
+impl<'a> Files<'a> {
+    /// Returns the file tagged `tag`
+    pub fn get<'r>(&'r self, tag: &[u8]) -> Option<FileRef<'r, 'a>> {
+        match *self {
+            Files::Ram(ref set) => set.get(tag).map(FileRef::Ram),
+            Files::Flash(ref index) => index.get(tag).map(FileRef::Cached),
+        }
+    }
+
+    /// Removes the file tagged `tag` from the table, and returns it
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs while obsoleting its record
+    pub fn take(&mut self, tag: &[u8]) -> Result<Option<File<'a>>, Error> {
+        match *self {
+            Files::Ram(ref mut set) => Ok(set.take(tag)),
+            Files::Flash(ref mut index) => index.take(tag),
+        }
+    }
+
+    /// Adds a file, whose block must already be valid, to the table
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs while adding its record, or if the index is full of live
+    /// records
+    pub fn insert(&mut self, f: File<'a>) -> Result<(), Error> {
+        match *self {
+            Files::Ram(ref mut set) => {
+                set.insert(f);
+                Ok(())
+            }
+            Files::Flash(ref mut index) => index.insert(f),
+        }
+    }
+}
+
+/// Record of an on-flash index
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+struct Record {
+    /// State of the record (`RECORD_LIVE`, `RECORD_OBSOLETE`, or anything else if it was
+    /// interrupted while being added)
+    state: u8,
+    /// Sector the block is on
+    sector: SectorID,
+    /// Lower 16 bits of the hash of the tag
+    hash: u16,
+    /// Index of the block in its sector
+    offset: usize,
+}
+
+impl Record {
+    /// Parses a record, returning `None` if it is free
+    fn parse(raw: &[u8]) -> Option<Record> {
+        if raw.iter().all(|&x| x == 0xFF) {
+            return None;
+        }
+        Some(Record {
+            state: raw[0],
+            sector: SectorID(raw[1] as usize),
+            hash: raw[2] as u16 | (raw[3] as u16) << 8,
+            offset: (0..4).fold(0, |acc, i| acc | (raw[4 + i] as usize) << (8 * i)),
+        })
+    }
+}
+
+/// Hash table of the files kept on a flash sector, behind a small RAM cache
+pub(super) struct Index<'a> {
+    /// Reference towards the flash
+    flash: &'a Flash,
+
+    /// Sector holding the index
+    sector: &'a Sector,
+
+    /// Sectors of the filesystem, the records point into
+    sectors: &'a [&'a Sector],
+
+    /// Format of the blocks on flash
+    format: Format,
+
+    /// Number of slots that are not free
+    used: usize,
+
+    /// Whether the valid blocks were found too many for a rebuild to bring the used slots under
+    /// three quarters
+    dense: bool,
+
+    /// Recently used files, along with the slot of their record, by hash of their tag
+    cache: RefCell<Vec<Option<(usize, File<'a>)>>>,
+}
+
+impl<'a> Index<'a> {
+    /// Opens the index held on `sector`, of the files in `sectors`
+    ///
+    /// The sector is erased if it does not hold an index yet, and the records not pointing to a
+    /// valid block any longer are obsoleted. The caller is then expected to
+    /// [`insert`](#method.insert) the valid blocks that are not indexed yet.
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs
+    pub fn open(
+        flash: &'a Flash,
+        sector: &'a Sector,
+        sectors: &'a [&'a Sector],
+        format: Format,
+    ) -> Result<Index<'a>, Error> {
+        let mut res = Index {
+            flash: flash,
+            sector: sector,
+            sectors: sectors,
+            format: format,
+            used: 0,
+            dense: false,
+            cache: RefCell::new((0..INDEX_CACHE_SIZE).map(|_| None).collect()),
+        };
+        let header = unsafe { &sector.raw()[..RECORD_SIZE] };
+        if header[..4] != INDEX_MAGIC || header[4] != INDEX_VERSION {
+            debug!("Formatting index sector {}", sector.num());
+            get!(res.clear());
+            return Ok(res);
+        }
+        for slot in 0..res.slots() {
+            if let Some(rec) = res.record(slot) {
+                res.used += 1;
+                if rec.state == RECORD_LIVE && res.resolve(rec).is_none() {
+                    debug!("  Obsoleting stale record {}", slot);
+                    get!(res.obsolete(slot));
+                }
+            }
+        }
+        Ok(res)
+    }
+
+    /// Returns the number of slots of the index
+    fn slots(&self) -> usize {
+        self.sector.len() / RECORD_SIZE - 1
+    }
+
+    /// Returns the record in a slot, unless it is free
+    fn record(&self, slot: usize) -> Option<Record> {
+        let pos = (slot + 1) * RECORD_SIZE;
+        Record::parse(unsafe { &self.sector.raw()[pos..pos + RECORD_SIZE] })
+    }
+
+    /// Returns the block a record points to, if it is a valid one with a tag of the same hash
+    fn resolve(&self, rec: Record) -> Option<(&'a Sector, super::RawBlock)> {
+        let sector = *self.sectors.get(rec.sector.0)?;
+        let zone = unsafe { sector.raw() };
+        if rec.offset >= zone.len() {
+            return None;
+        }
+        let b = parse_hdr(&zone[rec.offset..], self.format).ok()?;
+        let b = b.offset(rec.offset);
+        if b.valid && hash(&zone[b.tag..b.tag + b.taglen]) as u16 == rec.hash {
+            Some((sector, b))
+        } else {
+            None
+        }
+    }
+
+    /// Looks a tag up on flash, returning the slot of its record and the file
+    fn lookup(&self, tag: &[u8]) -> Option<(usize, File<'a>)> {
+        let h = hash(tag);
+        let slots = self.slots();
+        for i in 0..slots {
+            let slot = (h as usize + i) % slots;
+            let rec = self.record(slot)?;
+            if rec.state != RECORD_LIVE || rec.hash != h as u16 {
+                continue;
+            }
+            if let Some((sector, b)) = self.resolve(rec) {
+                if unsafe { &sector.raw()[b.tag..b.tag + b.taglen] } == tag {
+                    let f = File {
+                        tag: sector.read(b.tag, b.taglen).ok()?,
+                        data: sector.read(b.data, b.datalen).ok()?,
+                        sector: rec.sector,
+                        size: b.size,
+                        unchecked: Cell::new(b.payload),
+                        content: b.content,
+                    };
+                    return Some((slot, f));
+                }
+            }
+        }
+        None
+    }
+
+    /// Returns the file tagged `tag`, caching it
+    pub fn get(&self, tag: &[u8]) -> Option<Ref<File<'a>>> {
+        let i = hash(tag) as usize % INDEX_CACHE_SIZE;
+        let cached = match self.cache.borrow()[i] {
+            Some((_, ref f)) => &f.tag as &[u8] == tag,
+            None => false,
+        };
+        if !cached {
+            let found = self.lookup(tag)?;
+            self.cache.borrow_mut()[i] = Some(found);
+        }
+        Some(Ref::map(self.cache.borrow(), |c| &c[i].as_ref().unwrap().1))
+    }
+
+    /// Removes the file tagged `tag` from the index, and returns it
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs while obsoleting its record
+    pub fn take(&mut self, tag: &[u8]) -> Result<Option<File<'a>>, Error> {
+        let i = hash(tag) as usize % INDEX_CACHE_SIZE;
+        let cached = match self.cache.borrow()[i] {
+            Some((_, ref f)) => &f.tag as &[u8] == tag,
+            None => false,
+        };
+        let found = if cached {
+            self.cache.borrow_mut()[i].take()
+        } else {
+            self.lookup(tag)
+        };
+        match found {
+            Some((slot, f)) => {
+                get!(self.obsolete(slot));
+                Ok(Some(f))
+            }
+            None => Ok(None),
+        }
+    }
+
+    /// Adds a file, whose block must already be valid, to the index
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs, or if the valid blocks are more than the slots
+    pub fn insert(&mut self, f: File<'a>) -> Result<(), Error> {
+        let slots = self.slots();
+        let max = if self.used == slots {
+            // Only a rebuild can free a slot
+            Some(slots)
+        } else if 4 * (self.used + 1) > 3 * slots && !self.dense {
+            Some(3 * slots / 4 - 1)
+        } else {
+            None
+        };
+        if let Some(max) = max {
+            // The block being valid already, rebuilding indexes it along with the others
+            match self.rebuild(max) {
+                Err(Error::OutOfFlash) if self.used < slots => self.dense = true,
+                res => return res,
+            }
+        }
+        let h = hash(&f.tag);
+        let offset = f.header(self.format);
+        let slot = get!(self.append(h, f.sector, offset));
+        self.cache.borrow_mut()[h as usize % INDEX_CACHE_SIZE] = Some((slot, f));
+        Ok(())
+    }
+
+    /// Appends a record to the index, returning its slot
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs, or if there is no free slot left
+    fn append(&mut self, h: u32, sector: SectorID, offset: usize) -> Result<usize, Error> {
+        let slots = self.slots();
+        let slot = get!((0..slots)
+            .map(|i| (h as usize + i) % slots)
+            .find(|&slot| self.record(slot).is_none())
+            .ok_or(Error::OutOfFlash));
+        let mut raw = [0; RECORD_SIZE];
+        raw[0] = RECORD_LIVE;
+        raw[1] = sector.0 as u8;
+        raw[2] = h as u8;
+        raw[3] = (h >> 8) as u8;
+        for i in 0..4 {
+            raw[4 + i] = (offset >> (8 * i)) as u8;
+        }
+        // The state is programmed last, so that an interrupted append never leaves a live record
+        get!(get!(self.sector.with_writer(
+            self.flash,
+            (slot + 1) * RECORD_SIZE,
+            RECORD_SIZE,
+            |mut b| -> Result<(), FlashIOError> {
+                get!(b.write_block(1, &raw[1..]));
+                get!(b.barrier());
+                b.write(0, raw[0])
+            }
+        )));
+        self.used += 1;
+        Ok(slot)
+    }
+
+    /// Obsoletes the record in a slot
+    fn obsolete(&mut self, slot: usize) -> Result<(), Error> {
+        get!(get!(self.sector.with_writer(
+            self.flash,
+            (slot + 1) * RECORD_SIZE,
+            1,
+            |mut b| b.write(0, RECORD_OBSOLETE)
+        )));
+        Ok(())
+    }
+
+    /// Erases the index, leaving it empty
+    fn clear(&mut self) -> Result<(), Error> {
+        get!(self.sector.erase(self.flash));
+        get!(get!(self.sector.with_writer(
+            self.flash,
+            0,
+            RECORD_SIZE,
+            |mut b| -> Result<(), FlashIOError> {
+                get!(b.write_block(0, &INDEX_MAGIC));
+                b.write(4, INDEX_VERSION)
+            }
+        )));
+        self.used = 0;
+        self.dense = false;
+        for f in self.cache.borrow_mut().iter_mut() {
+            *f = None;
+        }
+        Ok(())
+    }
+
+    /// Rebuilds the index from the valid blocks on flash, dropping its obsolete records
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs, or if there are more than `max` valid blocks, in which
+    /// case the index is left as it is
+    fn rebuild(&mut self, max: usize) -> Result<(), Error> {
+        let (sectors, format) = (self.sectors, self.format);
+        // The blocks are counted first, as the index cannot be restored once erased
+        let mut valid = 0;
+        get!(scan_valid(sectors, format, |_, _, _| {
+            valid += 1;
+            Ok(())
+        }));
+        if valid > max {
+            debug!("Not rebuilding index sector {}", self.sector.num());
+            return err!(Error::OutOfFlash);
+        }
+        debug!("Rebuilding index sector {}", self.sector.num());
+        get!(self.clear());
+        get!(scan_valid(sectors, format, |h, sector, pos| {
+            self.append(h, sector, pos).map(|_| ())
+        }));
+        self.dense = 4 * (self.used + 1) > 3 * self.slots();
+        Ok(())
+    }
+}
+
+/// Calls `f` with the hash of the tag, the sector and the offset of each valid block of `sectors`
+fn scan_valid<F>(sectors: &[&Sector], format: Format, mut f: F) -> Result<(), Error>
+where
+    F: FnMut(u32, SectorID, usize) -> Result<(), Error>,
+{
+    let zones: Vec<(&Sector, usize)> = sectors.iter().map(|&x| (x, x.len())).collect();
+    for (id, mut cursor) in ScanCursor::all(&zones, format).into_iter().enumerate() {
+        while !cursor.done() {
+            let pos = cursor.pos();
+            match cursor.next() {
+                Ok(b) => {
+                    if b.valid {
+                        get!(f(hash(cursor.tag(&b)), SectorID(id), pos));
+                    }
+                }
+                Err(super::ParseNoBlock::Erased(_)) => (),
+                Err(_) => break,
+            }
+        }
+    }
+    Ok(())
+}
@@ -0,0 +1,294 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2020, National Cybersecurity Agency of France (ANSSI)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//! Offline provisioning of filesystem images, run with `make mkfs MANIFEST=<file>`
+//!
+//! A manifest lists the files to provision, one per line (lines starting with `#` are comments):
+//!  * `f <tag> <data>` writes a file,
+//!  * `a <tag> <data>` writes an applet, usually from its CAP file,
+//!  * `z <tag> <len>` creates a file of `len` zeros (see `FileSystem::create_zeroed`),
+//!
+//! where tags and data are given in hexadecimal, or data as `@<path>` to take it from a file
+//! (relative to the manifest).
+//!
+//! The files are written by the filesystem itself, on a freshly erased flash laid out along
+//! `FLASH_GEOMETRY`, so that the image is in the exact on-flash block format. They are written in
+//! the order of their tags, which leaves no invalid block and clusters them as a defragmentation
+//! would. The filesystem sectors are then output as an Intel HEX file, to be loaded along with the
+//! firmware with `flash write_image erase fs.hex`.
+
+#![cfg(test)]
+#![allow(unused_variables, unused_mut)]
+
+use super::*;
+#[cfg(test)]
+use speculate::speculate; // Must be imported into the current scope.
+
+use std::cmp::{max, min};
+use std::path::Path;
+use std::{env, fs};
+use {flash_ll, FLASH_GEOMETRY, SECTORS};
+
+/// Address the flash is mapped at on the STM32F401 (see `stm32f401xe.ld`)
+const FLASH_ADDRESS: u32 = 0x0800_0000;
+
+/// File to provision
+#[derive(Debug, PartialEq, Eq)]
+pub enum Entry {
+    /// File of the given tag and data
+    File(Vec<u8>, Vec<u8>),
+
+    /// Applet of the given tag and data
+    Applet(Vec<u8>, Vec<u8>),
+
+    /// File of the given tag, holding the given number of zeros
+    Zeroed(Vec<u8>, usize),
+}
+
+impl Entry {
+    /// Returns the tag of the file
+    fn tag(&self) -> &[u8] {
+        match *self {
+            Entry::File(ref tag, _) | Entry::Applet(ref tag, _) | Entry::Zeroed(ref tag, _) => tag,
+        }
+    }
+}
+
+/// Parses `s` as hexadecimal
+///
+/// # Panics
+///
+/// Panics if `s` is not an even number of hexadecimal digits.
+fn parse_hex(s: &str) -> Vec<u8> {
+    assert!(
+        s.len() % 2 == 0,
+        "Odd number of hexadecimal digits in {}",
+        s
+    );
+    (0..s.len())
+        .step_by(2)
+        .map(|i| u8::from_str_radix(&s[i..i + 2], 16).expect("Invalid hexadecimal"))
+        .collect()
+}
+
+/// Parses the data of a manifest entry, reading files relative to `dir`
+fn parse_data(s: &str, dir: &Path) -> Vec<u8> {
+    if s.starts_with('@') {
+        fs::read(dir.join(&s[1..])).expect("Unable to read the data of a manifest entry")
+    } else {
+        parse_hex(s)
+    }
+}
+
+/// Parses the manifest `text`, reading the data files it names relative to `dir`
+///
+/// # Panics
+///
+/// Panics if the manifest is malformed or a data file cannot be read.
+pub fn parse_manifest(text: &str, dir: &Path) -> Vec<Entry> {
+    text.lines()
+        .map(|l| l.trim())
+        .filter(|l| !l.is_empty() && !l.starts_with('#'))
+        .map(|l| {
+            let words: Vec<&str> = l.split_whitespace().collect();
+            assert!(words.len() == 3, "Malformed manifest line: {}", l);
+            let tag = parse_hex(words[1]);
+            match words[0] {
+                "f" => Entry::File(tag, parse_data(words[2], dir)),
+                "a" => Entry::Applet(tag, parse_data(words[2], dir)),
+                "z" => Entry::Zeroed(tag, words[2].parse().expect("Invalid length")),
+                op => panic!("Unknown manifest entry {}", op),
+            }
+        })
+        .collect()
+}
+
+/// Writes `entries` on `fs`, in the order of their tags
+///
+/// Of several entries of the same tag, only the last one is written, so as not to leave the others
+/// as invalid blocks.
+pub fn provision(fs: &mut FileSystem, entries: &[Entry]) -> Result<(), Error> {
+    let mut sorted: Vec<&Entry> = entries.iter().collect();
+    sorted.sort_by(|a, b| a.tag().cmp(b.tag()));
+    for (i, entry) in sorted.iter().enumerate() {
+        if sorted.get(i + 1).map_or(false, |x| x.tag() == entry.tag()) {
+            continue;
+        }
+        match **entry {
+            Entry::File(ref tag, ref data) => get!(fs.write(tag, data)),
+            Entry::Applet(ref tag, ref data) => get!(fs.write_applet(tag, data)),
+            Entry::Zeroed(ref tag, len) => get!(fs.create_zeroed(tag, len)),
+        }
+    }
+    Ok(())
+}
+
+/// Returns the Intel HEX record of type `kind` holding `data` at `address`
+fn record(address: u16, kind: u8, data: &[u8]) -> String {
+    let mut bytes = vec![data.len() as u8, (address >> 8) as u8, address as u8, kind];
+    bytes.extend_from_slice(data);
+    let sum = bytes.iter().fold(0u8, |acc, &x| acc.wrapping_add(x));
+    bytes.push(sum.wrapping_neg());
+    let mut res = String::from(":");
+    for x in bytes {
+        res += &format!("{:02X}", x);
+    }
+    res + "\n"
+}
+
+/// Returns an Intel HEX file holding `chunks`, given as (address, contents) pairs
+///
+/// Each chunk stops after its last programmed byte: `flash write_image erase` erases all the
+/// sectors an image touches, so the blank flash past it need not be written. A chunk that is blank
+/// altogether still gets a record, for its sector to be erased too.
+pub fn ihex(chunks: &[(u32, &[u8])]) -> String {
+    let mut res = String::new();
+    let mut upper = None;
+    for &(address, data) in chunks {
+        let used = data.iter().rposition(|&x| x != 0xFF).map_or(0, |x| x + 1);
+        let end = min(data.len(), max(16, (used + 15) & !15));
+        for offset in (0..end).step_by(16) {
+            let at = address + offset as u32;
+            if upper != Some(at >> 16) {
+                upper = Some(at >> 16);
+                res += &record(0, 4, &[(at >> 24) as u8, (at >> 16) as u8]);
+            }
+            res += &record(at as u16, 0, &data[offset..min(end, offset + 16)]);
+        }
+    }
+    res + &record(0, 1, &[])
+}
+
+/// Builds the filesystem holding `entries` on the emulated flash, and returns it as an Intel HEX
+/// file
+///
+/// The emulated flash must be cut along `SECTORS`, so that the addresses of the image are those of
+/// the card.
+pub fn build(entries: &[Entry]) -> Result<String, Error> {
+    let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+    let mut ids: Vec<flash::SectorID> = FLASH_GEOMETRY.sectors.to_vec();
+    ids.extend(FLASH_GEOMETRY.index);
+    for &id in ids.iter() {
+        flash.sector(id).erase(&flash).unwrap();
+    }
+    let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+    let mut fs = get!(match FLASH_GEOMETRY.index {
+        Some(index) => FileSystem::with_index(
+            &flash,
+            &fs_sectors,
+            FLASH_GEOMETRY.defrag,
+            FLASH_GEOMETRY.applet,
+            Format::default(),
+            flash.sector(index),
+        ),
+        None => FileSystem::new(
+            &flash,
+            &fs_sectors,
+            FLASH_GEOMETRY.defrag,
+            FLASH_GEOMETRY.applet,
+        ),
+    });
+    get!(provision(&mut fs, entries));
+    drop(fs);
+
+    let blocks: Vec<(u32, FlashBlock)> = ids
+        .iter()
+        .map(|&id| {
+            let sector = flash.sector(id);
+            let address = FLASH_ADDRESS + SECTORS[id.0].0 as u32;
+            (address, sector.read(0, sector.len()).unwrap())
+        })
+        .collect();
+    let chunks: Vec<(u32, &[u8])> = blocks.iter().map(|x| (x.0, &*x.1)).collect();
+    Ok(ihex(&chunks))
+}
+
+speculate! {
+    describe "mkfs" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            let path = env::temp_dir().join(format!("javacard-os-mkfs-{}.img", ::std::process::id()));
+            let _ = fs::remove_file(&path);
+            flash_ll::map_image(&path, &SECTORS).unwrap();
+        }
+
+        after {
+            flash_ll::unmap_image();
+            fs::remove_file(&path).unwrap();
+        }
+
+        it "writes Intel HEX records" {
+            let data = [0x42; 20];
+            let hex = ihex(&[(0x0800_4000, &data), (0x0801_0000, &[0xFF; 64])]);
+            assert_eq!(hex, ":020000040800F2\n\
+                             :104000004242424242424242424242424242424290\n\
+                             :0440100042424242A4\n\
+                             :020000040801F1\n\
+                             :10000000FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF00\n\
+                             :00000001FF\n");
+        }
+
+        it "provisions a filesystem from a manifest" {
+            let dir = env::temp_dir();
+            let cap = format!("javacard-os-mkfs-{}.cap", ::std::process::id());
+            let cap_data: Vec<u8> = (0..3000).map(|x| x as u8).collect();
+            fs::write(dir.join(&cap), &cap_data).unwrap();
+            let manifest = format!(
+                "# Test manifest\n\
+                 f 0300000001 76616c7565\n\
+                 \n\
+                 a 01020304 @{}\n\
+                 z 0300000002 300\n\
+                 f 0300000001 76616c756532\n",
+                cap);
+            let entries = parse_manifest(&manifest, &dir);
+            fs::remove_file(dir.join(&cap)).unwrap();
+            assert_eq!(entries.len(), 4);
+            assert_eq!(entries[1], Entry::Applet(vec![1, 2, 3, 4], cap_data.clone()));
+
+            let hex = build(&entries).unwrap();
+            assert!(hex.starts_with(":020000040800F2\n"));
+            assert!(hex.ends_with(":00000001FF\n"));
+            assert!(hex.lines().all(|l| l.len() <= 11 + 32));
+
+            // The image mounts as-is, with every file in place and no invalid block
+            let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+            let fs_sectors = FLASH_GEOMETRY.fs_sectors(&flash);
+            let fs = FileSystem::new(&flash, &fs_sectors, FLASH_GEOMETRY.defrag, FLASH_GEOMETRY.applet).unwrap();
+            assert_eq!(&*fs.read(b"\x03\x00\x00\x00\x01").unwrap(), b"value2");
+            assert_eq!(&*fs.read(b"\x01\x02\x03\x04").unwrap(), &cap_data as &[u8]);
+            assert_eq!(fs.length(b"\x03\x00\x00\x00\x02").unwrap(), 300);
+            let stats = fs.stats();
+            assert_eq!(stats.valid, stats.used);
+        }
+
+        #[ignore]
+        it "builds the image of a manifest" {
+            let manifest = env::var("MKFS_MANIFEST").expect("MKFS_MANIFEST is not set");
+            let output = env::var("MKFS_OUTPUT").unwrap_or_else(|_| "fs.hex".to_string());
+            let dir = Path::new(&manifest).parent().unwrap();
+            let entries = parse_manifest(&fs::read_to_string(&manifest).unwrap(), dir);
+            fs::write(&output, build(&entries).unwrap()).unwrap();
+            println!("Wrote {} files to {}", entries.len(), output);
+        }
+    }
+}
@@ -59,6 +59,11 @@
 //! In order to ensure this, a sector is designated as "defragmentation sector", and is reserved
 //! for only holding temporary data during defragmentation.
 //!
+//! When copying the blocks back, the defragmentation groups them by the first bytes of their tags
+//! (up to the class, for the fields of an object), in increasing order, so that related files end
+//! up next to each other. It then appends a summary of the clusters (see `Summary`), which
+//! [`FileSystem::scan_prefix`] uses to skip to the blocks whose tags start with a given prefix.
+//!
 //! # Block layout
 //!
 //! ## Header (1 byte)
@@ -119,17 +124,97 @@
 //! ```
 //! The `A` and `B` fields are set to zero before checksumming in order to have the checksum
 //! consistent independently of the validity state of the block.
-
+//!
+//! If the filesystem is used with a [`Format`] whose checksum is [`Checksum::Crc32`], `H` is
+//! instead a 4-byte CRC-32/MPEG-2, most significant byte first, over `E`, `F` and `G` followed by
+//! the header byte (with `A` and `B` set to zero). Having the header byte last allows to compute
+//! the bulk of the checksum directly from flash with the hardware CRC unit.
+//!
+//! ## Lazily-checked payload
+//!
+//! If the filesystem is used with a [`Format`] with `lazy_payload` set, the checksum is split in
+//! two:
+//! ```none
+//! +-+---------------+---------------+---------------+---------------+---------------+
+//! |.|       E       |       F       |      H1       |       G       |      H2       |
+//! +-+---------------+---------------+---------------+---------------+---------------+
+//! ```
+//!
+//! `H1`: Checksum over the header byte (with `A` and `B` set to zero), `E` and `F`, computed as
+//!       `H` above
+//!
+//! `H2`: Checksum over `G`, computed as `H` above with a null header byte
+//!
+//! Only `H1` is verified while mounting the filesystem, so that mounting time only depends on the
+//! number of files and not on their size. `H2` is verified the first time the data is accessed,
+//! or when the block is moved by a defragmentation.
+//!
+//! ## Aligned blocks
+//!
+//! If the filesystem is used with a [`Format`] with `aligned` set, blocks start on 32-bit
+//! boundaries and are written with whole-word programs only:
+//!
+//! * `D` is always `0`, and `E` is always 3 bytes long, so that the header and the data length
+//!   field fill the first word of the block;
+//! * `F` (followed by `H1` if the payload is checked lazily) is padded with `0xFF`'s up to the
+//!   next 32-bit boundary, so that `G` starts on one;
+//! * the block is padded with `0xFF`'s up to the next 32-bit boundary after `H` (or `H2`).
+//!
+//! Padding bytes are covered by the checksums like any other byte.
+//!
+//! ## Deduplicated payloads
+//!
+//! If the filesystem is used with a [`Format`] with `dedup` set, data of at least
+//! `DEDUP_MIN_LEN` bytes is stored once, as a shared payload: a block whose tag is `0xFF`, `'P'`,
+//! then the 4-byte FNV-1a hash of the data (most significant byte first). Each file holding the
+//! data is then a reference block, whose `G` is that hash and whose `E` is in long form (3 bytes
+//! for aligned blocks) with its most significant bit set.
+//!
+//! References are counted at mount, and a payload is erased along with the last file referencing
+//! it. Editing a file referencing a payload gives it a copy of its own, and defragmenting copies a
+//! payload once, whatever the number of files referencing it. Payloads left unreferenced by an
+//! interrupted write or erase are erased at mount.
+//!
+//! ## Zeroed files
+//!
+//! A file created with [`FileSystem::create_zeroed`] is a block without `G`, whose `E` is in long
+//! form (3 bytes for aligned blocks) with its second most significant bit set, the other bits
+//! giving the number of zeros the file is made of. The zeros are only written out, as a regular
+//! block, by the first edit of the file.
+//!
+//! ## On-flash index
+//!
+//! The hashmap rebuilt in RAM on each boot takes heap in proportion to the number of files. A
+//! filesystem mounted with [`FileSystem::with_index`] instead keeps it in a dedicated sector, with
+//! only a few hot files cached in RAM, so that the number of files is bounded by the flash. The
+//! blocks remain the reference, the index being repaired against them at mount (see the `index`
+//! module).
+//!
+//! [`Format`]: struct.Format.html
+//! [`FileSystem::with_index`]: struct.FileSystem.html#method.with_index
+//! [`FileSystem::scan_prefix`]: struct.FileSystem.html#method.scan_prefix
+//! [`FileSystem::create_zeroed`]: struct.FileSystem.html#method.create_zeroed
+//! [`Checksum::Crc32`]: enum.Checksum.html#variant.Crc32
+
+mod bench;
+mod fsck;
+mod fuzz;
+mod index;
+mod mkfs;
 mod tests;
 
 use alloc::vec;
 use alloc::vec::Vec;
 use core::borrow::Borrow;
+use core::cell::Cell;
 use core::hash::{Hash, Hasher};
 use core::usize;
 use flash::IOError as FlashIOError;
-use flash::{Flash, FlashBlock, Sector};
+use flash::{Flash, FlashBlock, FlashBlockMut, Sector};
 use hashset::HashSet;
+use {crc_ll, flash, scan_ll};
+
+use self::index::{Files, Index};
 
 /// An error that can happen during a filesystem operation
 #[derive(Debug, PartialEq, Eq, Clone, Copy)]
@@ -148,6 +233,33 @@ pub enum Error {
 
     /// A flash IO error occured during the requested operation
     IO(FlashIOError),
+
+    /// The data of the file does not match its checksum (see [`Format`] for more details)
+    ///
+    /// [`Format`]: struct.Format.html
+    Corrupted,
+
+    /// The operation would have to defragment a sector, which was not allowed (see
+    /// [`FileSystem::write_nodefrag`])
+    ///
+    /// [`FileSystem::write_nodefrag`]: struct.FileSystem.html#method.write_nodefrag
+    WouldBlock,
+
+    /// The file is zeroed and has no data on flash to be read in place (see
+    /// [`FileSystem::materialize`])
+    ///
+    /// [`FileSystem::materialize`]: struct.FileSystem.html#method.materialize
+    Zeroed,
+
+    /// All the handles are taken (see [`FileSystem::open`])
+    ///
+    /// [`FileSystem::open`]: struct.FileSystem.html#method.open
+    TooManyHandles,
+
+    /// The bytes to edit go past the end of the file (see [`FileSystem::edit_at`])
+    ///
+    /// [`FileSystem::edit_at`]: struct.FileSystem.html#method.edit_at
+    OutOfBounds,
 }
 
 impl From<FlashIOError> for Error {
@@ -171,6 +283,51 @@ struct File<'a> {
 
     /// Total size of the file block
     size: usize,
+
+    /// Checksum the data has to be verified against, if it has not been verified yet
+    unchecked: Cell<Option<u32>>,
+
+    /// What `data` holds
+    content: Content,
+}
+
+impl<'a> File<'a> {
+    /// Returns the index, in its sector, of the header of the block of the file
+    fn header(&self, format: Format) -> usize {
+        let lenlen = if self.content == Content::Data {
+            format.lenlen(self.data.len())
+        } else {
+            format.flagged_lenlen()
+        };
+        self.tag.start() - lenlen - 1
+    }
+}
+
+/// What the data field of a block holds, flagged by the two most significant bits of a long data
+/// length field
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+enum Content {
+    /// The contents of the file
+    Data,
+
+    /// The hash of the shared payload holding the contents of the file (see
+    /// [`Format::dedup`](struct.Format.html#structfield.dedup))
+    Shared,
+
+    /// Nothing, the file being made of as many zeros (see
+    /// [`FileSystem::create_zeroed`](struct.FileSystem.html#method.create_zeroed))
+    Zeroed(usize),
+}
+
+/// Flag of the data length field of a block referencing a shared payload, for a field of `lenlen`
+/// bytes
+fn shared_flag(lenlen: usize) -> usize {
+    1 << (8 * lenlen - 1)
+}
+
+/// Flag of the data length field of a zeroed file, for a field of `lenlen` bytes
+fn zeroed_flag(lenlen: usize) -> usize {
+    1 << (8 * lenlen - 2)
 }
 
 /// Offset in the `sectors` array of a [`FileSystem`] (do not make a mistake between this one and
@@ -181,6 +338,74 @@ struct File<'a> {
 #[derive(Debug, Copy, Clone, PartialEq, Eq)]
 pub struct SectorID(pub usize);
 
+/// Roles given to the flash sectors, for laying out a [`FileSystem`] at runtime
+///
+/// [`FileSystem`]: struct.FileSystem.html
+#[derive(Copy, Clone)]
+pub struct Geometry<'g> {
+    /// Flash sectors holding the firmware, that are neither part of the filesystem nor writable
+    pub program: &'g [flash::SectorID],
+
+    /// Flash sectors handed to the filesystem, in the order defining its [`SectorID`]s
+    ///
+    /// [`SectorID`]: struct.SectorID.html
+    pub sectors: &'g [flash::SectorID],
+
+    /// Sector reserved for defragmenting
+    pub defrag: SectorID,
+
+    /// Sector reserved for applets
+    pub applet: SectorID,
+
+    /// Flash sector holding an on-flash index of the files, if they are not all to be held in RAM
+    /// (see [`FileSystem::with_index`](struct.FileSystem.html#method.with_index))
+    pub index: Option<flash::SectorID>,
+}
+
+impl<'g> Geometry<'g> {
+    /// Returns the sectors of `flash` handed to the filesystem, as expected by
+    /// [`FileSystem::new`](struct.FileSystem.html#method.new)
+    pub fn fs_sectors<'a>(&self, flash: &'a Flash) -> Vec<&'a Sector> {
+        self.sectors.iter().map(|&x| flash.sector(x)).collect()
+    }
+}
+
+/// Usage statistics of a [`FileSystem`]
+///
+/// [`FileSystem`]: struct.FileSystem.html
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct Stats {
+    /// Number of defragmentations run since the filesystem was mounted
+    pub defragmentations: usize,
+
+    /// Size of the valid blocks
+    pub valid: usize,
+
+    /// Size of all the blocks, be they valid or not
+    pub used: usize,
+
+    /// Size of the sectors that can hold blocks (ie. all but the defrag sector)
+    pub capacity: usize,
+
+    /// Size still held by reservations
+    pub reserved: usize,
+}
+
+/// Handle to space reserved on the filesystem (see [`FileSystem::reserve`])
+///
+/// [`FileSystem::reserve`]: struct.FileSystem.html#method.reserve
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct Reservation(pub usize);
+
+/// Handle to an opened file (see [`FileSystem::open`])
+///
+/// [`FileSystem::open`]: struct.FileSystem.html#method.open
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct Handle(pub usize);
+
+/// Maximum number of files opened at once
+pub const HANDLES_MAX: usize = 16;
+
 /// Persistent pseudo-hashmap on top of the flash
 pub struct FileSystem<'a> {
     /// Reference towards the flash
@@ -195,14 +420,40 @@ pub struct FileSystem<'a> {
     /// Identifier of the sector reserved for applets
     appletsector: SectorID,
 
-    /// Set of the files found
-    files: HashSet<File<'a>>,
+    /// Table of the files found
+    files: Files<'a>,
 
     /// Pointers to the location of the first bytes to be put for new blocks on each sector
     next_blocks: Vec<usize>,
 
     /// Size of blocks that are actually useful on each sector
     valid_sizes: Vec<usize>,
+
+    /// Format of the blocks on flash
+    format: Format,
+
+    /// Number of defragmentations run since mounting
+    defragmentations: usize,
+
+    /// Reservations currently held, along with the sector they are on and the size they still hold
+    reservations: Vec<(Reservation, SectorID, usize)>,
+
+    /// Handle of the next reservation
+    next_reservation: usize,
+
+    /// Files opened, along with their tag and, once read, the location of their data and the
+    /// generation it was found at
+    handles: Vec<(Handle, Vec<u8>, Cell<Option<(usize, usize, usize)>>)>,
+
+    /// Handle of the next file opened
+    next_handle: usize,
+
+    /// Number of changes made to the table of the files, telling whether the data located by the
+    /// handles may have moved
+    generation: usize,
+
+    /// Hashes of the shared payloads, with the number of files referencing them
+    payloads: Vec<(u32, usize)>,
 }
 
 /// Mask for the `validity` bits in a header block
@@ -229,6 +480,30 @@ const LENLEN_SHORT: u8 = 0b00000000;
 /// [`FileSystem`]: struct.FileSystem.html
 const FS_FILES_BUCKETS: usize = 32;
 
+/// First byte of the tags of the blocks the filesystem keeps for itself
+///
+/// No tag from [`filename`](../filename/index.html) starts with it.
+const INTERNAL_TAG: u8 = 0xFF;
+
+/// Second byte of the tag of a sector summary, whose third byte is the sector
+const SUMMARY_TAG: u8 = b'S';
+
+/// Longest tag prefix by which blocks are clustered after a defragmentation
+///
+/// It covers `[type, applet, package, class]`, ie. all the fields of an object.
+const CLUSTER_KEY_LEN: usize = 4;
+
+/// Largest number of clusters in a sector, so that clustering takes bounded RAM
+const CLUSTER_MAX: usize = 32;
+
+/// Second byte of the tag of a shared payload, whose next four bytes are its hash
+const PAYLOAD_TAG: u8 = b'P';
+
+/// Length from which data is stored as a shared payload when deduplicating
+///
+/// Below it, the reference to the payload would not be much smaller than the data itself.
+const DEDUP_MIN_LEN: usize = 16;
+
 /// CRC table for CRC-8.
 ///
 /// This table could have been generated using `const fn`'s if these were more powerful.
@@ -275,18 +550,285 @@ const CRC_TABLE: [u8; 256] = [
     120, 210, 7, 83, 134, 44, 249,
 ];
 
+/// Slicing-by-4 tables for CRC-8.
+///
+/// `CRC_SLICING_TABLES[k][i]` is the CRC of byte `i` followed by `k + 1` null bytes, that is
+/// `CRC_TABLE` applied `k + 2` times to `i`. As the CRC is linear, this allows to process four
+/// bytes with four independent lookups instead of four chained ones.
+///
+/// They have been generated from `CRC_TABLE` with the following code:
+/// ```
+/// fn init_slicing_tables(table: &[u8; 256]) -> [[u8; 256]; 3] {
+///     let mut res = [[0; 256]; 3];
+///     for i in 0..256 {
+///         res[0][i] = table[table[i] as usize];
+///         res[1][i] = table[res[0][i] as usize];
+///         res[2][i] = table[res[1][i] as usize];
+///     }
+///     res
+/// }
+/// ```
+const CRC_SLICING_TABLES: [[u8; 256]; 3] = [
+    [
+        0, 11, 22, 29, 44, 39, 58, 49, 88, 83, 78, 69, 116, 127, 98, 105, 176, 187, 166, 173, 156,
+        151, 138, 129, 232, 227, 254, 245, 196, 207, 210, 217, 181, 190, 163, 168, 153, 146, 143,
+        132, 237, 230, 251, 240, 193, 202, 215, 220, 5, 14, 19, 24, 41, 34, 63, 52, 93, 86, 75, 64,
+        113, 122, 103, 108, 191, 180, 169, 162, 147, 152, 133, 142, 231, 236, 241, 250, 203, 192,
+        221, 214, 15, 4, 25, 18, 35, 40, 53, 62, 87, 92, 65, 74, 123, 112, 109, 102, 10, 1, 28, 23,
+        38, 45, 48, 59, 82, 89, 68, 79, 126, 117, 104, 99, 186, 177, 172, 167, 150, 157, 128, 139,
+        226, 233, 244, 255, 206, 197, 216, 211, 171, 160, 189, 182, 135, 140, 145, 154, 243, 248,
+        229, 238, 223, 212, 201, 194, 27, 16, 13, 6, 55, 60, 33, 42, 67, 72, 85, 94, 111, 100, 121,
+        114, 30, 21, 8, 3, 50, 57, 36, 47, 70, 77, 80, 91, 106, 97, 124, 119, 174, 165, 184, 179,
+        130, 137, 148, 159, 246, 253, 224, 235, 218, 209, 204, 199, 20, 31, 2, 9, 56, 51, 46, 37,
+        76, 71, 90, 81, 96, 107, 118, 125, 164, 175, 178, 185, 136, 131, 158, 149, 252, 247, 234,
+        225, 208, 219, 198, 205, 161, 170, 183, 188, 141, 134, 155, 144, 249, 242, 239, 228, 213,
+        222, 195, 200, 17, 26, 7, 12, 61, 54, 43, 32, 73, 66, 95, 84, 101, 110, 115, 120,
+    ],
+    [
+        0, 131, 211, 80, 115, 240, 160, 35, 230, 101, 53, 182, 149, 22, 70, 197, 25, 154, 202, 73,
+        106, 233, 185, 58, 255, 124, 44, 175, 140, 15, 95, 220, 50, 177, 225, 98, 65, 194, 146, 17,
+        212, 87, 7, 132, 167, 36, 116, 247, 43, 168, 248, 123, 88, 219, 139, 8, 205, 78, 30, 157,
+        190, 61, 109, 238, 100, 231, 183, 52, 23, 148, 196, 71, 130, 1, 81, 210, 241, 114, 34, 161,
+        125, 254, 174, 45, 14, 141, 221, 94, 155, 24, 72, 203, 232, 107, 59, 184, 86, 213, 133, 6,
+        37, 166, 246, 117, 176, 51, 99, 224, 195, 64, 16, 147, 79, 204, 156, 31, 60, 191, 239, 108,
+        169, 42, 122, 249, 218, 89, 9, 138, 200, 75, 27, 152, 187, 56, 104, 235, 46, 173, 253, 126,
+        93, 222, 142, 13, 209, 82, 2, 129, 162, 33, 113, 242, 55, 180, 228, 103, 68, 199, 151, 20,
+        250, 121, 41, 170, 137, 10, 90, 217, 28, 159, 207, 76, 111, 236, 188, 63, 227, 96, 48, 179,
+        144, 19, 67, 192, 5, 134, 214, 85, 118, 245, 165, 38, 172, 47, 127, 252, 223, 92, 12, 143,
+        74, 201, 153, 26, 57, 186, 234, 105, 181, 54, 102, 229, 198, 69, 21, 150, 83, 208, 128, 3,
+        32, 163, 243, 112, 158, 29, 77, 206, 237, 110, 62, 189, 120, 251, 171, 40, 11, 136, 216, 91,
+        135, 4, 84, 215, 244, 119, 39, 164, 97, 226, 178, 49, 18, 145, 193, 66,
+    ],
+    [
+        0, 69, 138, 207, 193, 132, 75, 14, 87, 18, 221, 152, 150, 211, 28, 89, 174, 235, 36, 97,
+        111, 42, 229, 160, 249, 188, 115, 54, 56, 125, 178, 247, 137, 204, 3, 70, 72, 13, 194, 135,
+        222, 155, 84, 17, 31, 90, 149, 208, 39, 98, 173, 232, 230, 163, 108, 41, 112, 53, 250, 191,
+        177, 244, 59, 126, 199, 130, 77, 8, 6, 67, 140, 201, 144, 213, 26, 95, 81, 20, 219, 158,
+        105, 44, 227, 166, 168, 237, 34, 103, 62, 123, 180, 241, 255, 186, 117, 48, 78, 11, 196,
+        129, 143, 202, 5, 64, 25, 92, 147, 214, 216, 157, 82, 23, 224, 165, 106, 47, 33, 100, 171,
+        238, 183, 242, 61, 120, 118, 51, 252, 185, 91, 30, 209, 148, 154, 223, 16, 85, 12, 73, 134,
+        195, 205, 136, 71, 2, 245, 176, 127, 58, 52, 113, 190, 251, 162, 231, 40, 109, 99, 38, 233,
+        172, 210, 151, 88, 29, 19, 86, 153, 220, 133, 192, 15, 74, 68, 1, 206, 139, 124, 57, 246,
+        179, 189, 248, 55, 114, 43, 110, 161, 228, 234, 175, 96, 37, 156, 217, 22, 83, 93, 24, 215,
+        146, 203, 142, 65, 4, 10, 79, 128, 197, 50, 119, 184, 253, 243, 182, 121, 60, 101, 32, 239,
+        170, 164, 225, 46, 107, 21, 80, 159, 218, 212, 145, 94, 27, 66, 7, 200, 141, 131, 198, 9,
+        76, 187, 254, 49, 116, 122, 63, 240, 181, 236, 169, 102, 35, 45, 104, 167, 226,
+    ],
+];
+
 /// Computes the CRC-8 of the concatenation of `firstbyte` with `bytes`
 ///
 /// The split between `firstbyte` and `bytes` can be useful as the first byte is a header and its
 /// value is set to change at some positions without having to change the computed checksum)
 fn crc8(firstbyte: u8, bytes: &[u8]) -> u8 {
-    let mut crc = CRC_TABLE[firstbyte as usize];
-    for b in bytes {
+    crc8_update(CRC_TABLE[firstbyte as usize], bytes)
+}
+
+/// Continues computing a CRC-8 whose current value is `crc` with `bytes`
+fn crc8_update(mut crc: u8, bytes: &[u8]) -> u8 {
+    let mut words = bytes.chunks_exact(4);
+    for w in &mut words {
+        crc = CRC_SLICING_TABLES[2][(crc ^ w[0]) as usize]
+            ^ CRC_SLICING_TABLES[1][w[1] as usize]
+            ^ CRC_SLICING_TABLES[0][w[2] as usize]
+            ^ CRC_TABLE[w[3] as usize];
+    }
+    for b in words.remainder() {
         crc = CRC_TABLE[(crc ^ b) as usize];
     }
     crc
 }
 
+/// Computes the CRC-32 of `bytes` followed by `lastbyte`
+///
+/// Contrary to [`crc8`](fn.crc8.html), the header byte comes last, so that the bulk of the
+/// checksummed data can be handed over as-is to a hardware CRC unit (see `crc_ll`).
+fn crc32(lastbyte: u8, bytes: &[u8]) -> u32 {
+    crc_ll::crc32_update(crc_ll::crc32(bytes), &[lastbyte])
+}
+
+/// Kind of checksum closing each block
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+pub enum Checksum {
+    /// One-byte CRC-8 (polynomial `0xD5`), the historical format
+    Crc8,
+
+    /// Four-byte CRC-32/MPEG-2 (polynomial `0x04C11DB7`), stored most significant byte first
+    Crc32,
+}
+
+impl Checksum {
+    /// Number of bytes taken by the checksum on flash
+    fn len(self) -> usize {
+        match self {
+            Checksum::Crc8 => 1,
+            Checksum::Crc32 => 4,
+        }
+    }
+
+    /// Computes the checksum of a block, given its header byte with the validity bits cleared and
+    /// the remaining bytes up to (excluded) the checksum
+    fn compute(self, hdr: u8, bytes: &[u8]) -> u32 {
+        match self {
+            Checksum::Crc8 => crc8(hdr, bytes) as u32,
+            Checksum::Crc32 => crc32(hdr, bytes),
+        }
+    }
+
+    /// Same as [`compute`](#method.compute), with the checksummed bytes being the concatenation
+    /// of `bytes` and `tail`
+    fn compute_with_tail(self, hdr: u8, bytes: &[u8], tail: &[u8]) -> u32 {
+        match self {
+            Checksum::Crc8 => crc8_update(crc8(hdr, bytes), tail) as u32,
+            Checksum::Crc32 => {
+                let crc = crc_ll::crc32_update(crc_ll::crc32(bytes), tail);
+                crc_ll::crc32_update(crc, &[hdr])
+            }
+        }
+    }
+
+    /// Reads a checksum stored at the beginning of `bytes`
+    fn read(self, bytes: &[u8]) -> u32 {
+        bytes[..self.len()]
+            .iter()
+            .fold(0, |acc, &b| (acc << 8) | b as u32)
+    }
+
+    /// Checks that the checksum stored at the beginning of `stored` is the one of `hdr` followed
+    /// by `bytes`
+    fn check(self, hdr: u8, bytes: &[u8], stored: &[u8]) -> bool {
+        let expected = self.read(stored);
+        let computed = self.compute(hdr, bytes);
+        if expected != computed {
+            debug!("excepted: {} | computed: {}", expected, computed);
+        }
+        expected == computed
+    }
+
+    /// Returns the on-flash representation of `crc`, in its first `self.len()` bytes
+    fn to_bytes(self, crc: u32) -> [u8; 4] {
+        match self {
+            Checksum::Crc8 => [crc as u8, 0, 0, 0],
+            Checksum::Crc32 => [
+                (crc >> 24) as u8,
+                (crc >> 16) as u8,
+                (crc >> 8) as u8,
+                crc as u8,
+            ],
+        }
+    }
+}
+
+/// On-flash format of the blocks of a [`FileSystem`]
+///
+/// The format is not recorded on flash: a filesystem must always be mounted with the format it
+/// has been written with, as blocks of another format are seen as broken and erased.
+///
+/// [`FileSystem`]: struct.FileSystem.html
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+pub struct Format {
+    /// Checksum closing each block
+    pub checksum: Checksum,
+
+    /// Whether the header and the data of the blocks have separate checksums, the one of the data
+    /// being only verified when it is first accessed (see [module-level
+    /// documentation](index.html))
+    pub lazy_payload: bool,
+
+    /// Whether blocks are laid out on 32-bit words, so that they can be written with full-word
+    /// programs only (see [module-level documentation](index.html))
+    pub aligned: bool,
+
+    /// Whether identical data is stored once, as a shared payload referenced by the files
+    /// holding it (see [module-level documentation](index.html))
+    pub dedup: bool,
+}
+
+/// Offsets of the fields of a block, relative to its first byte
+#[derive(Debug, Clone, Copy)]
+struct Layout {
+    /// Offset of the tag
+    tag: usize,
+
+    /// Offset of the header checksum, if the payload is checked lazily
+    hdrck: Option<usize>,
+
+    /// Offset of the data
+    data: usize,
+
+    /// Offset of the checksum closing the block
+    cksum: usize,
+
+    /// Size of the block on flash
+    size: usize,
+}
+
+impl Format {
+    /// Length of the data length field used when writing a block holding `datalen` bytes of data
+    fn lenlen(self, datalen: usize) -> usize {
+        if self.aligned {
+            3
+        } else if datalen <= 0xFF {
+            1
+        } else {
+            4
+        }
+    }
+
+    /// Length of the data length field of a block whose content is flagged (see `Content`)
+    fn flagged_lenlen(self) -> usize {
+        if self.aligned {
+            3
+        } else {
+            4
+        }
+    }
+
+    /// Rounds `i` up to the alignment of the blocks
+    fn align(self, i: usize) -> usize {
+        if self.aligned {
+            (i + 3) & !0b11
+        } else {
+            i
+        }
+    }
+
+    /// Computes the layout of a block with a data length field of `lenlen` bytes, a tag of
+    /// `taglen` bytes and `datalen` bytes of data
+    fn layout(self, lenlen: usize, taglen: usize, datalen: usize) -> Layout {
+        let tag = 1 + lenlen;
+        let mut i = tag + taglen;
+        let hdrck = if self.lazy_payload {
+            i = self.align(i);
+            i += self.checksum.len();
+            Some(i - self.checksum.len())
+        } else {
+            None
+        };
+        let data = self.align(i);
+        let cksum = data + datalen;
+        Layout {
+            tag: tag,
+            hdrck: hdrck,
+            data: data,
+            cksum: cksum,
+            size: self.align(cksum + self.checksum.len()),
+        }
+    }
+}
+
+impl Default for Format {
+    /// The historical format, with a CRC-8 per block
+    fn default() -> Format {
+        Format {
+            checksum: Checksum::Crc8,
+            lazy_payload: false,
+            aligned: false,
+            dedup: false,
+        }
+    }
+}
+
 /// An error that can occur during the initial parsing phase
 #[derive(Debug, PartialEq, Eq)]
 enum ParseNoBlock {
@@ -302,11 +844,51 @@ enum ParseNoBlock {
     Erased(usize),
 }
 
-/// Parses a filesystem block starting at the beginning of the input-provided [`FlashBlock`].
+/// Location of a parsed block
 ///
-/// It returns a tuple `(valid?, tag, data, size consumed)` on success, where `valid?` is true if
-/// the returned block is a valid one, `tag` is the tag of the block, `data` is the data of the
-/// block, and `size consumed` is the size of the block on flash.
+/// All the indices are relative to the beginning of the zone the block has been parsed from.
+#[derive(Debug, PartialEq, Eq, Clone, Copy)]
+struct RawBlock {
+    /// Whether the block is a valid one
+    valid: bool,
+
+    /// Index of the first byte of the tag
+    tag: usize,
+
+    /// Length of the tag
+    taglen: usize,
+
+    /// Index of the first byte of the data
+    data: usize,
+
+    /// Length of the data
+    datalen: usize,
+
+    /// Size of the block on flash
+    size: usize,
+
+    /// Checksum the data has to be verified against, if the format checks it lazily
+    payload: Option<u32>,
+
+    /// What the data holds
+    content: Content,
+}
+
+impl RawBlock {
+    /// Returns the same block, with all its indices shifted by `by`
+    fn offset(self, by: usize) -> RawBlock {
+        RawBlock {
+            tag: self.tag + by,
+            data: self.data + by,
+            ..self
+        }
+    }
+}
+
+/// Parses a filesystem block starting at the beginning of `zone`.
+///
+/// It returns the location of the tag and data of the block, along with whether it is a valid
+/// block and the size it takes on flash.
 ///
 /// See [the flash module documentation](index.html) for more details about the parsed block
 /// format.
@@ -315,10 +897,7 @@ enum ParseNoBlock {
 ///
 /// It will error out if an empty or erased block was found, or if a broken block was found (ie.
 /// invalid checksum, fs block extended past the end of `zone`, etc.)
-///
-/// [`FlashBlock`]: ../flash/struct.FlashBlock.html
-#[cfg_attr(feature = "cargo-clippy", allow(needless_pass_by_value))]
-fn parse_hdr(zone: FlashBlock) -> Result<(bool, FlashBlock, FlashBlock, usize), ParseNoBlock> {
+fn parse_hdr(zone: &[u8], format: Format) -> Result<RawBlock, ParseNoBlock> {
     let mut i = 0;
 
     // Parse header
@@ -326,20 +905,13 @@ fn parse_hdr(zone: FlashBlock) -> Result<(bool, FlashBlock, FlashBlock, usize),
     if hdr == 0xFF {
         return Err(ParseNoBlock::Empty);
     } else if hdr == 0x00 {
-        let mut b = hdr;
-        while b == 0x00 {
-            i += 1;
-            if let Some(&h) = zone.get(i) {
-                b = h;
-            } else {
-                break;
-            }
-        }
-        return Err(ParseNoBlock::Erased(i));
+        return Err(ParseNoBlock::Erased(scan_ll::find_first_not(zone, 0x00)));
     }
     let valid = (hdr & VALIDITY_MASK) == VALIDITY_VALID;
     let taglen = ((hdr & TAGLEN_MASK) >> TAGLEN_SHIFT) as usize;
-    let lenlen = if (hdr & LENLEN_MASK) == LENLEN_LONG {
+    let lenlen = if format.aligned {
+        3
+    } else if (hdr & LENLEN_MASK) == LENLEN_LONG {
         4
     } else {
         1
@@ -347,60 +919,575 @@ fn parse_hdr(zone: FlashBlock) -> Result<(bool, FlashBlock, FlashBlock, usize),
     i += 1;
 
     // Parse length of data
-    if i + lenlen >= zone.len() {
+    if i + lenlen > zone.len() {
         return err!(ParseNoBlock::Broken);
     }
-    let len = if lenlen == 1 {
-        zone[i] as usize
-    } else {
-        // lenlen == 4
-        ((zone[i] as usize) << 24)
-            | ((zone[i + 1] as usize) << 16)
-            | ((zone[i + 2] as usize) << 8)
-            | (zone[i + 3] as usize)
-    };
-    i += lenlen;
+    let mut len = zone[i..i + lenlen]
+        .iter()
+        .fold(0, |acc, &b| (acc << 8) | b as usize);
+    let mut content = Content::Data;
+    if lenlen > 1 && len & shared_flag(lenlen) != 0 {
+        if !format.dedup || len & zeroed_flag(lenlen) != 0 {
+            return err!(ParseNoBlock::Broken);
+        }
+        content = Content::Shared;
+        len &= !shared_flag(lenlen);
+    } else if lenlen > 1 && len & zeroed_flag(lenlen) != 0 {
+        content = Content::Zeroed(len & !zeroed_flag(lenlen));
+        len = 0;
+    }
 
     // Check tag, data and checksum lengths
-    if i + taglen + len >= zone.len() {
+    let layout = format.layout(lenlen, taglen, len);
+    if layout.size > zone.len() {
         return err!(ParseNoBlock::Broken);
     }
 
-    // Parse tag and data
-    let tag = get!(zone.read(i, taglen).map_err(|_| ParseNoBlock::Broken));
-    i += taglen;
-    let data = get!(zone.read(i, len).map_err(|_| ParseNoBlock::Broken));
-    i += len;
-
-    // Parse and check checksum
-    let cksum = *get!(zone.get(i).ok_or(ParseNoBlock::Broken));
-    if cksum != crc8(hdr & !VALIDITY_MASK, &zone[1..i]) {
-        debug!(
-            "excepted: {} | computed: {}",
-            cksum,
-            crc8(hdr & !VALIDITY_MASK, &zone[1..i])
-        );
-        return err!(ParseNoBlock::Broken);
+    // Check header checksum, if separate
+    if let Some(hdrck) = layout.hdrck {
+        if !format.checksum.check(hdr & !VALIDITY_MASK, &zone[1..hdrck], &zone[hdrck..]) {
+            return err!(ParseNoBlock::Broken);
+        }
     }
-    i += 1;
+
+    // Parse checksum, and check it unless it is to be done lazily
+    let payload = if format.lazy_payload {
+        Some(format.checksum.read(&zone[layout.cksum..]))
+    } else {
+        let cksum = layout.cksum;
+        if !format.checksum.check(hdr & !VALIDITY_MASK, &zone[1..cksum], &zone[cksum..]) {
+            return err!(ParseNoBlock::Broken);
+        }
+        None
+    };
 
     // And be happy
-    Ok((valid, tag, data, i))
+    Ok(RawBlock {
+        valid: valid,
+        tag: layout.tag,
+        taglen: taglen,
+        data: layout.data,
+        datalen: len,
+        size: layout.size,
+        payload: payload,
+        content: content,
+    })
+}
+
+/// Parses the block at index `pos` of `zone`, returning it located relatively to the beginning of
+/// `zone`, along with the index the scan goes on from
+///
+/// Scanning goes past valid, invalid and erased blocks, but stays on empty or broken blocks.
+fn parse_at(zone: &[u8], pos: usize, format: Format) -> (Result<RawBlock, ParseNoBlock>, usize) {
+    let res = parse_hdr(&zone[pos..], format).map(|b| b.offset(pos));
+    let next = match res {
+        Ok(b) => pos + b.size,
+        Err(ParseNoBlock::Erased(size)) => format.align(pos + size),
+        Err(_) => pos,
+    };
+    (res, next)
+}
+
+/// Cursor scanning the blocks of a sector straight from its memory-mapped contents
+///
+/// Contrary to [`Sector::read`], it does not take any lock on the scanned zone, so that walking
+/// over a sector does not cost a lock-table insertion per block. It is hence reserved to the
+/// privileged mount and recovery paths, and [`FlashBlock`]s are only to be built for the blocks
+/// that end up in the index.
+///
+/// [`Sector::read`]: ../flash/struct.Sector.html#method.read
+/// [`FlashBlock`]: ../flash/struct.FlashBlock.html
+struct ScanCursor<'a> {
+    /// Sector being scanned
+    sector: &'a Sector,
+
+    /// Index (in the sector) of the next block to parse
+    pos: usize,
+
+    /// Index (in the sector) at which scanning stops
+    end: usize,
+
+    /// Format of the scanned blocks
+    format: Format,
+
+    /// Results of the blocks parsed ahead by [`all`](#method.all), along with the index each one
+    /// moves the cursor to, in reverse order
+    #[cfg(feature = "host")]
+    parsed: Vec<(Result<RawBlock, ParseNoBlock>, usize)>,
+}
+
+impl<'a> ScanCursor<'a> {
+    /// Starts scanning `sector`, whose blocks are in format `format`, from its beginning up to
+    /// (excluded) index `end`
+    fn new(sector: &'a Sector, end: usize, format: Format) -> ScanCursor<'a> {
+        ScanCursor::between(sector, 0, end, format)
+    }
+
+    /// Starts scanning `sector`, whose blocks are in format `format`, from index `start`, which
+    /// must be the beginning of a block, up to (excluded) index `end`
+    fn between(sector: &'a Sector, start: usize, end: usize, format: Format) -> ScanCursor<'a> {
+        ScanCursor {
+            sector: sector,
+            pos: start,
+            end: end,
+            format: format,
+            #[cfg(feature = "host")]
+            parsed: Vec::new(),
+        }
+    }
+
+    /// Starts scanning each of `zones`, given as (sector, end) pairs, from its beginning
+    ///
+    /// On host, where flash images can be large, the zones are parsed ahead in parallel, each by a
+    /// thread of its own, up to their first empty or broken block. The cursors then replay these
+    /// results, so that the caller still handles the blocks one sector after the other and in
+    /// scanning order, which keeps the outcome of mounting deterministic.
+    #[cfg(feature = "host")]
+    fn all(zones: &[(&'a Sector, usize)], format: Format) -> Vec<ScanCursor<'a>> {
+        let workers: Vec<_> = zones
+            .iter()
+            .map(|&(sector, end)| {
+                let zone = unsafe { &sector.raw()[..end] };
+                let (start, len) = (zone.as_ptr() as usize, zone.len());
+                ::std::thread::spawn(move || {
+                    // The flash outlives the thread, which is joined before returning
+                    let zone = unsafe { ::core::slice::from_raw_parts(start as *const u8, len) };
+                    let mut parsed = Vec::new();
+                    let mut pos = 0;
+                    while pos < zone.len() {
+                        let (res, next) = parse_at(zone, pos, format);
+                        parsed.push((res, next));
+                        if next == pos {
+                            // Empty or broken block
+                            break;
+                        }
+                        pos = next;
+                    }
+                    parsed.reverse();
+                    parsed
+                })
+            })
+            .collect();
+        zones
+            .iter()
+            .zip(workers)
+            .map(|(&(sector, end), worker)| ScanCursor {
+                parsed: worker.join().expect("Sector scanning thread panicked"),
+                ..ScanCursor::new(sector, end, format)
+            })
+            .collect()
+    }
+
+    /// Starts scanning each of `zones`, given as (sector, end) pairs, from its beginning
+    #[cfg(not(feature = "host"))]
+    fn all(zones: &[(&'a Sector, usize)], format: Format) -> Vec<ScanCursor<'a>> {
+        zones
+            .iter()
+            .map(|&(sector, end)| ScanCursor::new(sector, end, format))
+            .collect()
+    }
+
+    /// Returns the index in the sector of the next block to be parsed
+    fn pos(&self) -> usize {
+        self.pos
+    }
+
+    /// Returns whether the end of the scanned zone has been reached
+    fn done(&self) -> bool {
+        self.pos >= self.end
+    }
+
+    /// Returns the raw contents of the scanned zone
+    ///
+    /// It is fetched anew at each call so that no reference to the sector contents is kept across
+    /// the writes that can happen between two calls.
+    fn zone(&self) -> &'a [u8] {
+        unsafe { &self.sector.raw()[..self.end] }
+    }
+
+    /// Parses the block at the current position
+    ///
+    /// On success, the returned block is located relatively to the beginning of the sector, and
+    /// the cursor is moved past it. It is also moved past erased blocks, but stays on empty or
+    /// broken blocks.
+    fn next(&mut self) -> Result<RawBlock, ParseNoBlock> {
+        let (res, pos) = match self.take_parsed() {
+            Some(parsed) => parsed,
+            None => parse_at(self.zone(), self.pos, self.format),
+        };
+        self.pos = pos;
+        res
+    }
+
+    /// Returns the result parsed ahead for the block at the current position, if any
+    #[cfg(feature = "host")]
+    fn take_parsed(&mut self) -> Option<(Result<RawBlock, ParseNoBlock>, usize)> {
+        self.parsed.pop()
+    }
+
+    /// Returns the result parsed ahead for the block at the current position, if any
+    #[cfg(not(feature = "host"))]
+    fn take_parsed(&mut self) -> Option<(Result<RawBlock, ParseNoBlock>, usize)> {
+        None
+    }
+
+    /// Returns the raw tag of a block returned by [`next`](#method.next)
+    fn tag(&self, b: &RawBlock) -> &'a [u8] {
+        &self.zone()[b.tag..b.tag + b.taglen]
+    }
+
+    /// Returns the raw data of a block returned by [`next`](#method.next)
+    fn data(&self, b: &RawBlock) -> &'a [u8] {
+        &self.zone()[b.data..b.data + b.datalen]
+    }
+
+    /// Returns whether the data of a block returned by [`next`](#method.next) matches its
+    /// checksum, verifying it if the format checks it lazily
+    fn payload_ok(&self, b: &RawBlock) -> bool {
+        match b.payload {
+            Some(expected) => self.format.checksum.compute(0, self.data(b)) == expected,
+            None => true,
+        }
+    }
+}
+
+/// Returns whether a block is kept by the filesystem for itself
+fn is_internal(tag: &[u8]) -> bool {
+    tag.first() == Some(&INTERNAL_TAG)
+}
+
+/// Returns the tag of the summary of a sector
+fn summary_tag(SectorID(sid): SectorID) -> [u8; 3] {
+    [INTERNAL_TAG, SUMMARY_TAG, sid as u8]
+}
+
+/// Returns whether a block is the summary of a sector
+fn is_summary(tag: &[u8]) -> bool {
+    is_internal(tag) && tag.get(1) == Some(&SUMMARY_TAG)
+}
+
+/// Returns the tag of the shared payload with a given hash
+fn payload_tag(hash: u32) -> [u8; 6] {
+    let h = u32_to_bytes(hash);
+    [INTERNAL_TAG, PAYLOAD_TAG, h[0], h[1], h[2], h[3]]
+}
+
+/// Returns the hash of the shared payload of a tag, if it is the tag of one
+fn payload_hash(tag: &[u8]) -> Option<u32> {
+    if tag.len() == 6 && is_internal(tag) && tag[1] == PAYLOAD_TAG {
+        Some(u32_from_bytes(&tag[2..]))
+    } else {
+        None
+    }
+}
+
+/// Returns the key by which a block is clustered, with keys `keylen` bytes long
+///
+/// Blocks kept by the filesystem for itself are all clustered together.
+fn cluster_key(tag: &[u8], keylen: usize) -> &[u8] {
+    let keylen = if is_internal(tag) {
+        core::cmp::min(keylen, 2)
+    } else {
+        keylen
+    };
+    &tag[..core::cmp::min(keylen, tag.len())]
+}
+
+/// Returns the length of the keys by which blocks of tags `tags` are to be clustered
+///
+/// Keys are shortened until there are at most `CLUSTER_MAX` of them, down to the empty key, which
+/// makes a single cluster of all the blocks.
+fn cluster_keylen(tags: &[&[u8]]) -> usize {
+    for keylen in (1..CLUSTER_KEY_LEN + 1).rev() {
+        let mut keys: Vec<&[u8]> = tags.iter().map(|t| cluster_key(t, keylen)).collect();
+        keys.sort();
+        keys.dedup();
+        if keys.len() <= CLUSTER_MAX {
+            return keylen;
+        }
+    }
+    0
+}
+
+/// Layout of a sector left by its last defragmentation
+///
+/// It is stored, as the data of the block whose tag is `[INTERNAL_TAG, SUMMARY_TAG, sector]`, as:
+/// ```none
+/// +-------+-+-+-----------------+-----------------+-+-------+-+-------+
+/// |   A   |B|C|        D        |       ...       |E|   F   |G|   H   |
+/// +-------+-+-+-----------------+-----------------+-+-------+-+-------+
+/// ```
+///
+/// `A`: End of the clustered zone (4 bytes, most significant byte first)
+///
+/// `B`: Length of the cluster keys
+///
+/// `C`: Number of clusters, each described by a `D` field
+///
+/// `D`: Length of the key (1 byte), key, and index in the sector of the first block of the
+///      cluster (4 bytes, most significant byte first)
+///
+/// `E`, `F`: Length and value of the lowest tag of the zone
+///
+/// `G`, `H`: Length and value of the highest tag of the zone
+struct Summary {
+    /// Index in the sector up to which blocks are clustered
+    covered: usize,
+    /// Keys of the clusters, in increasing order, with the index of their first block
+    clusters: Vec<(Vec<u8>, usize)>,
+    /// Lowest tag of the clustered zone
+    first: Vec<u8>,
+    /// Highest tag of the clustered zone
+    last: Vec<u8>,
+}
+
+impl Summary {
+    /// Serializes the summary
+    fn to_bytes(&self) -> Vec<u8> {
+        let mut bytes = Vec::new();
+        bytes.extend_from_slice(&u32_to_bytes(self.covered as u32));
+        bytes.push(self.clusters.iter().map(|c| c.0.len()).max().unwrap_or(0) as u8);
+        bytes.push(self.clusters.len() as u8);
+        for &(ref key, start) in self.clusters.iter() {
+            bytes.push(key.len() as u8);
+            bytes.extend_from_slice(key);
+            bytes.extend_from_slice(&u32_to_bytes(start as u32));
+        }
+        for tag in [&self.first, &self.last].iter() {
+            bytes.push(tag.len() as u8);
+            bytes.extend_from_slice(tag);
+        }
+        bytes
+    }
+
+    /// Deserializes a summary, returning `None` if it is malformed
+    fn from_bytes(mut bytes: &[u8]) -> Option<Summary> {
+        fn take<'b>(bytes: &mut &'b [u8], n: usize) -> Option<&'b [u8]> {
+            if bytes.len() < n {
+                return None;
+            }
+            let (head, tail) = bytes.split_at(n);
+            *bytes = tail;
+            Some(head)
+        }
+        fn take_u32(bytes: &mut &[u8]) -> Option<usize> {
+            take(bytes, 4).map(|b| b.iter().fold(0, |acc, &x| (acc << 8) | x as usize))
+        }
+        let covered = take_u32(&mut bytes)?;
+        let head = take(&mut bytes, 2)?;
+        let mut clusters = Vec::with_capacity(head[1] as usize);
+        for _ in 0..head[1] {
+            let len = take(&mut bytes, 1)?[0] as usize;
+            let key = take(&mut bytes, len)?.to_vec();
+            clusters.push((key, take_u32(&mut bytes)?));
+        }
+        let len = take(&mut bytes, 1)?[0] as usize;
+        let first = take(&mut bytes, len)?.to_vec();
+        let len = take(&mut bytes, 1)?[0] as usize;
+        let last = take(&mut bytes, len)?.to_vec();
+        Some(Summary {
+            covered: covered,
+            clusters: clusters,
+            first: first,
+            last: last,
+        })
+    }
+
+    /// Returns the zones of the clustered part of the sector that may hold tags starting with
+    /// `prefix`
+    fn zones(&self, prefix: &[u8]) -> Vec<(usize, usize)> {
+        let mut zones: Vec<(usize, usize)> = Vec::new();
+        if &self.last[..] < prefix
+            || &self.first[..core::cmp::min(prefix.len(), self.first.len())] > prefix
+        {
+            return zones;
+        }
+        for (i, &(ref key, start)) in self.clusters.iter().enumerate() {
+            if !key.starts_with(prefix) && !prefix.starts_with(key) {
+                continue;
+            }
+            let end = self
+                .clusters
+                .get(i + 1)
+                .map(|c| c.1)
+                .unwrap_or(self.covered);
+            match zones.last_mut() {
+                Some(zone) if zone.1 == start => zone.1 = end,
+                _ => zones.push((start, end)),
+            }
+        }
+        zones
+    }
+}
+
+/// Zeros out of which zeroed files are written
+static ZEROS: [u8; 64] = [0; 64];
+
+/// Returns `n` zeros, as slices of `ZEROS`
+fn zeros(n: usize) -> Vec<&'static [u8]> {
+    (0..(n + ZEROS.len() - 1) / ZEROS.len())
+        .map(|i| &ZEROS[..core::cmp::min(ZEROS.len(), n - i * ZEROS.len())])
+        .collect()
+}
+
+/// Returns the big-endian representation of an integer
+fn u32_to_bytes(x: u32) -> [u8; 4] {
+    [(x >> 24) as u8, (x >> 16) as u8, (x >> 8) as u8, x as u8]
+}
+
+/// Returns the integer represented by big-endian bytes
+fn u32_from_bytes(bytes: &[u8]) -> u32 {
+    bytes.iter().fold(0, |acc, &x| (acc << 8) | x as u32)
+}
+
+/// Adds `by` to the number of references to the shared payload whose hash is `hash`, tracking the
+/// payload if it was not yet
+fn count_payload(payloads: &mut Vec<(u32, usize)>, hash: u32, by: usize) {
+    match payloads.iter_mut().find(|p| p.0 == hash) {
+        Some(p) => p.1 += by,
+        None => payloads.push((hash, by)),
+    }
 }
 
 /// Writes `0x00`'s up to the last non-`0xFF` byte of the sector, starting with `from`
 fn erase_invalid_data(f: &Flash, s: &Sector, from: usize) -> Result<(), FlashIOError> {
     // Lock the block in writing immediately, to avoid TOCTOU
     get!(get!(s.with_writer(f, from, s.len() - from, |mut b| {
-        let mut end = s.len() - from;
-        while end > 0 && b[end - 1] == 0xFF {
-            end -= 1;
-        }
+        let end = scan_ll::find_last_not(&b, 0xFF);
         b.zero_block(0, end)
     })));
     Ok(())
 }
 
+/// Accumulator programming bytes into a block only by whole 32-bit words
+///
+/// The block must start on a 32-bit boundary.
+struct WordWriter<'b, 'c: 'b> {
+    /// Block being written
+    block: &'b mut FlashBlockMut<'c>,
+
+    /// Index in the block of the first byte not programmed yet
+    pos: usize,
+
+    /// Bytes waiting for their word to be complete before being programmed
+    pending: [u8; 4],
+
+    /// Number of bytes in `pending`
+    npending: usize,
+}
+
+impl<'b, 'c> WordWriter<'b, 'c> {
+    /// Starts writing at the beginning of `block`
+    fn new(block: &'b mut FlashBlockMut<'c>) -> WordWriter<'b, 'c> {
+        WordWriter {
+            block: block,
+            pos: 0,
+            pending: [0xFF; 4],
+            npending: 0,
+        }
+    }
+
+    /// Returns the bytes already programmed
+    fn written(&self) -> &[u8] {
+        &self.block[..self.pos]
+    }
+
+    /// Returns the bytes pushed but not programmed yet
+    fn pending(&self) -> &[u8] {
+        &self.pending[..self.npending]
+    }
+
+    /// Returns the index in the block of the next pushed byte
+    fn len(&self) -> usize {
+        self.pos + self.npending
+    }
+
+    /// Pushes `bytes`, programming all the words they complete
+    fn push(&mut self, mut bytes: &[u8]) -> Result<(), FlashIOError> {
+        // Complete the pending word first
+        while self.npending > 0 && !bytes.is_empty() {
+            self.pending[self.npending] = bytes[0];
+            self.npending += 1;
+            bytes = &bytes[1..];
+            if self.npending == 4 {
+                get!(self.flush());
+            }
+        }
+        // Then directly program all the whole words
+        let whole = if self.npending == 0 {
+            bytes.len() & !0b11
+        } else {
+            0
+        };
+        if whole > 0 {
+            get!(self.block.write_block(self.pos, &bytes[..whole]));
+            self.pos += whole;
+        }
+        // And keep the rest for later
+        let rest = &bytes[whole..];
+        self.pending[self.npending..self.npending + rest.len()].copy_from_slice(rest);
+        self.npending += rest.len();
+        Ok(())
+    }
+
+    /// Completes the pending word with `0xFF`'s and programs it
+    fn pad(&mut self) -> Result<(), FlashIOError> {
+        if self.npending > 0 {
+            for i in self.npending..4 {
+                self.pending[i] = 0xFF;
+            }
+            self.npending = 4;
+            get!(self.flush());
+        }
+        Ok(())
+    }
+
+    /// Programs the (complete) pending word
+    fn flush(&mut self) -> Result<(), FlashIOError> {
+        let word = self.pending;
+        get!(self.block.write_block(self.pos, &word));
+        self.pos += 4;
+        self.npending = 0;
+        Ok(())
+    }
+}
+
+/// Writes a block in the aligned format, with only whole-word programs
+///
+/// `head` is the header byte (still marking the block as not yet valid) followed by the data
+/// length field.
+fn write_aligned_block(
+    b: &mut FlashBlockMut,
+    format: Format,
+    head: &[u8],
+    tag: &[u8],
+    data: &[&[u8]],
+) -> Result<(), FlashIOError> {
+    let cksum = format.checksum;
+    let hdr = head[0] & !VALIDITY_MASK;
+    let mut w = WordWriter::new(b);
+    get!(w.push(head));
+    get!(w.push(tag));
+    if format.lazy_payload {
+        get!(w.pad());
+        let crc = cksum.compute(hdr, &w.written()[1..]);
+        get!(w.push(&cksum.to_bytes(crc)[..cksum.len()]));
+    }
+    get!(w.pad());
+    let data_start = w.len();
+    for d in data {
+        get!(w.push(d));
+    }
+    // The data not programmed yet goes into the same words as the checksum
+    let crc = if format.lazy_payload {
+        cksum.compute_with_tail(0, &w.written()[data_start..], w.pending())
+    } else {
+        cksum.compute_with_tail(hdr, &w.written()[1..], w.pending())
+    };
+    get!(w.push(&cksum.to_bytes(crc)[..cksum.len()]));
+    w.pad()
+}
+
 impl<'a> FileSystem<'a> {
     //! Tools to work with `SectorID`'s.
     //!
@@ -458,6 +1545,14 @@ impl<'a> FileSystem<'a> {
     fn set_valid_size(&mut self, SectorID(sid): SectorID) -> &mut usize {
         &mut self.valid_sizes[sid]
     }
+    /// Returns the size held by reservations on a requested SectorID
+    fn reserved(&self, sector: SectorID) -> usize {
+        self.reservations
+            .iter()
+            .filter(|r| r.1 == sector)
+            .map(|r| r.2)
+            .sum()
+    }
 }
 
 impl<'a> FileSystem<'a> {
@@ -484,11 +1579,16 @@ impl<'a> FileSystem<'a> {
         }
 
         debug!("  Files:");
-        for _f in self.files.iter() {
-            debug!("    {:?}:", &_f.tag);
-            debug!("      Value: {:?}", &_f.data);
-            debug!("      Sector: {}", _f.sector.0);
-            debug!("      On-disk size: {}", _f.size);
+        match self.files {
+            Files::Ram(ref files) => {
+                for _f in files.iter() {
+                    debug!("    {:?}:", &_f.tag);
+                    debug!("      Value: {:?}", &_f.data);
+                    debug!("      Sector: {}", _f.sector.0);
+                    debug!("      On-disk size: {}", _f.size);
+                }
+            }
+            Files::Flash(_) => debug!("    On the index sector"),
         }
     }
 
@@ -512,73 +1612,140 @@ impl<'a> FileSystem<'a> {
         sectors: &'b [&'b Sector],
         defragsector: SectorID,
         appletsector: SectorID,
+    ) -> Result<FileSystem<'b>, Error> {
+        FileSystem::with_format(
+            flash,
+            sectors,
+            defragsector,
+            appletsector,
+            Format::default(),
+        )
+    }
+
+    /// Same as [`new`](#method.new), for a filesystem whose blocks are in format `format`
+    pub fn with_format<'b>(
+        flash: &'b Flash,
+        sectors: &'b [&'b Sector],
+        defragsector: SectorID,
+        appletsector: SectorID,
+        format: Format,
+    ) -> Result<FileSystem<'b>, Error> {
+        let files = Files::Ram(HashSet::new(FS_FILES_BUCKETS));
+        FileSystem::mount(flash, sectors, defragsector, appletsector, format, files)
+    }
+
+    /// Same as [`with_format`](#method.with_format), for a filesystem whose files are indexed on
+    /// the flash sector `index` rather than all held in RAM
+    ///
+    /// `index` must not be one of `sectors`. If it does not hold an index yet, it is erased, then
+    /// filled with the files found while mounting.
+    pub fn with_index<'b>(
+        flash: &'b Flash,
+        sectors: &'b [&'b Sector],
+        defragsector: SectorID,
+        appletsector: SectorID,
+        format: Format,
+        index: &'b Sector,
+    ) -> Result<FileSystem<'b>, Error> {
+        let files = Files::Flash(get!(Index::open(flash, index, sectors, format)));
+        FileSystem::mount(flash, sectors, defragsector, appletsector, format, files)
+    }
+
+    /// Mounts a filesystem, adding the files found on its sectors to `files`
+    fn mount<'b>(
+        flash: &'b Flash,
+        sectors: &'b [&'b Sector],
+        defragsector: SectorID,
+        appletsector: SectorID,
+        format: Format,
+        mut files: Files<'b>,
     ) -> Result<FileSystem<'b>, Error> {
         debug!("Initializing fs subsystem");
-        let mut files = HashSet::new(FS_FILES_BUCKETS);
         let mut next_block = vec![0; sectors.len()];
         let mut valid_size = vec![0; sectors.len()];
-        'nextsector: for (id, &sector) in sectors.iter().enumerate() {
+        let mut payloads: Vec<(u32, usize)> = Vec::new();
+        let zones: Vec<(&Sector, usize)> = sectors
+            .iter()
+            .enumerate()
+            .map(|(id, &x)| {
+                let skipped = SectorID(id) == defragsector;
+                (x, if skipped { 0 } else { x.len() })
+            })
+            .collect();
+        let cursors = ScanCursor::all(&zones, format);
+        for ((id, &sector), mut cursor) in sectors.iter().enumerate().zip(cursors) {
             debug!("  Scanning sector {}", sector.num());
             if SectorID(id) == defragsector {
                 debug!("Skipping defrag sector");
                 continue;
             }
-            while next_block[id] < sector.len() {
-                match parse_hdr(get!(
-                    sector.read(next_block[id], sector.len() - next_block[id])
-                )) {
+            while !cursor.done() {
+                let pos = cursor.pos();
+                match cursor.next() {
                     Err(ParseNoBlock::Empty) => {
-                        debug!("    Found empty block at {:x}", next_block[id]);
+                        debug!("    Found empty block at {:x}", pos);
                         break;
                     }
                     Err(ParseNoBlock::Broken) => {
-                        debug!("    Found broken block at {:x}, erasing", next_block[id]);
-                        get!(erase_invalid_data(flash, sector, next_block[id]));
-                        continue 'nextsector;
+                        debug!("    Found broken block at {:x}, erasing", pos);
+                        get!(erase_invalid_data(flash, sector, pos));
+                        // Then scan on, over the erased block, to find the end of the sector
+                        continue;
                     }
-                    Err(ParseNoBlock::Erased(size)) => {
-                        debug!(
-                            "    Found erased block of size {:x} at {:x}",
-                            size, next_block[id]
-                        );
-                        next_block[id] += size;
+                    Err(ParseNoBlock::Erased(_size)) => {
+                        debug!("    Found erased block of size {:x} at {:x}", _size, pos);
                     }
-                    Ok((true, tag, data, size)) => {
-                        debug!("    Found valid block at {:x}", next_block[id]);
-                        // If there are multiple valid blocks, this means we
-                        // have been interrupted between marking the new block
-                        // as valid and marking the previous block as invalid.
-                        // In this case, any of the two blocks can be considered
-                        // as the right one, given that it's just supposed to be
-                        // an atomic operation
-                        // So, here we just take whichever comes first in the
-                        // order of scanning, and mark the second one as being
-                        // invalid
-                        if !files.insert(File {
-                            tag: tag,
-                            data: data,
-                            sector: SectorID(id),
-                            size: size,
-                        }) {
-                            // The value was already found, marking this one as
+                    Ok(b) => {
+                        if b.valid {
+                            debug!("    Found valid block at {:x}", pos);
+                            // If there are multiple valid blocks, this means we
+                            // have been interrupted between marking the new block
+                            // as valid and marking the previous block as invalid.
+                            // In this case, any of the two blocks can be considered
+                            // as the right one, given that it's just supposed to be
+                            // an atomic operation
+                            // So, here we just take whichever comes first in the
+                            // order of scanning, and mark the second one as being
                             // invalid
-                            get!(get!(sector.with_writer(
-                                flash,
-                                next_block[id],
-                                1,
-                                |mut b| {
+                            // An on-flash index may already know of this very block
+                            let known = files.get(cursor.tag(&b)).map(|f| {
+                                f.tag.sector().num() == sector.num() && f.tag.start() == b.tag
+                            });
+                            if known != Some(false) {
+                                if let Some(hash) = payload_hash(cursor.tag(&b)) {
+                                    count_payload(&mut payloads, hash, 0);
+                                } else if b.content == Content::Shared {
+                                    count_payload(
+                                        &mut payloads,
+                                        u32_from_bytes(cursor.data(&b)),
+                                        1,
+                                    );
+                                }
+                            }
+                            if known == None {
+                                get!(files.insert(File {
+                                    tag: get!(sector.read(b.tag, b.taglen)),
+                                    data: get!(sector.read(b.data, b.datalen)),
+                                    sector: SectorID(id),
+                                    size: b.size,
+                                    unchecked: Cell::new(b.payload),
+                                    content: b.content,
+                                }));
+                            } else if known == Some(false) {
+                                // The value was already found, marking this one as
+                                // invalid
+                                get!(get!(sector.with_writer(flash, pos, 1, |mut b| {
                                     let val = b[0] & (VALIDITY_NOLONGER | !VALIDITY_MASK);
                                     b.write(0, val)
-                                }
-                            )));
+                                })));
+                            }
+                            if known != Some(false) {
+                                valid_size[id] += b.size;
+                            }
                         }
-                        next_block[id] += size;
-                        valid_size[id] += size;
-                    }
-                    Ok((false, _, _, size)) => {
-                        next_block[id] += size;
                     }
                 }
+                next_block[id] = cursor.pos();
             }
         }
 
@@ -595,26 +1762,76 @@ impl<'a> FileSystem<'a> {
             files: files,
             next_blocks: next_block,
             valid_sizes: valid_size,
+            format: format,
+            defragmentations: 0,
+            reservations: Vec::new(),
+            next_reservation: 0,
+            handles: Vec::new(),
+            next_handle: 0,
+            generation: 0,
+            payloads: payloads,
         };
 
         res.finish_defragmentation()?;
 
+        // Drop the payloads left unreferenced by an interrupted write or erase
+        let orphans: Vec<u32> = res
+            .payloads
+            .iter()
+            .filter(|p| p.1 == 0)
+            .map(|p| p.0)
+            .collect();
+        for hash in orphans {
+            get!(res.release_payload(hash, 0));
+        }
+
         Ok(res)
     }
 
+    /// Returns usage statistics of the filesystem
+    pub fn stats(&self) -> Stats {
+        let ids: Vec<SectorID> = self
+            .sector_ids()
+            .into_iter()
+            .filter(|&x| x != self.defragsector)
+            .collect();
+        Stats {
+            defragmentations: self.defragmentations,
+            valid: ids.iter().map(|&x| self.valid_size(x)).sum(),
+            used: ids.iter().map(|&x| self.next_block(x)).sum(),
+            capacity: ids.iter().map(|&x| self.sector(x).len()).sum(),
+            reserved: self.reservations.iter().map(|r| r.2).sum(),
+        }
+    }
+
     /// Checks whether a given tag is present on the file system
     pub fn has_tag(&self, tag: &[u8]) -> bool {
         self.files.get(tag).is_some()
     }
 
+    /// Checks whether a block of `size` bytes for `tag` can be written on a sector, without taking
+    /// from the space held by reservations
     fn is_available(&self, sector: SectorID, size: usize, tag: &[u8]) -> bool {
+        self.is_available_beside(sector, size, tag, self.reserved(sector))
+    }
+
+    /// Checks whether a block of `size` bytes for `tag` can be written on a sector, without taking
+    /// from `reserved` bytes of it
+    fn is_available_beside(
+        &self,
+        sector: SectorID,
+        size: usize,
+        tag: &[u8],
+        reserved: usize,
+    ) -> bool {
         // If there is enough space on the sector
-        self.next_block(sector) + size <= self.sector(sector).len()
+        self.next_block(sector) + reserved + size <= self.sector(sector).len()
         // And adding the file wouldn't make it go over the defragmentable size
         && {
             let defragsize = self.sector(self.defragsector).len() - 1;
             let next_valid_size =
                 self.valid_size(sector)
+              + reserved
               + size
               - if let Some(f) = self.files.get(tag) {
                     if f.sector == sector { f.size }
@@ -649,6 +1866,55 @@ impl<'a> FileSystem<'a> {
         err!(Error::OutOfFlash)
     }
 
+    /// Returns the sector of the latest reservation able to hold a block for a given tag and
+    /// size, after taking the block's size from the reservation
+    ///
+    /// Writes fall back on reservations instead of defragmenting, so that the ones following a
+    /// `reserve()` never stall.
+    fn take_reserved(&mut self, size: usize, tag: &[u8]) -> Option<SectorID> {
+        for i in (0..self.reservations.len()).rev() {
+            let (_, sector, held) = self.reservations[i];
+            if held >= size
+                && self.is_available_beside(sector, size, tag, self.reserved(sector) - size)
+            {
+                self.reservations[i].2 -= size;
+                return Some(sector);
+            }
+        }
+        None
+    }
+
+    /// Returns the size of the valid blocks of a sector, leaving out its summary
+    fn live_size(&self, sector_id: SectorID) -> usize {
+        let summary = self
+            .files
+            .get(&summary_tag(sector_id))
+            .map(|f| f.size)
+            .unwrap_or(0);
+        self.valid_size(sector_id) - summary
+    }
+
+    /// Returns the sectors that could gain space by being defragmented, least-prioritized first
+    fn defragmentation_candidates(&self) -> Vec<SectorID> {
+        let mut candidates: Vec<SectorID> = self
+            .sector_ids()
+            .into_iter()
+            .filter(|&x| {
+                x != self.defragsector // Don't defragment defrag sector
+                      && x != self.appletsector // Nor applet sector
+                      && self.next_block(x) != self.valid_size(x)
+            })
+            .collect();
+        candidates.sort_by_key(|&id| {
+            if self.valid_size(id) == 0 {
+                usize::MAX
+            } else {
+                (1 << 15) * self.next_block(id) / self.valid_size(id)
+            }
+        });
+        candidates
+    }
+
     fn finish_defragmentation(&mut self) -> Result<(), Error> {
         let defragsector = self.defragsector;
         let defragsect = self.sector(defragsector);
@@ -663,24 +1929,27 @@ impl<'a> FileSystem<'a> {
         // Copy all valid blocks to defrag sector
         debug!("Defragmenting sector {}", sector_id.0);
         let sector = self.sector(sector_id);
-        let mut ptr = 0;
-        while ptr < sector.len() {
-            match parse_hdr(get!(sector.read(ptr, sector.len() - ptr))) {
+        let mut cursor = ScanCursor::new(sector, sector.len(), self.format);
+        while !cursor.done() {
+            match cursor.next() {
                 Err(ParseNoBlock::Empty) => {
                     break;
                 }
                 Err(ParseNoBlock::Broken) => {
                     return Ok(());
                 } // should not happen
-                Err(ParseNoBlock::Erased(size)) => {
-                    ptr += size;
-                }
-                Ok((false, _, _, size)) => {
-                    ptr += size;
-                }
-                Ok((true, tag, data, size)) => {
-                    get!(self.write_impl(&tag, &[&data], defragsector));
-                    ptr += size;
+                Err(ParseNoBlock::Erased(_)) => (),
+                Ok(b) => {
+                    if b.valid && is_summary(cursor.tag(&b)) {
+                        // Summaries get stale as soon as their sector is rewritten
+                        get!(self.take_file(cursor.tag(&b)));
+                    } else if b.valid && !cursor.payload_ok(&b) {
+                        debug!("  Dropping corrupted block at {:x}", b.tag);
+                        get!(self.take_file(cursor.tag(&b)));
+                    } else if b.valid {
+                        let (tag, data) = (cursor.tag(&b), cursor.data(&b));
+                        get!(self.write_impl_with(tag, &[data], defragsector, b.content));
+                    }
                 }
             }
         }
@@ -691,14 +1960,22 @@ impl<'a> FileSystem<'a> {
         *self.set_next_block(sector_id) = 0;
         *self.set_valid_size(sector_id) = 0;
 
-        // Copy all blocks back from defrag sector to previous sector
+        // Copy all blocks back from defrag sector to previous sector, one cluster after the other.
+        // The defrag sector is scanned once, its blocks then being sorted by cluster
         debug!("  Copying all blocks back to previous sector");
-        ptr = 0;
-        while ptr < defragsect.len() - 1 {
-            match parse_hdr(get!(defragsect.read(ptr, defragsect.len() - 1 - ptr))) {
-                Ok((true, tag, data, size)) => {
-                    get!(self.write_impl(&tag, &[&data], sector_id));
-                    ptr += size;
+        let mut blocks = Vec::new();
+        let mut cursor = ScanCursor::new(defragsect, defragsect.len() - 1, self.format);
+        while !cursor.done() {
+            match cursor.next() {
+                Ok(b) => {
+                    if !b.valid {
+                        continue;
+                    } else if !cursor.payload_ok(&b) {
+                        debug!("  Dropping corrupted block at {:x}", b.tag);
+                        get!(self.take_file(cursor.tag(&b)));
+                        continue;
+                    }
+                    blocks.push(b);
                 }
                 Err(ParseNoBlock::Empty) => {
                     break;
@@ -707,12 +1984,42 @@ impl<'a> FileSystem<'a> {
                 Err(ParseNoBlock::Broken) => {
                     return Ok(());
                 }
-                Err(ParseNoBlock::Erased(size)) => {
-                    ptr += size;
-                }
-                Ok((false, _, _, size)) => {
-                    ptr += size;
-                }
+                Err(ParseNoBlock::Erased(_)) => (),
+            }
+        }
+        let tags: Vec<&[u8]> = blocks.iter().map(|b| cursor.tag(b)).collect();
+        let keylen = cluster_keylen(&tags);
+        // The sort being stable, the blocks of a cluster stay in flash order
+        blocks.sort_by_key(|b| cluster_key(cursor.tag(b), keylen));
+        let mut summary = Summary {
+            covered: 0,
+            clusters: Vec::new(),
+            first: Vec::new(),
+            last: Vec::new(),
+        };
+        for b in blocks {
+            let tag = cursor.tag(&b);
+            let key = cluster_key(tag, keylen);
+            if summary.clusters.last().map_or(true, |c| &c.0[..] != key) {
+                summary
+                    .clusters
+                    .push((key.to_vec(), self.next_block(sector_id)));
+            }
+            get!(self.write_impl_with(tag, &[cursor.data(&b)], sector_id, b.content));
+            if summary.first.is_empty() || tag < &summary.first[..] {
+                summary.first = tag.to_vec();
+            }
+            if tag > &summary.last[..] {
+                summary.last = tag.to_vec();
+            }
+        }
+
+        // Describe the clusters, unless the sector is empty or too full to hold their summary
+        summary.covered = self.next_block(sector_id);
+        if summary.covered != 0 {
+            match self.write_impl(&summary_tag(sector_id), &[&summary.to_bytes()], sector_id) {
+                Ok(()) | Err(Error::OutOfFlash) => (),
+                Err(e) => err!(e)?,
             }
         }
 
@@ -725,12 +2032,87 @@ impl<'a> FileSystem<'a> {
         Ok(())
     }
 
+    /// Returns the summary left on a sector by its last defragmentation, if any
+    fn summary(&self, sector_id: SectorID) -> Option<Summary> {
+        let data = self.read(&summary_tag(sector_id)).ok()?;
+        Summary::from_bytes(&data)
+    }
+
+    /// Calls `f` with the tag and data of each file whose tag starts with `prefix`
+    ///
+    /// Files are visited sector by sector, in flash order. A defragmentation leaves the files of
+    /// a sector sorted by the first bytes of their tags (up to the class for object fields), and
+    /// a summary of where each cluster starts, so that only the matching clusters and the blocks
+    /// written since are scanned.
+    ///
+    /// # Errors
+    ///
+    /// Errors if the data of a visited file is found corrupted
+    pub fn scan_prefix<F>(&self, prefix: &[u8], mut f: F) -> Result<(), Error>
+    where
+        F: FnMut(&[u8], &[u8]),
+    {
+        for id in self.sector_ids() {
+            if id == self.defragsector {
+                continue;
+            }
+            let end = self.next_block(id);
+            let zones = match self.summary(id) {
+                Some(summary) => {
+                    let mut zones = summary.zones(prefix);
+                    zones.push((summary.covered, end));
+                    zones
+                }
+                None => vec![(0, end)],
+            };
+            for (start, end) in zones {
+                let mut cursor = ScanCursor::between(self.sector(id), start, end, self.format);
+                while !cursor.done() {
+                    match cursor.next() {
+                        Ok(b) => {
+                            let tag = cursor.tag(&b);
+                            if !b.valid
+                                || !tag.starts_with(prefix)
+                                || is_internal(tag) && !is_internal(prefix)
+                            {
+                                continue;
+                            } else if !cursor.payload_ok(&b) {
+                                return err!(Error::Corrupted);
+                            }
+                            match b.content {
+                                Content::Data => f(tag, cursor.data(&b)),
+                                Content::Shared => {
+                                    let hash = u32_from_bytes(cursor.data(&b));
+                                    let payload = self
+                                        .files
+                                        .get(&payload_tag(hash))
+                                        .ok_or(Error::Corrupted)?;
+                                    f(tag, &*get!(self.contents(&payload)));
+                                }
+                                Content::Zeroed(len) => f(tag, &vec![0; len]),
+                            }
+                        }
+                        Err(ParseNoBlock::Erased(_)) => (),
+                        Err(_) => break,
+                    }
+                }
+            }
+        }
+        Ok(())
+    }
+
     /// Defragments a sector by using the defragmentation sector
     ///
     /// # Errors
     ///
     /// Errors if there is a flash IO error during the defragmentation
     fn defragment(&mut self, sector_id: SectorID) -> Result<(), Error> {
+        self.defragmentations += 1;
+        if self.live_size(sector_id) == 0 && self.next_block(self.defragsector) == 0 {
+            // Nothing to copy, no need to go through the defrag sector (unless a block was already
+            // written there, to be moved into the sector)
+            return self.erase_sector(sector_id);
+        }
         let sect = self.sector(self.defragsector);
         get!(get!(sect.with_writer(
             self.flash,
@@ -744,6 +2126,110 @@ impl<'a> FileSystem<'a> {
         self.finish_defragmentation()
     }
 
+    /// Removes the file tagged `tag` from the table, and returns it
+    fn take_file(&mut self, tag: &[u8]) -> Result<Option<File<'a>>, Error> {
+        self.generation = self.generation.wrapping_add(1);
+        self.files.take(tag)
+    }
+
+    /// Adds a file, whose block must already be valid, to the table
+    fn insert_file(&mut self, f: File<'a>) -> Result<(), Error> {
+        self.generation = self.generation.wrapping_add(1);
+        self.files.insert(f)
+    }
+
+    /// Erases a sector holding no valid block
+    fn erase_sector(&mut self, sector_id: SectorID) -> Result<(), Error> {
+        debug!("Erasing sector {}", sector_id.0);
+        get!(self.take_file(&summary_tag(sector_id)));
+        get!(self.sector(sector_id).erase(self.flash));
+        *self.set_next_block(sector_id) = 0;
+        *self.set_valid_size(sector_id) = 0;
+        Ok(())
+    }
+
+    /// Merges the valid blocks of sparse sectors into other sectors, and erases the sectors left
+    /// without any valid block, returning how many were erased
+    ///
+    /// A defragmentation compacts a sector into itself, through the defrag sector: when the valid
+    /// blocks are spread thinly over several sectors, each of them stays partly full and writes
+    /// keep defragmenting. Compacting instead empties whole sectors, sparsest first, into the
+    /// fullest sectors able to take their valid blocks. It is meant to be run while idle.
+    ///
+    /// # Errors
+    ///
+    /// Errors if a flash IO error occurs
+    pub fn compact(&mut self) -> Result<usize, Error> {
+        let flash = self.flash;
+        let _session = get!(flash.session());
+        let mut sources: Vec<SectorID> = self
+            .sector_ids()
+            .into_iter()
+            .filter(|&x| {
+                x != self.defragsector
+                    && x != self.appletsector
+                    && self.next_block(x) != self.valid_size(x)
+            })
+            .collect();
+        sources.sort_by_key(|&x| self.live_size(x));
+        let mut freed = 0;
+        for source in sources {
+            if self.live_size(source) != 0 {
+                match self.compaction_destination(source) {
+                    Some(dest) => get!(self.move_blocks(source, dest)),
+                    None => continue,
+                }
+            }
+            get!(self.erase_sector(source));
+            freed += 1;
+        }
+        Ok(freed)
+    }
+
+    /// Returns the fullest sector, other than `source`, able to take all the valid blocks of
+    /// `source`
+    fn compaction_destination(&self, source: SectorID) -> Option<SectorID> {
+        let size = self.live_size(source);
+        self.sector_ids()
+            .into_iter()
+            .filter(|&x| {
+                x != source
+                    && x != self.defragsector
+                    && x != self.appletsector
+                    && self.is_available(x, size, &[])
+            })
+            .min_by_key(|&x| self.sector(x).len() - self.next_block(x))
+    }
+
+    /// Moves all the valid blocks of a sector to another one
+    ///
+    /// # Errors
+    ///
+    /// Errors if there is not enough free space on `dest`, or if a flash IO error occurs
+    fn move_blocks(&mut self, source: SectorID, dest: SectorID) -> Result<(), Error> {
+        debug!("Moving blocks of sector {} to sector {}", source.0, dest.0);
+        let sector = self.sector(source);
+        let mut cursor = ScanCursor::new(sector, self.next_block(source), self.format);
+        while !cursor.done() {
+            match cursor.next() {
+                Ok(b) => {
+                    if b.valid && is_summary(cursor.tag(&b)) {
+                        get!(self.take_file(cursor.tag(&b)));
+                    } else if b.valid && !cursor.payload_ok(&b) {
+                        debug!("  Dropping corrupted block at {:x}", b.tag);
+                        get!(self.take_file(cursor.tag(&b)));
+                    } else if b.valid {
+                        let (tag, data) = (cursor.tag(&b), cursor.data(&b));
+                        get!(self.write_impl_with(tag, &[data], dest, b.content));
+                    }
+                }
+                Err(ParseNoBlock::Erased(_)) => (),
+                Err(_) => break,
+            }
+        }
+        Ok(())
+    }
+
     /// Writes a tag-data association on a given sector
     ///
     /// # Errors
@@ -752,14 +2238,32 @@ impl<'a> FileSystem<'a> {
     /// details of valid lengths), if there is not enough free space on the sector, or if a flash
     /// IO error occurs during the defragmentation
     fn write_impl(&mut self, tag: &[u8], data: &[&[u8]], sector_id: SectorID) -> Result<(), Error> {
+        self.write_impl_with(tag, data, sector_id, Content::Data)
+    }
+
+    /// Same as [`write_impl`](#method.write_impl), for a block whose data holds `content`
+    fn write_impl_with(
+        &mut self,
+        tag: &[u8],
+        data: &[&[u8]],
+        sector_id: SectorID,
+        content: Content,
+    ) -> Result<(), Error> {
         if tag.is_empty() || tag.len() >= ((TAGLEN_MASK >> TAGLEN_SHIFT) - 1) as usize {
             return err!(Error::InvalidLengthForTag);
         }
 
         // Compute metadata for later usage
         let datalen = data.iter().map(|x| x.len()).sum();
-        let block_len = self.block_len(tag.len(), datalen);
-        let lenlen = if datalen <= 0xFF { 1 } else { 4 };
+        let format = self.format;
+        let lenlen = if content == Content::Data {
+            format.lenlen(datalen)
+        } else {
+            format.flagged_lenlen()
+        };
+        let layout = format.layout(lenlen, tag.len(), datalen);
+        let block_len = layout.size;
+        let cksum = format.checksum;
         let sector_len =
             self.sector(sector_id).len() - if sector_id == self.defragsector { 1 } else { 0 };
 
@@ -770,57 +2274,64 @@ impl<'a> FileSystem<'a> {
             return err!(Error::OutOfFlash);
         }
 
+        // Header and data length field
+        let mut head = [0; 5];
+        head[0] = VALIDITY_NOTYET
+            | (tag.len() << TAGLEN_SHIFT) as u8
+            | if lenlen == 4 { LENLEN_LONG } else { LENLEN_SHORT };
+        let lenfield = match content {
+            Content::Data => datalen,
+            Content::Shared => datalen | shared_flag(lenlen),
+            Content::Zeroed(len) => len | zeroed_flag(lenlen),
+        };
+        for j in 0..lenlen {
+            head[1 + j] = (lenfield >> (8 * (lenlen - 1 - j))) as u8;
+        }
+        let head = &head[..1 + lenlen];
+
         // Write the block
         get!(get!(self.sector(sector_id).with_writer(
             self.flash,
             self.next_block(sector_id),
             block_len,
             |mut b| -> Result<(), FlashIOError> {
-                // Write the header
-                let mut i = 0;
-                if lenlen == 1 {
-                    get!(b.write(
-                        i,
-                        VALIDITY_NOTYET | (tag.len() << TAGLEN_SHIFT) as u8 | LENLEN_SHORT
-                    ));
-                    get!(b.write(i + 1, datalen as u8));
-                    i += 2;
+                if format.aligned {
+                    get!(write_aligned_block(&mut b, format, head, tag, data));
                 } else {
-                    get!(b.write(
-                        i,
-                        VALIDITY_NOTYET | (tag.len() << TAGLEN_SHIFT) as u8 | LENLEN_LONG
-                    ));
-                    get!(b.write_block(
-                        i + 1,
-                        &[
-                            (datalen >> 24) as u8,
-                            (datalen >> 16) as u8,
-                            (datalen >> 8) as u8,
-                            datalen as u8
-                        ]
-                    ));
-                    i += 5;
-                }
+                    // Write the header
+                    get!(b.write(0, head[0]));
+                    get!(b.write_block(1, &head[1..]));
+
+                    // Then the tag and the data
+                    debug!(
+                        "About to write tag of length {} to index {} of block with len {}",
+                        tag.len(),
+                        layout.tag,
+                        b.len()
+                    );
+                    get!(b.write_block(layout.tag, tag));
+                    if let Some(hdrck) = layout.hdrck {
+                        let crc = cksum.compute(b[0] & !VALIDITY_MASK, &b[1..hdrck]);
+                        get!(b.write_block(hdrck, &cksum.to_bytes(crc)[..cksum.len()]));
+                    }
+                    let mut i = layout.data;
+                    for d in data {
+                        get!(b.write_block(i, d));
+                        i += d.len();
+                    }
 
-                // Then the tag and the data
-                debug!(
-                    "About to write tag of length {} to index {} of block with len {}",
-                    tag.len(),
-                    i,
-                    b.len()
-                );
-                get!(b.write_block(i, tag));
-                i += tag.len();
-                for d in data {
-                    get!(b.write_block(i, d));
-                    i += d.len();
+                    // The footer
+                    let crc = if format.lazy_payload {
+                        cksum.compute(0, &b[layout.data..i])
+                    } else {
+                        cksum.compute(b[0] & !VALIDITY_MASK, &b[1..i])
+                    };
+                    get!(b.write_block(i, &cksum.to_bytes(crc)[..cksum.len()]));
                 }
 
-                // The footer
-                let crc = crc8(b[0] & !VALIDITY_MASK, &b[1..i]);
-                get!(b.write(i, crc));
-
-                // And finally, mark the block as valid, now that it's completely written
+                // And finally, mark the block as valid, now that it's completely written (the
+                // barrier keeps the flip from being programmed along with the rest)
+                get!(b.barrier());
                 let header = b[0];
                 get!(b.write(0, header & (VALIDITY_VALID | !VALIDITY_MASK)));
 
@@ -828,36 +2339,51 @@ impl<'a> FileSystem<'a> {
             }
         )));
 
+        // Count the new reference before dropping the previous one, which may hold the same
+        if content == Content::Shared {
+            count_payload(&mut self.payloads, u32_from_bytes(&data.concat()), 1);
+        } else if let Some(hash) = payload_hash(tag) {
+            count_payload(&mut self.payloads, hash, 0);
+        }
+
         // Remove previous file from hashmap and mark it as invalid
         match self.erase(tag) {
             Ok(()) | Err(Error::NoSuchTag) => (),
             Err(e) => err!(e)?,
         }
 
-        // Update the link to the file in hashmap
-        let sector = self.sector(sector_id);
-        let new_tag = get!(sector.read(self.next_block(sector_id) + 1 + lenlen, tag.len()));
-        let new_data =
-            get!(sector.read(self.next_block(sector_id) + 1 + lenlen + tag.len(), datalen));
-        self.files.insert(File {
-            tag: new_tag,
-            data: new_data,
-            sector: sector_id,
-            size: block_len,
-        });
-
         // Advance next_block pointer
+        let pos = self.next_block(sector_id);
         *self.set_next_block(sector_id) += block_len;
         *self.set_valid_size(sector_id) += block_len;
 
+        // Update the link to the file in hashmap
+        let sector = self.sector(sector_id);
+        let new_file = || -> Result<File<'a>, Error> {
+            Ok(File {
+                tag: get!(sector.read(pos + layout.tag, tag.len())),
+                data: get!(sector.read(pos + layout.data, datalen)),
+                sector: sector_id,
+                size: block_len,
+                unchecked: Cell::new(None),
+                content: content,
+            })
+        };
+        if let Err(e) = self.insert_file(get!(new_file())) {
+            // An on-flash index full of live records cannot take the file, whose block is then
+            // dropped rather than left valid but out of reach
+            get!(self.erase_file(get!(new_file())));
+            return err!(e);
+        }
+
         Ok(())
     }
 
     /// Length of a block with a given tag and data
     fn block_len(&self, taglen: usize, datalen: usize) -> usize {
-        2 + // Header & checksum
-        if datalen > 0xFF { 4 } else { 1 } + // Length of data field
-        taglen + datalen
+        self.format
+            .layout(self.format.lenlen(datalen), taglen, datalen)
+            .size
     }
 
     /// Write a tag-data association to the file system
@@ -868,44 +2394,101 @@ impl<'a> FileSystem<'a> {
     ///
     /// Errors if not enough space can be gathered or if a flash IO error occurs during writing
     pub fn write(&mut self, tag: &[u8], data: &[u8]) -> Result<(), Error> {
-        // Find sector on which to put the block
-        let mut sector_id = self.available_sector(self.block_len(tag.len(), data.len()), tag);
+        self.write_with(tag, data, true)
+    }
+
+    /// Write a tag-data association to the file system, unless doing so requires defragmenting a
+    /// sector
+    ///
+    /// Defragmenting a sector takes seconds on card: this allows answering the current request
+    /// first, and defragmenting later on with [`write`](#method.write).
+    ///
+    /// # Errors
+    ///
+    /// Errors with `WouldBlock` if a sector would have to be defragmented, with `OutOfFlash` if
+    /// not even defragmenting would gather enough space, or if a flash IO error occurs during
+    /// writing
+    pub fn write_nodefrag(&mut self, tag: &[u8], data: &[u8]) -> Result<(), Error> {
+        self.write_with(tag, data, false)
+    }
+
+    /// Writes a tag-data association to the file system, defragmenting sectors as needed if
+    /// `defrag` is set
+    fn write_with(&mut self, tag: &[u8], data: &[u8], defrag: bool) -> Result<(), Error> {
+        let flash = self.flash;
+        let _session = get!(flash.session());
+        if self.format.dedup && data.len() >= DEDUP_MIN_LEN && !is_internal(tag) {
+            if let Some(hash) = get!(self.share(data, defrag)) {
+                let size = self
+                    .format
+                    .layout(self.format.flagged_lenlen(), tag.len(), 4)
+                    .size;
+                let reference = u32_to_bytes(hash);
+                let res = self.place(size, tag, defrag).and_then(|sector_id| {
+                    self.write_impl_with(tag, &[&reference], sector_id, Content::Shared)
+                });
+                if res.is_err() {
+                    // A payload just written for this file is not left behind without a reference
+                    get!(self.release_payload(hash, 0));
+                }
+                return res;
+            }
+        }
+        let size = self.block_len(tag.len(), data.len());
+        let sector_id = get!(self.place(size, tag, defrag));
+        self.write_impl(tag, &[data], sector_id)
+    }
+
+    /// Finds a sector on which to put a block of `size` bytes for `tag`, defragmenting sectors as
+    /// needed if `defrag` is set
+    fn place(&mut self, size: usize, tag: &[u8], defrag: bool) -> Result<SectorID, Error> {
+        let mut sector_id = self.available_sector(size, tag);
         if sector_id.is_err() {
+            if let Some(sector) = self.take_reserved(size, tag) {
+                return Ok(sector);
+            }
             // If none is available yet, defragment what we need to before
             // continuing
-            let mut sectors_to_defragment: Vec<SectorID> = self
-                .sector_ids()
-                .into_iter()
-                .filter(|&x| {
-                    x != self.defragsector // Don't defragment defrag sector
-                          && x != self.appletsector // Nor applet sector
-                          && self.next_block(x) != self.valid_size(x)
-                })
-                .collect();
-            // Sort sectors with least-prioritized-for-defrag first
-            sectors_to_defragment.sort_by_key(|&id| {
-                if self.valid_size(id) == 0 {
-                    usize::MAX
-                } else {
-                    (1 << 15) * self.next_block(id) / self.valid_size(id)
-                }
-            });
+            let sectors_to_defragment = self.defragmentation_candidates();
+            if !defrag && !sectors_to_defragment.is_empty() {
+                return Err(Error::WouldBlock);
+            }
             // Try to find an available sector while defragmenting
             for &x in sectors_to_defragment.iter().rev() {
                 get!(self.defragment(x));
-                sector_id = self.available_sector(self.block_len(tag.len(), data.len()), tag);
+                sector_id = self.available_sector(size, tag);
                 if sector_id.is_ok() {
                     break;
                 }
             }
         }
-        // And put it in
-        get!(self.write_impl(tag, &[data], get!(sector_id)));
-        Ok(())
+        sector_id
+    }
+
+    /// Stores `data` as a shared payload, unless it already is, and returns its hash
+    ///
+    /// Returns `None` if another payload has the same hash, the data then having to be stored
+    /// along with its file.
+    fn share(&mut self, data: &[u8], defrag: bool) -> Result<Option<u32>, Error> {
+        let hash = index::hash(data);
+        let tag = payload_tag(hash);
+        if let Some(payload) = self.files.get(&tag) {
+            get!(self.check_payload(&payload));
+            return Ok(if &*payload.data == data {
+                Some(hash)
+            } else {
+                None
+            });
+        }
+        let sector_id = get!(self.place(self.block_len(tag.len(), data.len()), &tag, defrag));
+        get!(self.write_impl(&tag, &[data], sector_id));
+        Ok(Some(hash))
     }
 
     /// Writes a tag-data association to the applet sector
     pub fn write_applet(&mut self, tag: &[u8], data: &[u8]) -> Result<(), Error> {
+        let flash = self.flash;
+        let _session = get!(flash.session());
         let appletsector = self.appletsector;
         if self.is_available(appletsector, self.block_len(tag.len(), data.len()), tag) {
             self.write_impl(tag, &[data], appletsector)
@@ -919,39 +2502,95 @@ impl<'a> FileSystem<'a> {
         }
     }
 
-    /// Replaces the bytes at some offset of the file. Note that if `offset + data.len()` is above
-    /// the size of the file, the result will not be extended past the original length without
-    /// raising any error.
+    /// Reserves `size` bytes of flash that can be written without defragmenting, until released
+    ///
+    /// Any defragmentation needed is run now, so that the writes and edits that follow, up to
+    /// `size` bytes of blocks (counting their header, tag and checksum), never stall on one. This
+    /// turns, for instance, the stalls in the middle of a transaction into a single step before
+    /// it. Reservations are not persistent: they are all released on reboot.
+    ///
+    /// # Errors
+    ///
+    /// Errors if not enough space can be gathered on a single sector, or if a flash IO error
+    /// occurs during the defragmentation
+    pub fn reserve(&mut self, size: usize) -> Result<Reservation, Error> {
+        let flash = self.flash;
+        let _session = get!(flash.session());
+        let mut sector_id = self.available_sector(size, &[]);
+        if sector_id.is_err() {
+            for &x in self.defragmentation_candidates().iter().rev() {
+                get!(self.defragment(x));
+                sector_id = self.available_sector(size, &[]);
+                if sector_id.is_ok() {
+                    break;
+                }
+            }
+        }
+        let reservation = Reservation(self.next_reservation);
+        self.next_reservation += 1;
+        self.reservations.push((reservation, get!(sector_id), size));
+        Ok(reservation)
+    }
+
+    /// Releases the space a reservation still holds
+    ///
+    /// Releasing a reservation twice is harmless.
+    pub fn release(&mut self, reservation: Reservation) {
+        self.reservations.retain(|r| r.0 != reservation);
+    }
+
+    /// Replaces the bytes at some offset of the file
+    ///
+    /// # Errors
+    ///
+    /// Errors if the tag does not exist in the filesystem, if `offset + data.len()` is above the
+    /// length of the file (which is never extended), if not enough space can be gathered or if a
+    /// flash IO error occurs during writing
     pub fn edit_at(&mut self, tag: &[u8], offset: usize, data: &[u8]) -> Result<(), Error> {
-        let current_file = self.files.take(tag).ok_or(Error::NoSuchTag)?;
+        let zeroed = match self.files.get(tag).ok_or(Error::NoSuchTag)?.content {
+            Content::Zeroed(len) => Some(len),
+            _ => None,
+        };
+        let current = match zeroed {
+            Some(_) => None,
+            None => Some(get!(self.read(tag))),
+        };
+        let current_len = match current {
+            Some(ref current) => current.len(),
+            None => zeroed.unwrap_or(0),
+        };
+        if offset > current_len || data.len() > current_len - offset {
+            return err!(Error::OutOfBounds);
+        }
+        // A zeroed file is materialized out of static zeros rather than a buffer in RAM
+        let parts: Vec<&[u8]> = match current {
+            Some(ref current) => vec![&current[..offset], data, &current[offset + data.len()..]],
+            None => {
+                let mut parts = zeros(offset);
+                parts.push(data);
+                parts.extend(zeros(current_len - offset - data.len()));
+                parts
+            }
+        };
+        let len = parts.iter().map(|p| p.len()).sum();
+        let flash = self.flash;
+        let _session = get!(flash.session());
+        // A file referencing a shared payload gets a copy of its own
+        let current_file = get!(self.take_file(tag)).ok_or(Error::NoSuchTag)?;
         let current_sector = current_file.sector;
-        if self.is_available(
-            current_sector,
-            self.block_len(tag.len(), current_file.data.len()),
-            tag,
-        ) {
-            get!(self.write_impl(
-                tag,
-                &[
-                    &current_file.data[..offset],
-                    data,
-                    &current_file.data[offset + data.len()..]
-                ],
-                current_sector
-            ));
+        if self.is_available(current_sector, self.block_len(tag.len(), len), tag) {
+            get!(self.write_impl(tag, &parts, current_sector));
+            get!(self.erase_file(current_file));
+            Ok(())
+        } else if let Some(sector) = self.take_reserved(self.block_len(tag.len(), len), tag) {
+            get!(self.write_impl(tag, &parts, sector));
             get!(self.erase_file(current_file));
             Ok(())
         } else {
             let defragsector = self.defragsector;
-            get!(self.write_impl(
-                tag,
-                &[
-                    &current_file.data[..offset],
-                    data,
-                    &current_file.data[offset + data.len()..]
-                ],
-                defragsector
-            ));
+            get!(self.write_impl(tag, &parts, defragsector));
+            drop(parts);
+            drop(current);
             get!(self.erase_file(current_file));
             get!(self.defragment(current_sector));
             Ok(())
@@ -962,16 +2601,245 @@ impl<'a> FileSystem<'a> {
     ///
     /// # Errors
     ///
-    /// Errors if the tag does not exist in the filesystem
+    /// Errors if the tag does not exist in the filesystem, if its data is found corrupted, or if
+    /// the file is zeroed and has no data on flash yet (see [`create_zeroed`](#method.create_zeroed))
     pub fn read(&self, tag: &[u8]) -> Result<FlashBlock<'a>, Error> {
-        self.files
-            .get(tag)
-            .map_or(Err(Error::NoSuchTag), |v| Ok(v.data.clone()))
+        // The file is let go of before looking its payload up, as an on-flash index may have to
+        // evict it from its cache
+        let hash = {
+            let f = self.files.get(tag).ok_or(Error::NoSuchTag)?;
+            match f.content {
+                Content::Shared => u32_from_bytes(&f.data),
+                _ => return self.contents(&f),
+            }
+        };
+        self.payload(hash)
+    }
+
+    /// Returns the contents of a file, that of its shared payload if it references one, after
+    /// verifying them against their checksum
+    ///
+    /// # Errors
+    ///
+    /// Errors if the contents do not match their checksum, or if the shared payload is missing
+    fn contents(&self, f: &File<'a>) -> Result<FlashBlock<'a>, Error> {
+        match f.content {
+            Content::Data => {
+                get!(self.check_payload(f));
+                Ok(f.data.clone())
+            }
+            Content::Shared => self.payload(u32_from_bytes(&f.data)),
+            Content::Zeroed(_) => err!(Error::Zeroed),
+        }
+    }
+
+    /// Returns the data of a shared payload, after verifying it against its checksum
+    ///
+    /// # Errors
+    ///
+    /// Errors if the payload is missing, or if it does not match its checksum
+    fn payload(&self, hash: u32) -> Result<FlashBlock<'a>, Error> {
+        let payload = self.files.get(&payload_tag(hash)).ok_or(Error::Corrupted)?;
+        get!(self.check_payload(&payload));
+        Ok(payload.data.clone())
+    }
+
+    /// Retrieves the length of the file associated to a tag
+    ///
+    /// # Errors
+    ///
+    /// Errors if the tag does not exist in the filesystem, or if its data is found corrupted
+    pub fn length(&self, tag: &[u8]) -> Result<usize, Error> {
+        let content = self.files.get(tag).ok_or(Error::NoSuchTag)?.content;
+        match content {
+            Content::Zeroed(len) => Ok(len),
+            _ => Ok(get!(self.read(tag)).len()),
+        }
+    }
+
+    /// Copies the bytes of the file associated to a tag, starting at `offset`, into `buffer`, and
+    /// returns how many were copied
+    ///
+    /// Contrary to [`read`](#method.read), it also reads zeroed files, which have no data on flash.
+    ///
+    /// # Errors
+    ///
+    /// Errors if the tag does not exist in the filesystem, or if its data is found corrupted
+    pub fn read_at(&self, tag: &[u8], offset: usize, buffer: &mut [u8]) -> Result<usize, Error> {
+        let content = self.files.get(tag).ok_or(Error::NoSuchTag)?.content;
+        if let Content::Zeroed(len) = content {
+            let n = core::cmp::min(buffer.len(), len.saturating_sub(offset));
+            for x in buffer[..n].iter_mut() {
+                *x = 0;
+            }
+            return Ok(n);
+        }
+        let data = get!(self.read(tag));
+        if offset >= data.len() {
+            return Ok(0);
+        }
+        let n = core::cmp::min(buffer.len(), data.len() - offset);
+        buffer[..n].copy_from_slice(&data[offset..offset + n]);
+        Ok(n)
+    }
+
+    /// Opens the file associated to a tag, for accessing it later without looking its tag up
+    ///
+    /// The data of the file is located by the first access through the handle, and read in place
+    /// by the following ones, as long as no file is written, edited or erased in the meantime. A
+    /// handle stays open until closed, whatever happens to the file: once the file is erased, the
+    /// accesses through it error with `NoSuchTag`, until a file with the same tag is written.
+    ///
+    /// # Errors
+    ///
+    /// Errors if the tag does not exist in the filesystem, or if `HANDLES_MAX` files are already
+    /// opened
+    pub fn open(&mut self, tag: &[u8]) -> Result<Handle, Error> {
+        if self.files.get(tag).is_none() {
+            return err!(Error::NoSuchTag);
+        }
+        if self.handles.len() >= HANDLES_MAX {
+            return err!(Error::TooManyHandles);
+        }
+        let handle = Handle(self.next_handle);
+        self.next_handle += 1;
+        self.handles.push((handle, tag.to_vec(), Cell::new(None)));
+        Ok(handle)
+    }
+
+    /// Closes a handle
+    ///
+    /// Closing a handle twice is harmless.
+    pub fn close(&mut self, handle: Handle) {
+        self.handles.retain(|h| h.0 != handle);
+    }
+
+    /// Copies the bytes of an opened file, starting at `offset`, into `buffer`, and returns how
+    /// many were copied (see [`read_at`](#method.read_at))
+    ///
+    /// # Errors
+    ///
+    /// Errors if the handle is not opened, if the file does not exist anymore, or if its data is
+    /// found corrupted
+    pub fn read_handle_at(
+        &self,
+        handle: Handle,
+        offset: usize,
+        buffer: &mut [u8],
+    ) -> Result<usize, Error> {
+        let &(_, ref tag, ref location) = self
+            .handles
+            .iter()
+            .find(|h| h.0 == handle)
+            .ok_or(Error::NoSuchTag)?;
+        let (addr, len) = match location.get() {
+            Some((generation, addr, len)) if generation == self.generation => (addr, len),
+            _ => {
+                let content = self.files.get(tag).ok_or(Error::NoSuchTag)?.content;
+                if let Content::Zeroed(_) = content {
+                    return self.read_at(tag, offset, buffer);
+                }
+                let data = get!(self.read(tag));
+                location.set(Some((self.generation, data.as_ptr() as usize, data.len())));
+                (data.as_ptr() as usize, data.len())
+            }
+        };
+        // Blocks only move or get erased along with a change of the table of the files, so the
+        // data is still there, and was already checked against its checksum
+        if offset >= len {
+            return Ok(0);
+        }
+        let data = unsafe { core::slice::from_raw_parts(addr as *const u8, len) };
+        let n = core::cmp::min(buffer.len(), len - offset);
+        buffer[..n].copy_from_slice(&data[offset..offset + n]);
+        Ok(n)
+    }
+
+    /// Replaces the bytes at some offset of an opened file (see [`edit_at`](#method.edit_at))
+    ///
+    /// # Errors
+    ///
+    /// Errors if the handle is not opened, or as [`edit_at`](#method.edit_at)
+    pub fn edit_handle_at(
+        &mut self,
+        handle: Handle,
+        offset: usize,
+        data: &[u8],
+    ) -> Result<(), Error> {
+        // Tags are at most 31 bytes long, see `TAGLEN_MASK`
+        let mut tag = [0; 32];
+        let taglen = {
+            let h = self
+                .handles
+                .iter()
+                .find(|h| h.0 == handle)
+                .ok_or(Error::NoSuchTag)?;
+            tag[..h.1.len()].copy_from_slice(&h.1);
+            h.1.len()
+        };
+        self.edit_at(&tag[..taglen], offset, data)
+    }
+
+    /// Creates a file of `len` zeros, recording only its length on flash
+    ///
+    /// Allocating a persistent array this way takes a block of a few bytes, whatever its length,
+    /// and no buffer in RAM. The zeros are only written out by the first
+    /// [`edit_at`](#method.edit_at) of the file (or by [`materialize`](#method.materialize)).
+    ///
+    /// # Errors
+    ///
+    /// Errors if the file could never be written out in full, if not enough space can be gathered
+    /// or if a flash IO error occurs during writing
+    pub fn create_zeroed(&mut self, tag: &[u8], len: usize) -> Result<(), Error> {
+        if len >= zeroed_flag(self.format.flagged_lenlen())
+            || self.block_len(tag.len(), len) >= self.sector(self.defragsector).len()
+        {
+            return err!(Error::OutOfFlash);
+        }
+        let flash = self.flash;
+        let _session = get!(flash.session());
+        let size = self
+            .format
+            .layout(self.format.flagged_lenlen(), tag.len(), 0)
+            .size;
+        let sector_id = get!(self.place(size, tag, true));
+        self.write_impl_with(tag, &[], sector_id, Content::Zeroed(len))
+    }
+
+    /// Writes out the zeros of a zeroed file, so that it can be [`read`](#method.read) in place
+    ///
+    /// Nothing is done for files that are not zeroed.
+    ///
+    /// # Errors
+    ///
+    /// Errors if the tag does not exist in the filesystem, if not enough space can be gathered or
+    /// if a flash IO error occurs during writing
+    pub fn materialize(&mut self, tag: &[u8]) -> Result<(), Error> {
+        let content = self.files.get(tag).ok_or(Error::NoSuchTag)?.content;
+        match content {
+            Content::Zeroed(_) => self.edit_at(tag, 0, &[]),
+            _ => Ok(()),
+        }
+    }
+
+    /// Verifies the data of a file against its checksum, unless it has already been done
+    ///
+    /// # Errors
+    ///
+    /// Errors if the data does not match its checksum
+    fn check_payload(&self, f: &File) -> Result<(), Error> {
+        if let Some(expected) = f.unchecked.get() {
+            if self.format.checksum.compute(0, &f.data) != expected {
+                return err!(Error::Corrupted);
+            }
+            f.unchecked.set(None);
+        }
+        Ok(())
     }
 
     fn erase_file(&mut self, f: File) -> Result<(), Error> {
         *self.set_valid_size(f.sector) -= f.size;
-        let hdrpos = f.tag.start() - if f.data.len() <= 0xFF { 1 } else { 4 } - 1;
+        let hdrpos = f.header(self.format);
         get!(get!(f.tag.sector().with_writer(
             self.flash,
             hdrpos,
@@ -981,13 +2849,34 @@ impl<'a> FileSystem<'a> {
                 b.write(0, val)
             }
         )));
+        if f.content == Content::Shared {
+            get!(self.release_payload(u32_from_bytes(&f.data), 1));
+        }
+        Ok(())
+    }
+
+    /// Drops `by` references to a shared payload, erasing the payload once no file references it
+    fn release_payload(&mut self, hash: u32, by: usize) -> Result<(), Error> {
+        let i = match self.payloads.iter().position(|p| p.0 == hash) {
+            Some(i) => i,
+            None => return Ok(()),
+        };
+        self.payloads[i].1 = self.payloads[i].1.saturating_sub(by);
+        if self.payloads[i].1 == 0 {
+            self.payloads.swap_remove(i);
+            if let Some(f) = get!(self.take_file(&payload_tag(hash))) {
+                get!(self.erase_file(f));
+            }
+        }
         Ok(())
     }
 
     /// Removes the file associated to a tag
     pub fn erase(&mut self, tag: &[u8]) -> Result<(), Error> {
+        let flash = self.flash;
+        let _session = get!(flash.session());
         // Remove file from hashmap and mark it as invalid
-        let f = self.files.take(tag).ok_or(Error::NoSuchTag)?;
+        let f = get!(self.take_file(tag)).ok_or(Error::NoSuchTag)?;
         self.erase_file(f)
     }
 }
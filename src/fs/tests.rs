@@ -27,7 +27,8 @@ use super::*;
 #[cfg(test)]
 use speculate::speculate; // Must be imported into the current scope.
 
-use {flash, flash_ll};
+use super::bench::{replay, workload};
+use {crc_ll, flash, flash_ll, scan_ll};
 
 speculate! {
     describe "crc" {
@@ -61,6 +62,218 @@ speculate! {
             assert_eq!(crc8(0xE1, &[0x00, 0xCA, 0xFE]), 0x26); // Computed using https://ghsi.de/CRC/index.php?Polynom=111010101&Message=E100CAFE
             assert_eq!(crc8(0x12, &[0x34, 0x56, 0x78, 0x90]), 0x3E); // Computed using http://crccalc.com/ (CRC-8/DVB-S2)
         }
+
+        it "has correct slicing tables" {
+            for i in 0..256 {
+                let mut crc = CRC_TABLE[i];
+                for k in 0..3 {
+                    crc = CRC_TABLE[crc as usize];
+                    assert_eq!(CRC_SLICING_TABLES[k][i], crc);
+                }
+            }
+        }
+
+        it "computes the same CRC-8 with slicing as byte by byte" {
+            let bytes: Vec<u8> = (0..37).map(|x| (x * 73 + 11) as u8).collect();
+            for len in 0..bytes.len() {
+                let mut crc = CRC_TABLE[0x5A];
+                for b in &bytes[..len] {
+                    crc = CRC_TABLE[(crc ^ b) as usize];
+                }
+                assert_eq!(crc8(0x5A, &bytes[..len]), crc);
+            }
+        }
+
+        it "computes correct CRC-32s" {
+            assert_eq!(crc_ll::crc32(b"123456789"), 0x0376E6E7); // Computed using http://crccalc.com/ (CRC-32/MPEG-2)
+            for split in 0..10 {
+                let (a, b) = b"123456789".split_at(split);
+                assert_eq!(crc_ll::crc32_update(crc_ll::crc32(a), b), 0x0376E6E7);
+            }
+            assert_eq!(crc32(b'9', b"12345678"), 0x0376E6E7);
+        }
+    }
+
+    describe "scan" {
+        it "finds the same runs as byte-by-byte loops" {
+            let mut bytes = vec![0xFF; 80];
+            for &(pos, value) in &[(0, 0x00), (3, 0x12), (17, 0x00), (40, 0xFE), (79, 0x00)] {
+                bytes[pos] = value;
+                for start in 0..8 {
+                    for end in start..bytes.len() {
+                        let zone = &bytes[start..end];
+                        for &value in &[0x00, 0xFF] {
+                            let first = zone.iter().position(|&b| b != value).unwrap_or(zone.len());
+                            let last = zone.iter().rposition(|&b| b != value).map_or(0, |p| p + 1);
+                            assert_eq!(scan_ll::find_first_not(zone, value), first);
+                            assert_eq!(scan_ll::find_last_not(zone, value), last);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    describe "image" {
+        before {
+            let _only_one_at_a_time = flash_ll::FLASH_TEST_RUNNING.lock();
+            let path = ::std::env::temp_dir()
+                .join(format!("javacard-os-fs-{}.img", ::std::process::id()));
+            let _ = ::std::fs::remove_file(&path);
+            let geometry: Vec<(usize, usize)> = (0..8).map(|i| (i << 20, 1 << 20)).collect();
+            flash_ll::map_image(&path, &geometry).unwrap();
+        }
+
+        after {
+            flash_ll::unmap_image();
+            ::std::fs::remove_file(&path).unwrap();
+        }
+
+        #[ignore]
+        it "benchmarks mounting a multi-megabyte image" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let data: Vec<u8> = (0..1000).map(|x| x as u8).collect();
+            let flash_sectors = flash_ll::sectors();
+            let flash = unsafe { Flash::new(&flash_sectors) }.unwrap();
+            let fs_sectors: Vec<&flash::Sector> = (1..8).map(|i| flash.sector(flash::SectorID(i))).collect();
+            let mut fs = FileSystem::new(&flash, &fs_sectors, SectorID(0), SectorID(6)).unwrap();
+            for i in 0..5000 {
+                fs.write(format!("cap-{}", i).as_bytes(), &data).unwrap();
+            }
+            let start = ::std::time::Instant::now();
+            drop(fs);
+            let fs = FileSystem::new(&flash, &fs_sectors, SectorID(0), SectorID(6)).unwrap();
+            println!("Mounting 5000 files of 1000 bytes from a 8MB image: {:?}", start.elapsed());
+            assert_eq!(&*fs.read(b"cap-4242").unwrap(), &data[..]);
+        }
+
+        #[ignore]
+        it "benchmarks mounting tens of thousands of files with an on-flash index" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let flash_sectors = flash_ll::sectors();
+            let flash = unsafe { Flash::new(&flash_sectors) }.unwrap();
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format::default();
+            let fs_sectors: Vec<&flash::Sector> = (1..8).map(|i| flash.sector(flash::SectorID(i))).collect();
+            let mut fs = FileSystem::with_index(&flash, &fs_sectors, SectorID(0), SectorID(6), format, index).unwrap();
+            for i in 0..30000 {
+                fs.write(format!("field-{}", i).as_bytes(), &[i as u8; 16]).unwrap();
+            }
+            drop(fs);
+            let start = ::std::time::Instant::now();
+            let fs = FileSystem::new(&flash, &fs_sectors, SectorID(0), SectorID(6)).unwrap();
+            println!("Mounting 30000 files into RAM: {:?}", start.elapsed());
+            let start = ::std::time::Instant::now();
+            for i in 0..30000 {
+                assert_eq!(fs.read(format!("field-{}", i).as_bytes()).unwrap()[0], i as u8);
+            }
+            println!("  Reading them all: {:?}", start.elapsed());
+            drop(fs);
+            let start = ::std::time::Instant::now();
+            let fs = FileSystem::with_index(&flash, &fs_sectors, SectorID(0), SectorID(6), format, index).unwrap();
+            println!("Mounting 30000 files with an on-flash index: {:?}", start.elapsed());
+            let start = ::std::time::Instant::now();
+            for i in 0..30000 {
+                assert_eq!(fs.read(format!("field-{}", i).as_bytes()).unwrap()[0], i as u8);
+            }
+            println!("  Reading them all: {:?}", start.elapsed());
+        }
+
+        #[ignore]
+        it "sweeps flash geometries against a card session" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let data: Vec<u8> = (0..4096).map(|x| (x * 7) as u8).collect();
+            // Each layout gives 256k to the files, along with a 16k applet sector and a defrag
+            // sector as large as the others
+            for &(count, size) in &[(16, 0x4000), (8, 0x8000), (4, 0x10000), (2, 0x20000)] {
+                let geometry: Vec<(usize, usize)> = ::std::iter::once((0, 0x4000))
+                    .chain((0..count + 1).map(|i| (0x4000 + i * size, size)))
+                    .collect();
+                flash_ll::map_image(&path, &geometry).unwrap();
+                let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+                let ids: Vec<flash::SectorID> = (0..geometry.len()).map(flash::SectorID).collect();
+                for &id in ids.iter() {
+                    flash.sector(id).erase(&flash).unwrap();
+                }
+                let roles = Geometry { program: &[], sectors: &ids, defrag: SectorID(1), applet: SectorID(0), index: None };
+                let fs_sectors = roles.fs_sectors(&flash);
+                let mut fs = FileSystem::new(&flash, &fs_sectors, roles.defrag, roles.applet).unwrap();
+
+                let mut ops = 0;
+                let mut total = ::std::time::Duration::new(0, 0);
+                let mut worst = total;
+                let mut card_worst = 0;
+                flash_ll::reset_elapsed();
+                for line in workload() {
+                    let start = ::std::time::Instant::now();
+                    let card_start = flash_ll::elapsed_ns();
+                    replay(&mut fs, &line, &data, ops).unwrap();
+                    let elapsed = start.elapsed();
+                    total += elapsed;
+                    worst = ::std::cmp::max(worst, elapsed);
+                    card_worst = ::std::cmp::max(card_worst, flash_ll::elapsed_ns() - card_start);
+                    ops += 1;
+                }
+                let stats = fs.stats();
+                println!(
+                    "{:2} x {:3}k: {} ops, {:?}/op on average, {:?} at worst (on card: {}ms, {}ms), \
+                     {} defragmentations, {}% valid, {}% used",
+                    count, size >> 10, ops, total / ops as u32, worst,
+                    flash_ll::elapsed_ns() / ops as u64 / 1_000_000, card_worst / 1_000_000,
+                    stats.defragmentations, 100 * stats.valid / stats.capacity,
+                    100 * stats.used / stats.capacity,
+                );
+                drop(fs);
+                drop(flash);
+            }
+        }
+
+        #[ignore]
+        it "simulates flash wear until the filesystem fails" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let data: Vec<u8> = (0..4096).map(|x| (x * 7) as u8).collect();
+            let trace = workload();
+            // 16k applet and defrag sectors, then 8k sectors for the other files
+            let geometry: Vec<(usize, usize)> = [(0, 0x4000), (0x4000, 0x4000)].iter().cloned()
+                .chain((0..4).map(|i| (0x8000 + i * 0x2000, 0x2000)))
+                .collect();
+            for &format in &[
+                Format::default(),
+                Format { checksum: Checksum::Crc32, ..Format::default() },
+                Format { lazy_payload: true, ..Format::default() },
+                Format { aligned: true, ..Format::default() },
+            ] {
+                flash_ll::map_image(&path, &geometry).unwrap();
+                let flash = unsafe { Flash::new(&flash_ll::sectors()) }.unwrap();
+                let ids: Vec<flash::SectorID> = (0..geometry.len()).map(flash::SectorID).collect();
+                for &id in ids.iter() {
+                    flash.sector(id).erase(&flash).unwrap();
+                }
+                // Rated endurance of the STM32F401 flash
+                flash_ll::set_wear_model(Some(flash_ll::WearModel { endurance: 10_000, spread: 20_000, seed: 42 }));
+                let roles = Geometry { program: &[], sectors: &ids, defrag: SectorID(1), applet: SectorID(0), index: None };
+                let fs_sectors = roles.fs_sectors(&flash);
+                let mut fs = FileSystem::with_format(&flash, &fs_sectors, roles.defrag, roles.applet, format).unwrap();
+
+                let mut ops = 0;
+                let failure = 'replay: loop {
+                    for line in trace.iter() {
+                        if let Err(e) = replay(&mut fs, line, &data, ops) {
+                            break 'replay e;
+                        }
+                        ops += 1;
+                    }
+                };
+                let most_worn = (0..ids.len()).map(flash_ll::erase_count).max().unwrap();
+                println!(
+                    "{:?}: first failure ({:?}) after {} operations ({} replays of the trace), most worn sector erased {} times",
+                    format, failure, ops, ops / trace.len(), most_worn,
+                );
+                flash_ll::set_wear_model(None);
+                drop(fs);
+                drop(flash);
+            }
+        }
     }
 
     describe "fs" {
@@ -152,8 +365,13 @@ speculate! {
             assert_eq!(fs.valid_size(SectorID(1)), 18);
             fs.defragment(SectorID(1)).unwrap();
             assert_eq!(fs.next_block(SectorID(0)), 0);
-            assert_eq!(fs.next_block(SectorID(1)), 18);
-            assert_eq!(fs.valid_size(SectorID(1)), 18);
+            // The blocks are followed by the summary of their 3 clusters
+            let summary = fs.summary(SectorID(1)).unwrap();
+            assert_eq!(summary.covered, 18);
+            assert_eq!(summary.clusters.len(), 3);
+            let size = 18 + fs.block_len(3, summary.to_bytes().len());
+            assert_eq!(fs.next_block(SectorID(1)), size);
+            assert_eq!(fs.valid_size(SectorID(1)), size);
         }
 
         it "writes to a sector" {
@@ -201,6 +419,40 @@ speculate! {
             assert!(!fs.has_tag(b"test"));
         }
 
+        it "appends after the erased run of a broken block" {
+            fs.write(b"first", b"value").unwrap();
+            let broken = fs.next_block(SectorID(1));
+            fs.write(b"second", b"value").unwrap();
+            let end = fs.next_block(SectorID(1));
+            drop(fs);
+            // Corrupt the data of the second block, behind its checksum
+            fs_sectors[1].with_writer(&flash, broken + 2 + 6, 1, |mut b| b.write(0, 0)).unwrap().unwrap();
+            fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            assert_eq!(fs.next_block(SectorID(1)), end);
+            assert_eq!(&*fs.read(b"first").unwrap(), b"value");
+            assert_eq!(fs.read(b"second").unwrap_err(), Error::NoSuchTag);
+            fs.write(b"third", b"value").unwrap();
+            drop(fs);
+            fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            assert_eq!(&*fs.read(b"third").unwrap(), b"value");
+        }
+
+        it "does not count the duplicates of a block as valid" {
+            fs.write(b"test", b"value").unwrap();
+            let len = fs.block_len(4, 5);
+            drop(fs);
+            // Two valid blocks for a tag, as left by an interrupted write
+            let block = unsafe { fs_sectors[1].raw() }[..len].to_vec();
+            fs_sectors[1].with_writer(&flash, len, len, |mut b| b.write_block(0, &block)).unwrap().unwrap();
+            for _ in 0..2 {
+                fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+                assert_eq!(&*fs.read(b"test").unwrap(), b"value");
+                assert_eq!(fs.valid_size(SectorID(1)), len);
+                assert_eq!(fs.next_block(SectorID(1)), 2 * len);
+                drop(fs);
+            }
+        }
+
         #[ignore]
         it "allows spamming reads and writes" {
             ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
@@ -241,6 +493,575 @@ speculate! {
             }
         }
 
+        it "refuses to defragment when asked not to" {
+            let value = [0x42; 1000];
+            let mut i = 0;
+            loop {
+                match fs.write_nodefrag(b"test", &value) {
+                    Ok(()) => i += 1,
+                    Err(e) => {
+                        assert_eq!(e, Error::WouldBlock);
+                        break;
+                    }
+                }
+                assert!(i < 10_000);
+            }
+            assert!(i > 1);
+            assert_eq!(fs.stats().defragmentations, 0);
+            assert_eq!(&*fs.read(b"test").unwrap(), &value[..]);
+            fs.write(b"test", &[0x43; 1000]).unwrap();
+            assert!(fs.stats().defragmentations > 0);
+            fs.write_nodefrag(b"other", b"value").unwrap();
+            assert_eq!(&*fs.read(b"test").unwrap(), &[0x43; 1000][..]);
+        }
+
+        it "reserves space that can be written without defragmenting" {
+            let value = [0x42; 1000];
+            while fs.write_nodefrag(b"test", &value).is_ok() {}
+            let reservation = fs.reserve(4 * 1100).unwrap();
+            assert!(fs.stats().defragmentations > 0);
+            assert_eq!(fs.stats().reserved, 4 * 1100);
+            let defragmentations = fs.stats().defragmentations;
+            let mut writes = 0;
+            while fs.write_nodefrag(b"test", &value).is_ok() {
+                writes += 1;
+                assert!(writes < 10_000);
+            }
+            assert!(writes >= 4);
+            assert!(fs.stats().reserved < 1100);
+            assert_eq!(fs.stats().defragmentations, defragmentations);
+            fs.release(reservation);
+            fs.release(reservation);
+            assert_eq!(fs.stats().reserved, 0);
+            fs.write(b"test", &value).unwrap();
+        }
+
+        it "finds files through an on-flash index across remounts" {
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format::default();
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            for i in 0..300 {
+                fs.write(format!("file-{}", i).as_bytes(), format!("value-{}", i).as_bytes()).unwrap();
+            }
+            fs.erase(b"file-7").unwrap();
+            fs.edit_at(b"file-8", 0, b"V").unwrap();
+            for _ in 0..3 {
+                drop(fs);
+                fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+                assert_eq!(fs.read(b"file-7").unwrap_err(), Error::NoSuchTag);
+                assert!(!fs.has_tag(b"file-7"));
+                assert_eq!(&*fs.read(b"file-8").unwrap(), b"Value-8");
+                for i in 9..300 {
+                    assert_eq!(&*fs.read(format!("file-{}", i).as_bytes()).unwrap(), format!("value-{}", i).as_bytes());
+                }
+            }
+        }
+
+        it "rebuilds a full on-flash index" {
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format::default();
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            for j in 0..100 {
+                for i in 0..50 {
+                    fs.write(format!("counter-{}", i).as_bytes(), format!("{}-{:0100}", i, j).as_bytes()).unwrap();
+                }
+            }
+            assert!(fs.stats().defragmentations > 0);
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            for i in 0..50 {
+                assert_eq!(&*fs.read(format!("counter-{}", i).as_bytes()).unwrap(), format!("{}-{:0100}", i, 99).as_bytes());
+            }
+        }
+
+        it "neither keeps rebuilding nor wipes a crowded on-flash index" {
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format::default();
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            // The 16kB index sector holds 2047 records, more than three quarters of them live here
+            for i in 0..1700 {
+                fs.write(format!("file-{}", i).as_bytes(), b"v").unwrap();
+            }
+            flash_ll::set_wear_model(None);
+            for i in 0..500 {
+                fs.write(format!("file-{}", i).as_bytes(), b"w").unwrap();
+            }
+            assert!(flash_ll::erase_count(0) <= 2);
+            // Once the valid blocks no longer fit, new files are refused and the index left as it is
+            let mut i = 1700;
+            while fs.write(format!("file-{}", i).as_bytes(), b"v").is_ok() {
+                i += 1;
+            }
+            let erases = flash_ll::erase_count(0);
+            let last = format!("file-{}", i);
+            assert_eq!(fs.write(last.as_bytes(), b"v").unwrap_err(), Error::OutOfFlash);
+            assert_eq!(flash_ll::erase_count(0), erases);
+            fs.write(b"file-0", b"x").unwrap();
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            assert_eq!(&*fs.read(b"file-0").unwrap(), b"x");
+            assert_eq!(&*fs.read(b"file-499").unwrap(), b"w");
+            assert_eq!(&*fs.read(format!("file-{}", i - 1).as_bytes()).unwrap(), b"v");
+            assert_eq!(fs.read(last.as_bytes()).unwrap_err(), Error::NoSuchTag);
+        }
+
+        it "repairs an on-flash index at mount" {
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format::default();
+            for i in 0..100 {
+                fs.write(format!("file-{}", i).as_bytes(), b"ram").unwrap();
+            }
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            assert_eq!(&*fs.read(b"file-42").unwrap(), b"ram");
+            fs.write(b"file-5", b"index").unwrap();
+            drop(fs);
+            // Updates made without the index leave it stale
+            fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            assert_eq!(&*fs.read(b"file-5").unwrap(), b"index");
+            fs.write(b"file-6", b"no index").unwrap();
+            fs.erase(b"file-7").unwrap();
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            assert_eq!(&*fs.read(b"file-5").unwrap(), b"index");
+            assert_eq!(&*fs.read(b"file-6").unwrap(), b"no index");
+            assert_eq!(fs.read(b"file-7").unwrap_err(), Error::NoSuchTag);
+            assert_eq!(&*fs.read(b"file-99").unwrap(), b"ram");
+        }
+
+        it "frees whole sectors by compacting them into others" {
+            let value = [0x42; 500];
+            for i in 0..120 {
+                fs.write(format!("file-{}", i).as_bytes(), &value).unwrap();
+            }
+            for i in 0..120 {
+                if i % 10 != 0 {
+                    fs.erase(format!("file-{}", i).as_bytes()).unwrap();
+                }
+            }
+            let before = fs.stats();
+            let freed = fs.compact().unwrap();
+            let after = fs.stats();
+            assert!(freed >= 2);
+            assert_eq!(after.valid, before.valid);
+            assert!(after.used < before.used);
+            assert_eq!(after.defragmentations, before.defragmentations);
+            for _ in 0..2 {
+                for i in 0..120 {
+                    let res = fs.read(format!("file-{}", i).as_bytes());
+                    if i % 10 == 0 {
+                        assert_eq!(&*res.unwrap(), &value[..]);
+                    } else {
+                        assert_eq!(res.unwrap_err(), Error::NoSuchTag);
+                    }
+                }
+                drop(fs);
+                fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            }
+            assert_eq!(fs.compact().unwrap(), 0);
+        }
+
+        it "keeps the edits of a file defragmenting a sector of its own" {
+            fs.write(b"test", &[0; 1000]).unwrap();
+            let mut i = 0;
+            while fs.stats().defragmentations == 0 {
+                i += 1;
+                fs.edit_at(b"test", 0, &[i as u8]).unwrap();
+            }
+            drop(fs);
+            fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            assert_eq!(fs.read(b"test").unwrap()[0], i as u8);
+        }
+
+        it "clusters the fields of objects after defragmenting" {
+            // Fields of 8 objects, written interleaved, then all updated once
+            for round in 0..2 {
+                for field in 0..20 {
+                    for object in 0..8 {
+                        fs.write(&[3, object, 0, 0, field], &[round; 30]).unwrap();
+                    }
+                }
+            }
+            fs.defragment(SectorID(1)).unwrap();
+            let summary = fs.summary(SectorID(1)).unwrap();
+            assert_eq!(summary.clusters.len(), 8);
+            assert_eq!(&summary.first[..], &[3, 0, 0, 0, 0]);
+            assert_eq!(&summary.last[..], &[3, 7, 0, 0, 19]);
+            fs.write(&[3, 2, 0, 0, 5], &[2; 30]).unwrap();
+            for _ in 0..2 {
+                for object in 0..8 {
+                    let mut fields = Vec::new();
+                    let mut addresses = Vec::new();
+                    fs.scan_prefix(&[3, object], |tag, data| {
+                        fields.push(tag[4]);
+                        addresses.push(data.as_ptr() as usize);
+                        let expected = if tag == &[3, 2, 0, 0, 5] { 2 } else { 1 };
+                        assert_eq!(data, &[expected; 30][..]);
+                    }).unwrap();
+                    fields.sort();
+                    assert_eq!(fields, (0..20).collect::<Vec<u8>>());
+                    // All the fields but the updated one are next to each other
+                    addresses.sort();
+                    let span = addresses[18] - addresses[0];
+                    assert!(span < 19 * fs.block_len(5, 30) + 1);
+                }
+                let mut internal = 0;
+                fs.scan_prefix(&[], |_, _| internal += 1).unwrap();
+                assert_eq!(internal, 160);
+                drop(fs);
+                fs = FileSystem::new(&flash, &fs_sectors, defragsector, appletsector).unwrap();
+            }
+        }
+
+        it "drops a payload whose reference cannot be written" {
+            let format = Format { dedup: true, ..Format::default() };
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            fs.write(b"fives", &[5; 100]).unwrap();
+            assert_eq!(fs.write(b"", &[5; 100]).unwrap_err(), Error::InvalidLengthForTag);
+            assert_eq!(fs.write(b"", &[6; 100]).unwrap_err(), Error::InvalidLengthForTag);
+            assert!(fs.has_tag(&payload_tag(index::hash(&[5; 100]))));
+            assert!(!fs.has_tag(&payload_tag(index::hash(&[6; 100]))));
+            assert_eq!(&*fs.read(b"fives").unwrap(), &[5; 100][..]);
+        }
+
+        it "shares identical payloads when deduplicating" {
+            let format = Format { dedup: true, ..Format::default() };
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            let zeros = payload_tag(index::hash(&[0; 100]));
+            let payloads = |fs: &FileSystem| {
+                let mut n = 0;
+                fs.scan_prefix(&[INTERNAL_TAG, PAYLOAD_TAG], |_, _| n += 1).unwrap();
+                n
+            };
+            for i in 0..10 {
+                fs.write(&[3, i], &[0; 100]).unwrap();
+            }
+            fs.write(b"ones", &[1; 100]).unwrap();
+            fs.write(b"short", &[0; 10]).unwrap();
+            assert_eq!(payloads(&fs), 2);
+            assert!(fs.stats().valid < 3 * fs.block_len(6, 100) + 10 * fs.block_len(4, 4));
+            fs.edit_at(&[3, 0], 50, &[2]).unwrap();
+            fs.defragment(SectorID(1)).unwrap();
+            for _ in 0..2 {
+                assert_eq!(payloads(&fs), 2);
+                assert_eq!(fs.read(&[3, 0]).unwrap()[49..52], [0, 2, 0]);
+                for i in 1..10 {
+                    assert_eq!(&*fs.read(&[3, i]).unwrap(), &[0; 100][..]);
+                }
+                assert_eq!(&*fs.read(b"ones").unwrap(), &[1; 100][..]);
+                assert_eq!(&*fs.read(b"short").unwrap(), &[0; 10][..]);
+                drop(fs);
+                fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            }
+            // The payload goes with the last file referencing it
+            for i in 1..9 {
+                fs.erase(&[3, i]).unwrap();
+            }
+            assert!(fs.has_tag(&zeros));
+            fs.write(&[3, 9], &[3; 100]).unwrap();
+            assert!(!fs.has_tag(&zeros));
+            // Payloads left unreferenced by an interruption are dropped at mount
+            fs.share(&[4; 100], true).unwrap();
+            assert_eq!(payloads(&fs), 3);
+            drop(fs);
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            assert_eq!(payloads(&fs), 2);
+        }
+
+        it "reads shared payloads through an on-flash index" {
+            let index = flash.sector(flash::SectorID(0));
+            let format = Format { dedup: true, ..Format::default() };
+            drop(fs);
+            fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            fs.write(b"shared-0", &[5; 100]).unwrap();
+            fs.write(b"shared-1", &[5; 100]).unwrap();
+            // Evict the payload from the cache, in front of the files referencing it
+            for i in 0..64 {
+                fs.write(format!("file-{}", i).as_bytes(), b"value").unwrap();
+            }
+            for _ in 0..2 {
+                let h = fs.open(b"shared-1").unwrap();
+                assert_eq!(&*fs.read(b"shared-0").unwrap(), &[5; 100][..]);
+                assert_eq!(fs.length(b"shared-1").unwrap(), 100);
+                let mut buf = [0; 4];
+                assert_eq!(fs.read_at(b"shared-0", 98, &mut buf).unwrap(), 2);
+                assert_eq!(fs.read_handle_at(h, 0, &mut buf).unwrap(), 4);
+                assert_eq!(buf, [5; 4]);
+                fs.close(h);
+                drop(fs);
+                fs = FileSystem::with_index(&flash, &fs_sectors, defragsector, appletsector, format, index).unwrap();
+            }
+        }
+
+        it "creates zeroed files without writing their zeros" {
+            let aligned = Format { checksum: Checksum::Crc32, lazy_payload: true, aligned: true, ..Format::default() };
+            for &format in [Format::default(), aligned].iter() {
+                drop(fs);
+                for sector in fs_sectors.iter() {
+                    sector.erase(&flash).unwrap();
+                }
+                fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                fs.create_zeroed(b"array", 1000).unwrap();
+                fs.create_zeroed(b"other", 300).unwrap();
+                assert!(fs.stats().used < 64);
+                assert_eq!(fs.read(b"array").unwrap_err(), Error::Zeroed);
+                let mut buf = [1; 16];
+                assert_eq!(fs.read_at(b"array", 990, &mut buf).unwrap(), 10);
+                assert_eq!(buf[..11], [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1]);
+                fs.defragment(SectorID(1)).unwrap();
+                drop(fs);
+                fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                assert_eq!(fs.length(b"array").unwrap(), 1000);
+                fs.edit_at(b"array", 500, &[1, 2]).unwrap();
+                let mut expected = vec![0; 1000];
+                expected[500] = 1;
+                expected[501] = 2;
+                assert_eq!(&*fs.read(b"array").unwrap(), &expected[..]);
+                assert_eq!(fs.length(b"other").unwrap(), 300);
+                fs.materialize(b"other").unwrap();
+                assert_eq!(&*fs.read(b"other").unwrap(), &[0; 300][..]);
+                assert_eq!(fs.create_zeroed(b"huge", 1 << 30).unwrap_err(), Error::OutOfFlash);
+            }
+        }
+
+        it "edits nothing past the end of a file" {
+            fs.write(b"test", b"value").unwrap();
+            fs.create_zeroed(b"array", 10).unwrap();
+            for &(tag, len) in &[(&b"test"[..], 5), (&b"array"[..], 10)] {
+                assert_eq!(fs.edit_at(tag, len, &[1]).unwrap_err(), Error::OutOfBounds);
+                assert_eq!(fs.edit_at(tag, len - 1, &[1, 2]).unwrap_err(), Error::OutOfBounds);
+                assert_eq!(fs.edit_at(tag, 1 << 30, &[1]).unwrap_err(), Error::OutOfBounds);
+                assert_eq!(fs.edit_at(tag, 1, &[1; 1 << 10]).unwrap_err(), Error::OutOfBounds);
+                assert_eq!(fs.length(tag).unwrap(), len);
+                fs.edit_at(tag, len - 1, &[1]).unwrap();
+                fs.edit_at(tag, len, &[]).unwrap();
+                assert_eq!(fs.length(tag).unwrap(), len);
+                assert_eq!(fs.read(tag).unwrap()[len - 1], 1);
+            }
+            assert_eq!(&*fs.read(b"array").unwrap(), &[0, 0, 0, 0, 0, 0, 0, 0, 0, 1][..]);
+        }
+
+        it "reads nothing past the end of a file" {
+            fs.write(b"test", b"value").unwrap();
+            fs.create_zeroed(b"array", 5).unwrap();
+            let mut buf = [1; 4];
+            for &tag in &[&b"test"[..], &b"array"[..]] {
+                assert_eq!(fs.read_at(tag, 3, &mut buf).unwrap(), 2);
+                assert_eq!(fs.read_at(tag, 5, &mut buf).unwrap(), 0);
+                assert_eq!(fs.read_at(tag, 100, &mut buf).unwrap(), 0);
+                // Once through the lookup of an opened file, then through its cached location
+                let h = fs.open(tag).unwrap();
+                for _ in 0..2 {
+                    assert_eq!(fs.read_handle_at(h, 5, &mut buf).unwrap(), 0);
+                    assert_eq!(fs.read_handle_at(h, 100, &mut buf).unwrap(), 0);
+                    assert_eq!(fs.read_handle_at(h, 3, &mut buf).unwrap(), 2);
+                }
+                fs.close(h);
+            }
+        }
+
+        it "reads and edits opened files across moves and erases" {
+            assert_eq!(fs.open(b"test").unwrap_err(), Error::NoSuchTag);
+            fs.write(b"test", b"value").unwrap();
+            fs.create_zeroed(b"array", 10).unwrap();
+            let h = fs.open(b"test").unwrap();
+            let a = fs.open(b"array").unwrap();
+            let mut buf = [0; 4];
+            assert_eq!(fs.read_handle_at(h, 1, &mut buf).unwrap(), 4);
+            assert_eq!(&buf, b"alue");
+            assert_eq!(fs.read_handle_at(a, 8, &mut buf).unwrap(), 2);
+            fs.edit_handle_at(a, 8, &[1, 2]).unwrap();
+            assert_eq!(fs.read_handle_at(a, 8, &mut buf).unwrap(), 2);
+            assert_eq!(buf[..2], [1, 2]);
+            // The data moves along with the sector defragmented
+            fs.edit_handle_at(h, 0, b"V").unwrap();
+            fs.defragment(SectorID(1)).unwrap();
+            assert_eq!(fs.read_handle_at(h, 0, &mut buf).unwrap(), 4);
+            assert_eq!(&buf, b"Valu");
+            // Handles outlive their file, but not their closing
+            fs.erase(b"test").unwrap();
+            assert_eq!(fs.read_handle_at(h, 0, &mut buf).unwrap_err(), Error::NoSuchTag);
+            fs.write(b"test", b"again").unwrap();
+            assert_eq!(fs.read_handle_at(h, 0, &mut buf).unwrap(), 4);
+            assert_eq!(&buf, b"agai");
+            fs.close(h);
+            assert_eq!(fs.read_handle_at(h, 0, &mut buf).unwrap_err(), Error::NoSuchTag);
+            assert_eq!(fs.edit_handle_at(h, 0, b"x").unwrap_err(), Error::NoSuchTag);
+            for _ in 1..HANDLES_MAX {
+                fs.open(b"test").unwrap();
+            }
+            assert_eq!(fs.open(b"test").unwrap_err(), Error::TooManyHandles);
+        }
+
+        it "handles a simple read write reinitialize loop with CRC-32 blocks" {
+            let format = Format { checksum: Checksum::Crc32, ..Format::default() };
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            fs.write(b"test", b"value").unwrap();
+            assert_eq!(fs.block_len(4, 5), 15);
+            assert_eq!(fs.next_block(SectorID(1)), 15);
+            drop(fs);
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            assert_eq!(&*fs.read(b"test").unwrap(), b"value");
+            assert_eq!(fs.next_block(SectorID(1)), 15);
+        }
+
+        it "handles a simple read write reinitialize loop with aligned blocks" {
+            let values: &[&[u8]] = &[b"", b"a", b"abc", b"value", &[42; 300]];
+            for &checksum in &[Checksum::Crc8, Checksum::Crc32] {
+                for &lazy_payload in &[false, true] {
+                    let format = Format { checksum: checksum, lazy_payload: lazy_payload, aligned: true, ..Format::default() };
+                    drop(fs);
+                    for sector in fs_sectors.iter() {
+                        sector.erase(&flash).unwrap();
+                    }
+                    fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                    for (i, value) in values.iter().enumerate() {
+                        fs.write(&[b't', i as u8], value).unwrap();
+                        assert_eq!(fs.next_block(SectorID(1)) % 4, 0);
+                    }
+                    fs.edit_at(&[b't', 4], 1, b"xyz").unwrap();
+                    drop(fs);
+                    fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                    for (i, value) in values.iter().enumerate().take(4) {
+                        assert_eq!(&*fs.read(&[b't', i as u8]).unwrap(), *value);
+                    }
+                    assert_eq!(&fs.read(&[b't', 4]).unwrap()[..5], b"*xyz*");
+                    fs.defragment(SectorID(1)).unwrap();
+                    assert_eq!(&*fs.read(&[b't', 3]).unwrap(), b"value");
+                }
+            }
+            // Header and length share the first word, tag pads to the second one
+            let format = Format { aligned: true, ..Format::default() };
+            drop(fs);
+            for sector in fs_sectors.iter() {
+                sector.erase(&flash).unwrap();
+            }
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            assert_eq!(fs.block_len(4, 5), 16);
+            assert_eq!(fs.block_len(5, 5), 20);
+        }
+
+        it "checks payloads lazily" {
+            let format = Format { lazy_payload: true, ..Format::default() };
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            fs.write(b"test", b"value").unwrap();
+            fs.write(b"good", b"value").unwrap();
+            assert_eq!(fs.block_len(4, 5), 13);
+            drop(fs);
+            // Corrupt the first byte of the data of "test"
+            fs_sectors[1].with_writer(&flash, 7, 1, |mut b| b.write(0, 0)).unwrap().unwrap();
+            fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+            assert_eq!(fs.next_block(SectorID(1)), 26);
+            assert!(fs.has_tag(b"test"));
+            assert_eq!(fs.read(b"test").unwrap_err(), Error::Corrupted);
+            assert_eq!(fs.edit_at(b"test", 0, b"V").unwrap_err(), Error::Corrupted);
+            assert_eq!(&*fs.read(b"good").unwrap(), b"value");
+            fs.defragment(SectorID(1)).unwrap();
+            assert!(!fs.has_tag(b"test"));
+            assert_eq!(&*fs.read(b"good").unwrap(), b"value");
+        }
+
+        #[ignore]
+        it "benchmarks erased-run scanning" {
+            // Leave a zeroed run over most of the sector, as after an interrupted write was erased
+            let sector = fs_sectors[4];
+            let len = sector.len();
+            sector.with_writer(&flash, 0, len - 0x100, |mut b| b.zero_block(0, len - 0x100)).unwrap().unwrap();
+            sector.with_writer(&flash, len - 0x100, 1, |mut b| b.write(0, 0x42)).unwrap().unwrap();
+            let zone = unsafe { sector.raw() };
+            let start = ::std::time::Instant::now();
+            for _ in 0..100 {
+                assert_eq!(parse_hdr(zone, Format::default()), Err(ParseNoBlock::Erased(len - 0x100)));
+                assert_eq!(scan_ll::find_last_not(zone, 0xFF), len - 0xFF);
+            }
+            let kernel = start.elapsed() / 100;
+            let start = ::std::time::Instant::now();
+            for _ in 0..100 {
+                let first = zone.iter().position(|&b| b != 0x00).unwrap_or(len);
+                let mut last = len;
+                while last > 0 && zone[last - 1] == 0xFF {
+                    last -= 1;
+                }
+                assert_eq!((first, last), (len - 0x100, len - 0xFF));
+            }
+            let bytewise = start.elapsed() / 100;
+            println!("Scanning {} bytes: {:?} (byte by byte: {:?})", len, kernel, bytewise);
+        }
+
+        #[ignore]
+        it "benchmarks mount time" {
+            ::debug::DISABLE_DEBUG.store(true, ::std::sync::atomic::Ordering::SeqCst);
+            let data: Vec<u8> = (0..1000).map(|x| x as u8).collect();
+            for &(checksum, lazy_payload) in &[
+                (Checksum::Crc8, false),
+                (Checksum::Crc32, false),
+                (Checksum::Crc8, true),
+                (Checksum::Crc32, true),
+            ] {
+                let format = Format { checksum: checksum, lazy_payload: lazy_payload, ..Format::default() };
+                drop(fs);
+                for sector in fs_sectors.iter() {
+                    sector.erase(&flash).unwrap();
+                }
+                fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                for i in 0..64 {
+                    fs.write(format!("cap-{}", i).as_bytes(), &data).unwrap();
+                }
+                let start = ::std::time::Instant::now();
+                for _ in 0..100 {
+                    drop(fs);
+                    fs = FileSystem::with_format(&flash, &fs_sectors, defragsector, appletsector, format).unwrap();
+                }
+                println!("Mounting 64 files of 1000 bytes with {:?}: {:?}", format, start.elapsed() / 100);
+                assert_eq!(&*fs.read(b"cap-42").unwrap(), &data[..]);
+            }
+        }
+
+        it "scans a sector without locking it" {
+            fs.write_impl(b"a", &[b"ta"], SectorID(1)).unwrap();
+            fs.write_impl(b"b", &[b"tb"], SectorID(1)).unwrap();
+            fs.write_impl(b"a", &[b"tc"], SectorID(1)).unwrap();
+            let sector = fs_sectors[1];
+            let mut cursor = ScanCursor::new(sector, sector.len(), Format::default());
+            let expected: &[(bool, &[u8], &[u8])] = &[(false, b"a", b"ta"), (true, b"b", b"tb"), (true, b"a", b"tc")];
+            for &(valid, tag, data) in expected {
+                let b = cursor.next().unwrap();
+                assert_eq!(b.valid, valid);
+                assert_eq!(cursor.tag(&b), tag);
+                assert_eq!(cursor.data(&b), data);
+            }
+            assert_eq!(cursor.pos(), 18);
+            assert_eq!(cursor.next(), Err(ParseNoBlock::Empty));
+            assert_eq!(cursor.pos(), 18);
+            // Only the index entries hold locks, so the free space is still writable
+            sector.with_writer(&flash, 18, sector.len() - 18, |_| ()).unwrap();
+        }
+
+        it "parses sectors ahead as a sequential scan would" {
+            fs.write_impl(b"a", &[b"ta"], SectorID(1)).unwrap();
+            fs.write_impl(b"b", &[b"tb"], SectorID(1)).unwrap();
+            fs.write_impl(b"a", &[b"tc"], SectorID(2)).unwrap();
+            // A broken block, and an erased one
+            fs_sectors[2].with_writer(&flash, 6, 1, |mut b| b.write(0, 0x42)).unwrap().unwrap();
+            fs_sectors[3].with_writer(&flash, 0, 4, |mut b| b.zero_block(0, 4)).unwrap().unwrap();
+            let zones: Vec<(&flash::Sector, usize)> = fs_sectors.iter().map(|&x| (x, x.len())).collect();
+            for (&(sector, end), mut ahead) in zones.iter().zip(ScanCursor::all(&zones, Format::default())) {
+                let mut cursor = ScanCursor::new(sector, end, Format::default());
+                while !cursor.done() {
+                    let res = cursor.next();
+                    assert_eq!(ahead.next(), res);
+                    assert_eq!(ahead.pos(), cursor.pos());
+                    match res {
+                        Err(ParseNoBlock::Empty) | Err(ParseNoBlock::Broken) => break,
+                        _ => (),
+                    }
+                }
+            }
+        }
+
         describe "parse_hdr" {
             before {
                 type Res<'a> = Result<(bool, &'a [u8], &'a [u8], usize), ParseNoBlock>;
@@ -251,17 +1072,15 @@ speculate! {
                 if auto_crc8 {
                     header[header_len - 1] = crc8(header[0] & !VALIDITY_MASK, &header[1..header.len()-1]);
                 }
-                let sector = flash.sector(flash::SectorID(0));
-                sector.with_writer(&flash, 0, header_len, |mut b| b.write_block(0, header).unwrap()).unwrap();
-                let res = parse_hdr(sector.read(0, header_len).unwrap());
+                let res = parse_hdr(&header[..], Format::default());
                 match result {
                     Err(e) => assert_eq!(e, res.unwrap_err()),
                     Ok((a, b, c, d)) => {
-                        let (ra, rb, rc, rd) = res.unwrap();
-                        assert_eq!(a, ra);
-                        assert_eq!(b, &*rb);
-                        assert_eq!(c, &*rc);
-                        assert_eq!(d, rd);
+                        let r = res.unwrap();
+                        assert_eq!(a, r.valid);
+                        assert_eq!(b, &header[r.tag..r.tag + r.taglen]);
+                        assert_eq!(c, &header[r.data..r.data + r.datalen]);
+                        assert_eq!(d, r.size);
                     },
                 }
             }
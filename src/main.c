@@ -268,12 +268,24 @@ extern "C" {
 #endif
 uint8_t mpu_shared_ro_size, mpu_shared_ro_start;
 uint8_t mpu_shared_rw_size, mpu_shared_rw_start;
+extern uint8_t isr_vector_size;
+extern uint32_t g_pfnVectors[];
 #ifdef __cplusplus
 }
 #endif
 
 void setup_reent() {}
 
+/* RAM copy of the ISR vector, so that interrupts can be taken while the flash
+ * is busy (the handlers that must run then live in .ramfunc) */
+static uint32_t ram_vectors[128] __attribute__((aligned(512)));
+
+void relocate_vectors() {
+  memcpy(ram_vectors, g_pfnVectors, (size_t)&isr_vector_size);
+  SCB->VTOR = (uint32_t)ram_vectors;
+  __DSB();
+}
+
 int main(void) {
 
   //  FIRST, ZERO-OUT SHARED_RO AND SHARED_RW (as it's not in .data)
@@ -285,6 +297,8 @@ int main(void) {
     (&mpu_shared_rw_start)[i] = 0;
   }
 
+  relocate_vectors();
+
   // Set the first mpu_shared_rw_start as location of _impure_ptr
   struct _reent *init_reent = (((struct _reent *)&mpu_shared_rw_start));
 
@@ -127,14 +127,26 @@ void PendSV_Handler(void)
 
 /**
   * @brief  This function handles SysTick Handler.
+  * @note   Runs from RAM (as does HAL_IncTick), so that ticks keep being
+  *         counted while the flash is busy programming or erasing.
   * @param  None
   * @retval None
   */
-void SysTick_Handler(void)
+__attribute__((section(".ramfunc"))) void SysTick_Handler(void)
 {
   HAL_IncTick();
 }
 
+/**
+  * @brief  Overrides the HAL weak definition, so that it lives in RAM.
+  * @param  None
+  * @retval None
+  */
+__attribute__((section(".ramfunc"))) void HAL_IncTick(void)
+{
+  uwTick += uwTickFreq;
+}
+
 /******************************************************************************/
 /*                 STM32F4xx Peripherals Interrupt Handlers                   */
 /*  Add here the Interrupt Handler for the used peripheral(s) (PPP), for the  */
@@ -25,20 +25,22 @@
 use alloc::boxed::Box;
 use alloc::vec::Vec;
 use context::CURRENT_CONTEXT;
-use core::cmp::min;
 use core::ptr::{null, null_mut};
 use core::{mem, ptr, slice};
-use flash::{Flash, Sector};
+use flash::{Flash, Sector, SectorInfo};
 use fs::FileSystem;
 use syscall::{syscall, Syscall};
-use {
-    context, filename, flash, flash_sectors, fs, registers, FLASH_APPLET_SECTOR,
-    FLASH_DEFRAG_SECTOR, FLASH_FS_SECTORS, FLASH_PROGRAM_SECTORS,
-};
+use {context, filename, flash, flash_sectors, fs, registers, FLASH_GEOMETRY};
 
 static mut FLASH: *const Flash = null();
 static mut FS_SECTORS: *mut Vec<&'static Sector> = null_mut();
 static mut FS: *mut FileSystem = null_mut();
+/// Files opened through syscalls, along with the context that opened them and whether it may
+/// write them
+static mut HANDLES: [Option<(fs::Handle, usize, bool)>; fs::HANDLES_MAX] = [None; fs::HANDLES_MAX];
+/// Number of files a single context may keep opened, so that no context can starve the others of
+/// handles
+pub const HANDLES_PER_CONTEXT: usize = 4;
 
 /// An error occurred while initializing the filesystem
 #[derive(Debug)]
@@ -52,29 +54,41 @@ pub enum FsInitError {
 /// Initialize the filesystem. *Must* be called before any other filesystem syscall, and from
 /// privileged code.
 pub unsafe fn privileged_fs_init() -> Result<(), FsInitError> {
+    privileged_fs_init_with(&flash_sectors(), FLASH_GEOMETRY)
+}
+
+/// Same as [`privileged_fs_init`], but with the flash cut along `sectors` and laid out along
+/// `geometry` instead of the platform defaults.
+///
+/// [`privileged_fs_init`]: fn.privileged_fs_init.html
+pub unsafe fn privileged_fs_init_with(
+    sectors: &[SectorInfo],
+    geometry: fs::Geometry,
+) -> Result<(), FsInitError> {
     // Init the flash
-    let f = get!(Flash::new(&flash_sectors()).map_err(FsInitError::FlashInit));
+    let f = get!(Flash::new(sectors).map_err(FsInitError::FlashInit));
     // Lock program sectors
-    for &s in FLASH_PROGRAM_SECTORS {
+    for &s in geometry.program {
         let sector = f.sector(s);
         mem::forget(sector.read(0, sector.len()));
     }
     FLASH = Box::into_raw(Box::new(f));
 
     // Init the filesystem
-    FS_SECTORS = Box::into_raw(Box::new(
-        FLASH_FS_SECTORS
-            .iter()
-            .map(|&x| (*FLASH).sector(x))
-            .collect(),
-    ));
-    FS = Box::into_raw(Box::new(get!(FileSystem::new(
-        &*FLASH,
-        &*FS_SECTORS,
-        FLASH_DEFRAG_SECTOR,
-        FLASH_APPLET_SECTOR
-    )
-    .map_err(FsInitError::FsInit))));
+    FS_SECTORS = Box::into_raw(Box::new(geometry.fs_sectors(&*FLASH)));
+    let fs = match geometry.index {
+        Some(index) => FileSystem::with_index(
+            &*FLASH,
+            &*FS_SECTORS,
+            geometry.defrag,
+            geometry.applet,
+            fs::Format::default(),
+            (*FLASH).sector(index),
+        ),
+        None => FileSystem::new(&*FLASH, &*FS_SECTORS, geometry.defrag, geometry.applet),
+    };
+    FS = Box::into_raw(Box::new(get!(fs.map_err(FsInitError::FsInit))));
+    HANDLES = [None; fs::HANDLES_MAX];
     Ok(())
 }
 
@@ -125,6 +139,11 @@ fn fs_error_to_usize(e: fs::Error) -> usize {
             fs::Error::OutOfFlash => 1,
             fs::Error::NoSuchTag => 2,
             fs::Error::InvalidLengthForTag => 3,
+            fs::Error::Corrupted => 4,
+            fs::Error::WouldBlock => 5,
+            fs::Error::Zeroed => 6,
+            fs::Error::TooManyHandles => 7,
+            fs::Error::OutOfBounds => 8,
             fs::Error::IO(e) => flash_error_to_usize(e),
         }
 }
@@ -134,6 +153,11 @@ fn usize_to_fs_error(e: usize) -> fs::Error {
         1 => fs::Error::OutOfFlash,
         2 => fs::Error::NoSuchTag,
         3 => fs::Error::InvalidLengthForTag,
+        4 => fs::Error::Corrupted,
+        5 => fs::Error::WouldBlock,
+        6 => fs::Error::Zeroed,
+        7 => fs::Error::TooManyHandles,
+        8 => fs::Error::OutOfBounds,
         x => fs::Error::IO(usize_to_flash_error(x)),
     }
 }
@@ -188,13 +212,28 @@ pub fn syscall_read(tagaddr: usize, bufptr: usize, buflen: usize) -> Option<usiz
 }
 
 fn syscall_read_impl(fs: &mut FileSystem, tag: &[u8], buffer: &mut [u8]) -> Result<(), fs::Error> {
-    let res = fs.read(tag)?;
-    let len = min(buffer.len(), res.len());
-    buffer[0..len].copy_from_slice(&res[0..len]);
+    fs.read_at(tag, 0, buffer)?;
+    Ok(())
+}
+
+/// Fills `buffer` with the bytes of the file `tag` starting at `offset`, zeroed files included
+///
+/// # Panics
+///
+/// Panics if the file ends before `buffer` is full
+fn syscall_read_at_impl(
+    fs: &mut FileSystem,
+    tag: &[u8],
+    offset: usize,
+    buffer: &mut [u8],
+) -> Result<(), fs::Error> {
+    let len = fs.read_at(tag, offset, buffer)?;
+    assert!(len == buffer.len(), "Read past the end of a file");
     Ok(())
 }
 
-/// Returns a pointer to the file tagged `tag`
+/// Returns a pointer to the file tagged `tag`, or `Error::Zeroed` if it has no data on flash yet
+/// (see [`materialize`](fn.materialize.html))
 ///
 /// # Safety
 ///
@@ -225,6 +264,8 @@ pub fn syscall_read_inplace(tagaddr: usize, dataptrret: usize, datalenret: usize
         );
         let tag = retrieve_tag(tagaddr);
         assert!(filename::can_read(CURRENT_CONTEXT.ctxid(), tag));
+        // Reading never writes: writing out a zeroed file could defragment its sector, and move
+        // the blocks already read in place
         let res = match (*FS).read(tag) {
             Ok(b) => b,
             Err(e) => return Some(fs_error_to_usize(e)),
@@ -259,9 +300,10 @@ pub fn syscall_read_1b_at(tagaddr: usize, offset: usize, retaddr: usize) -> Opti
         assert!(context::is_writable_from_current_context(retaddr, 1));
         let tag = retrieve_tag(tagaddr);
         assert!(filename::can_read(CURRENT_CONTEXT.ctxid(), tag));
-        match (*FS).read(tag) {
-            Ok(b) => {
-                *(retaddr as *mut u8) = b[offset];
+        let mut b = [0; 1];
+        match syscall_read_at_impl(&mut *FS, tag, offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u8) = b[0];
                 Some(0)
             }
             Err(e) => Some(fs_error_to_usize(e)),
@@ -324,11 +366,10 @@ pub fn syscall_read_2b_at(tagaddr: usize, offset: usize, retaddr: usize) -> Opti
         assert!(context::is_writable_from_current_context(retaddr, 2));
         let tag = retrieve_tag(tagaddr);
         assert!(filename::can_read(CURRENT_CONTEXT.ctxid(), tag));
-        match (*FS).read(tag) {
-            Ok(b) => {
-                *(retaddr as *mut u16) = ptr::read_unaligned(
-                    (&b[0] as *const u8 as *const u16).wrapping_offset(offset as isize),
-                );
+        let mut b = [0; 2];
+        match syscall_read_at_impl(&mut *FS, tag, 2 * offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u16) = ptr::read_unaligned(&b[0] as *const u8 as *const u16);
                 Some(0)
             }
             Err(e) => Some(fs_error_to_usize(e)),
@@ -393,11 +434,10 @@ pub fn syscall_read_4b_at(tagaddr: usize, offset: usize, retaddr: usize) -> Opti
         assert!(context::is_writable_from_current_context(retaddr, 4));
         let tag = retrieve_tag(tagaddr);
         assert!(filename::can_read(CURRENT_CONTEXT.ctxid(), tag));
-        match (*FS).read(tag) {
-            Ok(b) => {
-                *(retaddr as *mut u32) = ptr::read_unaligned(
-                    (&b[0] as *const u8 as *const u32).wrapping_offset(offset as isize),
-                );
+        let mut b = [0; 4];
+        match syscall_read_at_impl(&mut *FS, tag, 4 * offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u32) = ptr::read_unaligned(&b[0] as *const u8 as *const u32);
                 Some(0)
             }
             Err(e) => Some(fs_error_to_usize(e)),
@@ -436,6 +476,303 @@ pub fn syscall_write_4b_at(tagaddr: usize, offset: usize, data: usize) -> Option
     }
 }
 
+/// Opens the file tagged `tag`, for accessing it without passing its tag again. A context may keep
+/// at most [`HANDLES_PER_CONTEXT`] files opened, which are closed when it returns.
+///
+/// [`HANDLES_PER_CONTEXT`]: constant.HANDLES_PER_CONTEXT.html
+pub fn open(tag: &[u8]) -> Result<fs::Handle, fs::Error> {
+    unsafe {
+        let t = pass_tag(tag);
+        let mut handle = 0;
+        let res = syscall(
+            Syscall::FsOpen,
+            t.as_ptr() as usize,
+            &mut handle as *mut usize as usize,
+            0,
+        );
+        if res == 0 {
+            Ok(fs::Handle(handle))
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_open(tagaddr: usize, retaddr: usize, _: usize) -> Option<usize> {
+    unsafe {
+        assert!(context::is_writable_from_current_context(
+            retaddr,
+            mem::size_of::<usize>()
+        ));
+        let tag = retrieve_tag(tagaddr);
+        let ctx = CURRENT_CONTEXT.ctxid();
+        assert!(filename::can_read(ctx, tag));
+        if HANDLES.iter().filter(|h| opened_by(h, ctx.id())).count() >= HANDLES_PER_CONTEXT {
+            return Some(fs_error_to_usize(fs::Error::TooManyHandles));
+        }
+        match (*FS).open(tag) {
+            Ok(handle) => {
+                // The filesystem hands out at most as many handles as there are slots
+                let slot = HANDLES.iter_mut().find(|h| h.is_none()).unwrap();
+                *slot = Some((handle, ctx.id(), filename::can_write(ctx, tag)));
+                *(retaddr as *mut usize) = handle.0;
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Closes a handle returned by [`open`](fn.open.html)
+pub fn close(handle: fs::Handle) {
+    unsafe {
+        syscall(Syscall::FsClose, handle.0, 0, 0);
+    }
+}
+
+pub fn syscall_close(handle: usize, _: usize, _: usize) -> Option<usize> {
+    unsafe {
+        let ctx = CURRENT_CONTEXT.id();
+        for h in HANDLES.iter_mut() {
+            let opened = match *h {
+                Some((fs::Handle(x), c, _)) => x == handle && c == ctx,
+                None => false,
+            };
+            if opened {
+                *h = None;
+                (*FS).close(fs::Handle(handle));
+            }
+        }
+        Some(0)
+    }
+}
+
+/// Closes all the files the context `ctx` has left opened. Called when it returns from its last
+/// remote call, as it cannot use them anymore.
+pub unsafe fn privileged_release_handles(ctx: usize) {
+    for h in HANDLES.iter_mut() {
+        if opened_by(h, ctx) {
+            (*FS).close(h.take().unwrap().0);
+        }
+    }
+}
+
+/// Whether the slot `h` holds a file opened by the context `ctx`
+fn opened_by(h: &Option<(fs::Handle, usize, bool)>, ctx: usize) -> bool {
+    match *h {
+        Some((_, c, _)) => c == ctx,
+        None => false,
+    }
+}
+
+/// Returns the handle `handle`, checking that it was opened by the current context, with the right
+/// to write if `write` is set
+unsafe fn retrieve_handle(handle: usize, write: bool) -> fs::Handle {
+    let ctx = CURRENT_CONTEXT.id();
+    assert!(
+        HANDLES.iter().any(|h| match *h {
+            Some((fs::Handle(x), c, writable)) => x == handle && c == ctx && (writable || !write),
+            None => false,
+        }),
+        "Received a handle not opened by the current context"
+    );
+    fs::Handle(handle)
+}
+
+fn syscall_read_handle_impl(
+    fs: &FileSystem,
+    handle: fs::Handle,
+    offset: usize,
+    buffer: &mut [u8],
+) -> Result<(), fs::Error> {
+    let len = fs.read_handle_at(handle, offset, buffer)?;
+    assert!(len == buffer.len(), "Read past the end of a file");
+    Ok(())
+}
+
+/// Reads a byte from the file opened as `handle` at offset `offset`
+pub fn read_1b_at_handle(handle: fs::Handle, offset: usize) -> Result<u8, fs::Error> {
+    unsafe {
+        let mut data = 0;
+        let res = syscall(
+            Syscall::FsRead1bHandle,
+            handle.0,
+            offset,
+            &mut data as *mut _ as usize,
+        );
+        if res == 0 {
+            Ok(data)
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_read_1b_at_handle(handle: usize, offset: usize, retaddr: usize) -> Option<usize> {
+    unsafe {
+        assert!(context::is_writable_from_current_context(retaddr, 1));
+        let handle = retrieve_handle(handle, false);
+        let mut b = [0; 1];
+        match syscall_read_handle_impl(&*FS, handle, offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u8) = b[0];
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Reads two bytes from the file opened as `handle` at offset `offset` (`offset` being considered
+/// as a number of 2-byte words)
+pub fn read_2b_at_handle(handle: fs::Handle, offset: usize) -> Result<u16, fs::Error> {
+    unsafe {
+        let mut data = 0;
+        let res = syscall(
+            Syscall::FsRead2bHandle,
+            handle.0,
+            offset,
+            &mut data as *mut _ as usize,
+        );
+        if res == 0 {
+            Ok(data)
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_read_2b_at_handle(handle: usize, offset: usize, retaddr: usize) -> Option<usize> {
+    unsafe {
+        assert!(retaddr & 1 == 0);
+        assert!(context::is_writable_from_current_context(retaddr, 2));
+        let handle = retrieve_handle(handle, false);
+        let mut b = [0; 2];
+        match syscall_read_handle_impl(&*FS, handle, 2 * offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u16) = ptr::read_unaligned(&b[0] as *const u8 as *const u16);
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Reads four bytes from the file opened as `handle` at offset `offset` (`offset` being
+/// considered as a number of 4-byte words)
+pub fn read_4b_at_handle(handle: fs::Handle, offset: usize) -> Result<u32, fs::Error> {
+    unsafe {
+        let mut data = 0;
+        let res = syscall(
+            Syscall::FsRead4bHandle,
+            handle.0,
+            offset,
+            &mut data as *mut _ as usize,
+        );
+        if res == 0 {
+            Ok(data)
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_read_4b_at_handle(handle: usize, offset: usize, retaddr: usize) -> Option<usize> {
+    unsafe {
+        assert!(retaddr & 3 == 0);
+        assert!(context::is_writable_from_current_context(retaddr, 4));
+        let handle = retrieve_handle(handle, false);
+        let mut b = [0; 4];
+        match syscall_read_handle_impl(&*FS, handle, 4 * offset, &mut b) {
+            Ok(()) => {
+                *(retaddr as *mut u32) = ptr::read_unaligned(&b[0] as *const u8 as *const u32);
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Writes byte `data` to the file opened as `handle` at offset `offset`
+pub fn write_1b_at_handle(handle: fs::Handle, offset: usize, data: u8) -> Result<(), fs::Error> {
+    unsafe {
+        let res = syscall(Syscall::FsWrite1bHandle, handle.0, offset, data as usize);
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_write_1b_at_handle(handle: usize, offset: usize, data: usize) -> Option<usize> {
+    unsafe {
+        let handle = retrieve_handle(handle, true);
+        match (*FS).edit_handle_at(handle, offset, &[data as u8]) {
+            Ok(()) => Some(0),
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Writes two bytes `data` to the file opened as `handle` at offset `offset` (`offset` being
+/// considered as a number of 2-byte words)
+pub fn write_2b_at_handle(handle: fs::Handle, offset: usize, data: u16) -> Result<(), fs::Error> {
+    unsafe {
+        let res = syscall(
+            Syscall::FsWrite2bHandle,
+            handle.0,
+            2 * offset,
+            data as usize,
+        );
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_write_2b_at_handle(handle: usize, offset: usize, data: usize) -> Option<usize> {
+    unsafe {
+        let handle = retrieve_handle(handle, true);
+        let d: [u8; 2] = mem::transmute(data as u16);
+        match (*FS).edit_handle_at(handle, offset, &d) {
+            Ok(()) => Some(0),
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Writes four bytes `data` to the file opened as `handle` at offset `offset` (`offset` being
+/// considered as a number of 4-byte words)
+pub fn write_4b_at_handle(handle: fs::Handle, offset: usize, data: u32) -> Result<(), fs::Error> {
+    unsafe {
+        let res = syscall(
+            Syscall::FsWrite4bHandle,
+            handle.0,
+            4 * offset,
+            data as usize,
+        );
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_write_4b_at_handle(handle: usize, offset: usize, data: usize) -> Option<usize> {
+    unsafe {
+        let handle = retrieve_handle(handle, true);
+        let d: [u8; 4] = mem::transmute(data as u32);
+        match (*FS).edit_handle_at(handle, offset, &d) {
+            Ok(()) => Some(0),
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
 /// Writes `data` as the new file named `tag`
 pub fn write(tag: &[u8], data: &[u8]) -> Result<(), fs::Error> {
     unsafe {
@@ -467,6 +804,169 @@ pub fn syscall_write(tagaddr: usize, bufptr: usize, buflen: usize) -> Option<usi
     }
 }
 
+/// Writes `data` as the new file named `tag`, unless a sector would have to be defragmented first
+pub fn write_nodefrag(tag: &[u8], data: &[u8]) -> Result<(), fs::Error> {
+    unsafe {
+        let t = pass_tag(tag);
+        let res = syscall(
+            Syscall::FsWriteNoDefrag,
+            t.as_ptr() as usize,
+            data.as_ptr() as usize,
+            data.len(),
+        );
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_write_nodefrag(tagaddr: usize, bufptr: usize, buflen: usize) -> Option<usize> {
+    unsafe {
+        assert!(context::is_readable_from_current_context(bufptr, buflen));
+        let tag = retrieve_tag(tagaddr);
+        assert!(filename::can_write(CURRENT_CONTEXT.ctxid(), tag) && !filename::is_applet(tag));
+        let res = (*FS).write_nodefrag(tag, slice::from_raw_parts(bufptr as *const u8, buflen));
+        Some(match res {
+            Ok(()) => 0,
+            Err(e) => fs_error_to_usize(e),
+        })
+    }
+}
+
+/// Creates the file `tag`, made of `len` zeros, without writing them out
+pub fn create_zeroed(tag: &[u8], len: usize) -> Result<(), fs::Error> {
+    unsafe {
+        let t = pass_tag(tag);
+        let res = syscall(Syscall::FsCreateZeroed, t.as_ptr() as usize, len, 0);
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_create_zeroed(tagaddr: usize, len: usize, _: usize) -> Option<usize> {
+    unsafe {
+        let tag = retrieve_tag(tagaddr);
+        assert!(filename::can_write(CURRENT_CONTEXT.ctxid(), tag) && !filename::is_applet(tag));
+        let res = (*FS).create_zeroed(tag, len);
+        Some(match res {
+            Ok(()) => 0,
+            Err(e) => fs_error_to_usize(e),
+        })
+    }
+}
+
+/// Writes out the zeros of the zeroed file `tag`, so that it can be read in place
+pub fn materialize(tag: &[u8]) -> Result<(), fs::Error> {
+    unsafe {
+        let t = pass_tag(tag);
+        let res = syscall(Syscall::FsMaterialize, t.as_ptr() as usize, 0, 0);
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_materialize(tagaddr: usize, _: usize, _: usize) -> Option<usize> {
+    unsafe {
+        let tag = retrieve_tag(tagaddr);
+        assert!(filename::can_write(CURRENT_CONTEXT.ctxid(), tag));
+        Some(match (*FS).materialize(tag) {
+            Ok(()) => 0,
+            Err(e) => fs_error_to_usize(e),
+        })
+    }
+}
+
+/// Reserves `size` bytes of flash that can be written without defragmenting (only allowed to the
+/// runtime environment and the installer)
+pub fn reserve(size: usize) -> Result<fs::Reservation, fs::Error> {
+    unsafe {
+        let mut handle = 0;
+        let res = syscall(
+            Syscall::FsReserve,
+            size,
+            &mut handle as *mut usize as usize,
+            0,
+        );
+        if res == 0 {
+            Ok(fs::Reservation(handle))
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_reserve(size: usize, retaddr: usize, _: usize) -> Option<usize> {
+    unsafe {
+        assert!(filename::can_manage(CURRENT_CONTEXT.ctxid()));
+        assert!(context::is_writable_from_current_context(
+            retaddr,
+            mem::size_of::<usize>()
+        ));
+        match (*FS).reserve(size) {
+            Ok(fs::Reservation(handle)) => {
+                *(retaddr as *mut usize) = handle;
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
+/// Releases the space a reservation still holds (only allowed to the runtime environment and the
+/// installer)
+pub fn release(reservation: fs::Reservation) {
+    unsafe {
+        syscall(Syscall::FsRelease, reservation.0, 0, 0);
+    }
+}
+
+pub fn syscall_release(handle: usize, _: usize, _: usize) -> Option<usize> {
+    unsafe {
+        assert!(filename::can_manage(CURRENT_CONTEXT.ctxid()));
+        (*FS).release(fs::Reservation(handle));
+        Some(0)
+    }
+}
+
+/// Empties the sparsest sectors into the others, returning how many sectors were freed (only
+/// allowed to the runtime environment and the installer)
+pub fn compact() -> Result<usize, fs::Error> {
+    unsafe {
+        let mut freed = 0;
+        let res = syscall(Syscall::FsCompact, &mut freed as *mut usize as usize, 0, 0);
+        if res == 0 {
+            Ok(freed)
+        } else {
+            Err(usize_to_fs_error(res))
+        }
+    }
+}
+
+pub fn syscall_compact(retaddr: usize, _: usize, _: usize) -> Option<usize> {
+    unsafe {
+        assert!(filename::can_manage(CURRENT_CONTEXT.ctxid()));
+        assert!(context::is_writable_from_current_context(
+            retaddr,
+            mem::size_of::<usize>()
+        ));
+        match (*FS).compact() {
+            Ok(freed) => {
+                *(retaddr as *mut usize) = freed;
+                Some(0)
+            }
+            Err(e) => Some(fs_error_to_usize(e)),
+        }
+    }
+}
+
 /// Writes `data` as an applet under tag `tag`
 pub fn write_applet(tag: &[u8], data: &[u8]) -> ! {
     unsafe {
@@ -562,9 +1062,9 @@ pub fn syscall_length(ptr: usize, len: usize, lenret: usize) -> Option<usize> {
         );
         let tag = slice::from_raw_parts(ptr as *const u8, len);
         assert!(filename::can_read(CURRENT_CONTEXT.ctxid(), tag));
-        match (*FS).read(tag) {
-            Ok(b) => {
-                ptr::write_unaligned(lenret as *mut usize, b.len());
+        match (*FS).length(tag) {
+            Ok(len) => {
+                ptr::write_unaligned(lenret as *mut usize, len);
                 Some(0)
             }
             Err(e) => Some(fs_error_to_usize(e)),
@@ -31,21 +31,38 @@ mod fs;
 mod remotecall;
 mod test;
 mod usart;
+pub use self::fs::close as fs_close;
+pub use self::fs::compact as fs_compact;
+pub use self::fs::create_zeroed as fs_create_zeroed;
 pub use self::fs::erase as fs_erase;
 pub use self::fs::erase_applet as fs_erase_applet;
 pub use self::fs::exists as fs_exists;
 pub use self::fs::length as fs_length;
+pub use self::fs::materialize as fs_materialize;
+pub use self::fs::open as fs_open;
 pub use self::fs::read as fs_read;
 pub use self::fs::read_1b_at as fs_read_1b_at;
+pub use self::fs::read_1b_at_handle as fs_read_1b_at_handle;
 pub use self::fs::read_2b_at as fs_read_2b_at;
+pub use self::fs::read_2b_at_handle as fs_read_2b_at_handle;
 pub use self::fs::read_4b_at as fs_read_4b_at;
+pub use self::fs::read_4b_at_handle as fs_read_4b_at_handle;
 pub use self::fs::read_inplace as fs_read_inplace;
+pub use self::fs::release as fs_release;
+pub use self::fs::reserve as fs_reserve;
 pub use self::fs::write as fs_write;
 pub use self::fs::write_1b_at as fs_write_1b_at;
+pub use self::fs::write_1b_at_handle as fs_write_1b_at_handle;
 pub use self::fs::write_2b_at as fs_write_2b_at;
+pub use self::fs::write_2b_at_handle as fs_write_2b_at_handle;
 pub use self::fs::write_4b_at as fs_write_4b_at;
+pub use self::fs::write_4b_at_handle as fs_write_4b_at_handle;
 pub use self::fs::write_applet as fs_write_applet;
-pub use self::fs::{privileged_fs_init, privileged_get_flash, FsInitError};
+pub use self::fs::write_nodefrag as fs_write_nodefrag;
+pub use self::fs::HANDLES_PER_CONTEXT as FS_HANDLES_PER_CONTEXT;
+pub use self::fs::{
+    privileged_fs_init, privileged_fs_init_with, privileged_get_flash, FsInitError,
+};
 pub use self::remotecall::remote_call;
 pub use self::test::test;
 pub use self::usart::output as usart_output;
@@ -100,6 +117,34 @@ pub enum Syscall {
     FsWrite2b = 16,
     /// Writes four bytes to a file at some offset
     FsWrite4b = 17,
+    /// Writes a file from a buffer, unless a sector would have to be defragmented
+    FsWriteNoDefrag = 18,
+    /// Reserves space that can be written without defragmenting
+    FsReserve = 19,
+    /// Releases a reservation
+    FsRelease = 20,
+    /// Empties sparse sectors into others
+    FsCompact = 21,
+    /// Creates a zero-filled file without writing its zeros
+    FsCreateZeroed = 22,
+    /// Opens a file for accessing it through a handle
+    FsOpen = 23,
+    /// Closes a handle
+    FsClose = 24,
+    /// Reads one byte from an opened file at some offset
+    FsRead1bHandle = 25,
+    /// Reads two bytes from an opened file at some offset
+    FsRead2bHandle = 26,
+    /// Reads four bytes from an opened file at some offset
+    FsRead4bHandle = 27,
+    /// Writes one byte to an opened file at some offset
+    FsWrite1bHandle = 28,
+    /// Writes two bytes to an opened file at some offset
+    FsWrite2bHandle = 29,
+    /// Writes four bytes to an opened file at some offset
+    FsWrite4bHandle = 30,
+    /// Writes out the zeros of a zeroed file
+    FsMaterialize = 31,
 }
 
 impl Syscall {
@@ -124,6 +169,20 @@ impl Syscall {
             15 => Some(Syscall::FsWrite1b),
             16 => Some(Syscall::FsWrite2b),
             17 => Some(Syscall::FsWrite4b),
+            18 => Some(Syscall::FsWriteNoDefrag),
+            19 => Some(Syscall::FsReserve),
+            20 => Some(Syscall::FsRelease),
+            21 => Some(Syscall::FsCompact),
+            22 => Some(Syscall::FsCreateZeroed),
+            23 => Some(Syscall::FsOpen),
+            24 => Some(Syscall::FsClose),
+            25 => Some(Syscall::FsRead1bHandle),
+            26 => Some(Syscall::FsRead2bHandle),
+            27 => Some(Syscall::FsRead4bHandle),
+            28 => Some(Syscall::FsWrite1bHandle),
+            29 => Some(Syscall::FsWrite2bHandle),
+            30 => Some(Syscall::FsWrite4bHandle),
+            31 => Some(Syscall::FsMaterialize),
             _ => None,
         }
     }
@@ -150,6 +209,20 @@ impl Into<SyscallFn> for Syscall {
             Syscall::FsWrite1b => fs::syscall_write_1b_at,
             Syscall::FsWrite2b => fs::syscall_write_2b_at,
             Syscall::FsWrite4b => fs::syscall_write_4b_at,
+            Syscall::FsWriteNoDefrag => fs::syscall_write_nodefrag,
+            Syscall::FsReserve => fs::syscall_reserve,
+            Syscall::FsRelease => fs::syscall_release,
+            Syscall::FsCompact => fs::syscall_compact,
+            Syscall::FsCreateZeroed => fs::syscall_create_zeroed,
+            Syscall::FsOpen => fs::syscall_open,
+            Syscall::FsClose => fs::syscall_close,
+            Syscall::FsRead1bHandle => fs::syscall_read_1b_at_handle,
+            Syscall::FsRead2bHandle => fs::syscall_read_2b_at_handle,
+            Syscall::FsRead4bHandle => fs::syscall_read_4b_at_handle,
+            Syscall::FsWrite1bHandle => fs::syscall_write_1b_at_handle,
+            Syscall::FsWrite2bHandle => fs::syscall_write_2b_at_handle,
+            Syscall::FsWrite4bHandle => fs::syscall_write_4b_at_handle,
+            Syscall::FsMaterialize => fs::syscall_materialize,
         }
     }
 }
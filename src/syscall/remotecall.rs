@@ -23,7 +23,7 @@
 //! Module for the syscall allowing to call functions in other contexts
 
 use context;
-use syscall::{syscall_saveall, Syscall};
+use syscall::{fs, syscall_saveall, Syscall};
 
 /// Call function in context syscall
 pub fn remote_call(c: context::ContextID, arg1: usize, arg2: usize) -> usize {
@@ -48,6 +48,11 @@ pub fn syscall_remote_call(cid: usize, arg1: usize, arg2: usize) -> Option<usize
 
 /// Syscall to return a return value to the calling context.
 pub fn syscall_remote_result(res: usize, _: usize, _: usize) -> Option<usize> {
+    // Unless it is still running further down the stack, the context is done with its files
+    let ctxt = context::CURRENT_CONTEXT.ctxid();
+    if !context::is_stacked(ctxt) {
+        unsafe { fs::privileged_release_handles(ctxt.id()) };
+    }
     context::pop();
     Some(res)
 }
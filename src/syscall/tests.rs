@@ -188,6 +188,32 @@ speculate! {
 
                 assert_eq!(syscall::fs_read(filename, &mut buf).unwrap_err(), Error::NoSuchTag);
                 assert!(!syscall::fs_exists(filename));
+
+                syscall::fs_create_zeroed(filename, 6).unwrap();
+
+                buf = [1; 8];
+                assert_eq!(syscall::fs_length(filename).unwrap(), 6);
+                syscall::fs_read(filename, &mut buf).unwrap();
+                assert_eq!(&buf as &[u8], b"\0\0\0\0\0\0\x01\x01");
+                assert_eq!(unsafe { syscall::fs_read_inplace(filename) }.unwrap_err(), Error::Zeroed);
+                syscall::fs_materialize(filename).unwrap();
+                assert_eq!(unsafe { syscall::fs_read_inplace(filename) }.unwrap(), &[0; 6]);
+
+                syscall::fs_write_2b_at(filename, 1, 0x4242).unwrap();
+                assert_eq!(syscall::fs_write_2b_at(filename, 5, 0).unwrap_err(), Error::OutOfBounds);
+
+                assert_eq!(syscall::fs_read_1b_at(filename, 0).unwrap(), 0);
+                assert_eq!(syscall::fs_read_1b_at(filename, 2).unwrap(), 0x42);
+                assert_eq!(syscall::fs_length(filename).unwrap(), 6);
+
+                let handle = syscall::fs_open(filename).unwrap();
+                syscall::fs_write_1b_at_handle(handle, 5, 0x12).unwrap();
+                assert_eq!(syscall::fs_read_2b_at_handle(handle, 1).unwrap(), 0x4242);
+                assert_eq!(syscall::fs_read_1b_at_handle(handle, 5).unwrap(), 0x12);
+                assert_eq!(syscall::fs_read_1b_at(filename, 5).unwrap(), 0x12);
+                syscall::fs_erase(filename).unwrap();
+                assert_eq!(syscall::fs_read_1b_at_handle(handle, 0).unwrap_err(), Error::NoSuchTag);
+                syscall::fs_close(handle);
             });
         }
     }